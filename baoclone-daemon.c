@@ -0,0 +1,97 @@
+/*
+ * Daemon for programming many radios: accepts jobs over a Unix socket.
+ *
+ * Copyright (C) 2013-2023 Serge Vakulenko, KK6ABQ
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   1. Redistributions of source code must retain the above copyright notice,
+ *      this list of conditions and the following disclaimer.
+ *   2. Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in the
+ *      documentation and/or other materials provided with the distribution.
+ *   3. The name of the author may not be used to endorse or promote products
+ *      derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO
+ * EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#include <getopt.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "daemon.h"
+#include "radio.h"
+#include "util.h"
+
+void usage()
+{
+    fprintf(stderr, _("BaoClone Daemon, Version %s\n"), program_version);
+    fprintf(stderr, _("%s\n"), program_copyright);
+    fprintf(stderr, _("Usage:\n"));
+    fprintf(stderr, _("    baoclone-daemon [-v] [-s socket]\n"));
+    fprintf(stderr, _("                          Run jobs for radios, submitted as JSON lines\n"));
+    fprintf(stderr, _("                          over a Unix socket.  See README.txt.\n"));
+    fprintf(stderr, _("Options:\n"));
+    fprintf(stderr, _("    -s socket             Name of the socket, by default\n"));
+    fprintf(stderr, _("                          $XDG_RUNTIME_DIR/baoclone.sock or\n"));
+    fprintf(stderr, _("                          /tmp/baoclone-<uid>/baoclone.sock.\n"));
+    fprintf(stderr, _("    -v                    Trace requests and serial protocol.\n"));
+    exit(-1);
+}
+
+static void stop(int sig)
+{
+    daemon_stop();
+}
+
+int main(int argc, char **argv)
+{
+    const char *socket_path = NULL;
+
+    // Set locale and message catalogs.
+    setlocale(LC_ALL, "");
+    bindtextdomain("baoclone", "/usr/local/share/locale");
+    textdomain("baoclone");
+
+    trace_flag = 0;
+    for (;;) {
+        switch (getopt(argc, argv, "vs:")) {
+        case 'v':
+            trace_flag = true;
+            continue;
+        case 's':
+            socket_path = optarg;
+            continue;
+        default:
+            usage();
+        case EOF:
+            break;
+        }
+        break;
+    }
+    if (optind != argc)
+        usage();
+    if (!socket_path)
+        socket_path = daemon_socket_name();
+
+    // Stop on a signal; a client which has gone must not kill the daemon.
+    signal(SIGINT, stop);
+    signal(SIGTERM, stop);
+    signal(SIGPIPE, SIG_IGN);
+
+    printf(_("Listening on %s.\n"), socket_path);
+    fflush(stdout);
+    return daemon_serve(socket_path);
+}
@@ -30,6 +30,7 @@
 #include <string.h>
 #include <unistd.h>
 
+#include "latency.h"
 #include "radio.h"
 #include "util.h"
 
@@ -42,93 +43,85 @@ static const char *OFF_ON[] = { "Off", "On" };
 //
 // Print a generic information about the device.
 //
-static void bf888s_print_version(FILE *out, int show_version)
+static void bf888s_print_version(radio_session_t *s, FILE *out, int show_version)
 {
     // Nothing to print.
 }
 
 //
-// Read block of data, up to 8 bytes.
-// Halt the program on any error.
+// Read block of data, 8 bytes or as calibrated.
+// Return 0 on any error.
 //
-static void read_block(int fd, int start, unsigned char *data, int nbytes)
+static int try_read_block(radio_session_t *s, int start, unsigned char *data, int nbytes)
 {
-    unsigned char cmd[4], reply[4];
+    unsigned char reply[4];
     int addr, len;
 
     // Send command.
-    cmd[0] = 'R';
-    cmd[1] = start >> 8;
-    cmd[2] = start;
-    cmd[3] = nbytes;
-    serial_write(fd, cmd, 4);
+    radio_send_frame(s, 'R', start, NULL, nbytes);
 
     // Read reply.
-    if (serial_read(fd, reply, 4) != 4) {
+    if (radio_read(s, LAT_READ_HEADER, reply, 4) != 4) {
         fprintf(stderr, "Radio refused to send block 0x%04x.\n", start);
-        exit(-1);
+        return 0;
     }
     addr = reply[1] << 8 | reply[2];
     if (reply[0] != 'W' || addr != start || reply[3] != nbytes) {
         fprintf(stderr, "Bad reply for block 0x%04x of %d bytes: %02x-%02x-%02x-%02x\n", start,
                 nbytes, reply[0], reply[1], reply[2], reply[3]);
-        exit(-1);
+        return 0;
     }
 
     // Read data.
-    len = serial_read(fd, data, 8);
+    len = radio_read(s, LAT_READ_DATA, data, nbytes);
     if (len != nbytes) {
         fprintf(stderr, "Reading block 0x%04x: got only %d bytes.\n", start, len);
-        exit(-1);
+        return 0;
     }
 
     // Get acknowledge.
-    serial_write(fd, "\x06", 1);
-    if (serial_read(fd, reply, 1) != 1) {
+    serial_write(s->port, "\x06", 1);
+    if (radio_read(s, LAT_READ_ACK, reply, 1) != 1) {
         fprintf(stderr, "No acknowledge after block 0x%04x.\n", start);
-        exit(-1);
+        return 0;
     }
     if (reply[0] != 0x06) {
         fprintf(stderr, "Bad acknowledge after block 0x%04x: %02x\n", start, reply[0]);
-        exit(-1);
+        return 0;
     }
     if (trace_flag) {
         printf("# Read 0x%04x: ", start);
         print_hex(data, nbytes);
         printf("\n");
     } else {
-        ++radio_progress;
-        if (radio_progress % 4 == 0) {
+        ++s->progress;
+        if (s->progress % 4 == 0) {
             fprintf(stderr, "#");
             fflush(stderr);
         }
     }
+    return 1;
 }
 
 //
-// Write block of data, up to 8 bytes.
-// Halt the program on any error.
+// Write block of data, 8 bytes or as calibrated.
+// Return 0 on any error.
 //
-static void write_block(int fd, int start, const unsigned char *data, int nbytes)
+static int try_write_block(radio_session_t *s, int start, const unsigned char *data, int nbytes)
 {
-    unsigned char cmd[4], reply;
+    unsigned char reply;
 
-    // Send command.
-    cmd[0] = 'W';
-    cmd[1] = start >> 8;
-    cmd[2] = start;
-    cmd[3] = nbytes;
-    serial_write(fd, cmd, 4);
-    serial_write(fd, data, nbytes);
+    // Send command and data in one write: one USB transfer.
+    radio_send_frame(s, 'W', start, data, nbytes);
 
     // Get acknowledge.
-    if (serial_read(fd, &reply, 1) != 1) {
+    if (radio_read(s, LAT_WRITE_ACK, &reply, 1) != 1) {
         fprintf(stderr, "No acknowledge after block 0x%04x.\n", start);
-        exit(-1);
+        return 0;
     }
     if (reply != 0x06) {
         fprintf(stderr, "Bad acknowledge after block 0x%04x: %02x\n", start, reply);
-        exit(-1);
+        return 0;
     }
 
     if (trace_flag) {
@@ -136,43 +129,64 @@ static void write_block(int fd, int start, const unsigned char *data, int nbytes
         print_hex(data, nbytes);
         printf("\n");
     } else {
-        ++radio_progress;
-        if (radio_progress % 4 == 0) {
+        ++s->progress;
+        if (s->progress % 4 == 0) {
             fprintf(stderr, "#");
             fflush(stderr);
         }
     }
+    return 1;
+}
+
+//
+// Read memory range in blocks of 8 bytes, or as calibrated.
+// Return 0 when a block failed.
+//
+static int read_range(radio_session_t *s, int start, int end)
+{
+    int addr, nbytes;
+
+    for (addr = start; addr < end; addr += nbytes) {
+        nbytes = radio_block_size(s, 0, addr, end);
+        if (!radio_read_block(s, addr, &s->mem[addr], nbytes))
+            return 0;
+    }
+    return 1;
+}
+
+//
+// Write changed blocks of memory range.
+// Return 0 when a block failed.
+//
+static int write_range(radio_session_t *s, int start, int end)
+{
+    int addr, nbytes;
+
+    for (addr = start; addr < end; addr += nbytes) {
+        nbytes = radio_block_size(s, 1, addr, end);
+        if (radio_block_dirty(s, addr, nbytes) && !radio_write_block(s, addr, &s->mem[addr], nbytes))
+            return 0;
+    }
+    return 1;
 }
 
 //
 // Read memory image from the device.
 //
-static void bf888s_download()
+static int bf888s_download(radio_session_t *s)
 {
-    int addr;
-
-    memset(radio_mem, 0xff, 0x400);
-    for (addr = 0x10; addr < 0x110; addr += 8)
-        read_block(radio_port, addr, &radio_mem[addr], 8);
-    for (addr = 0x2b0; addr < 0x2c0; addr += 8)
-        read_block(radio_port, addr, &radio_mem[addr], 8);
-    for (addr = 0x3c0; addr < 0x3e0; addr += 8)
-        read_block(radio_port, addr, &radio_mem[addr], 8);
+    memset(s->mem, 0xff, 0x400);
+    return read_range(s, 0x10, 0x110) && read_range(s, 0x2b0, 0x2c0) &&
+           read_range(s, 0x3c0, 0x3e0);
 }
 
 //
 // Write memory image to the device.
 //
-static void bf888s_upload(int cont_flag)
+static int bf888s_upload(radio_session_t *s, int cont_flag)
 {
-    int addr;
-
-    for (addr = 0x10; addr < 0x110; addr += 8)
-        write_block(radio_port, addr, &radio_mem[addr], 8);
-    for (addr = 0x2b0; addr < 0x2c0; addr += 8)
-        write_block(radio_port, addr, &radio_mem[addr], 8);
-    for (addr = 0x3c0; addr < 0x3e0; addr += 8)
-        write_block(radio_port, addr, &radio_mem[addr], 8);
+    return write_range(s, 0x10, 0x110) && write_range(s, 0x2b0, 0x2c0) &&
+           write_range(s, 0x3c0, 0x3e0);
 }
 
 static void decode_squelch(uint16_t bcd, int *ctcs, int *dcs)
@@ -256,11 +270,11 @@ typedef struct {
     uint8_t _u3[3];
 } memory_channel_t;
 
-static void decode_channel(int i, int *rx_hz, int *tx_hz, int *rx_ctcs, int *tx_ctcs, int *rx_dcs,
-                           int *tx_dcs, int *lowpower, int *wide, int *scan, int *bcl,
-                           int *scramble)
+static void decode_channel(radio_session_t *s, int i, int *rx_hz, int *tx_hz, int *rx_ctcs,
+                           int *tx_ctcs, int *rx_dcs, int *tx_dcs, int *lowpower, int *wide,
+                           int *scan, int *bcl, int *scramble)
 {
-    memory_channel_t *ch = i + (memory_channel_t *)&radio_mem[0x10];
+    memory_channel_t *ch = i + (memory_channel_t *)&s->mem[0x10];
 
     *rx_hz = *tx_hz = *rx_ctcs = *tx_ctcs = *rx_dcs = *tx_dcs = 0;
     if (ch->rxfreq == 0 || bcd_invalid(ch->rxfreq))
@@ -282,10 +296,10 @@ static void decode_channel(int i, int *rx_hz, int *tx_hz, int *rx_ctcs, int *tx_
     *scramble = !ch->noscr;
 }
 
-static void setup_channel(int i, double rx_mhz, double tx_mhz, int rq, int tq, int highpower,
-                          int wide, int scan, int bcl, int scramble)
+static void setup_channel(radio_session_t *s, int i, double rx_mhz, double tx_mhz, int rq, int tq,
+                          int highpower, int wide, int scan, int bcl, int scramble)
 {
-    memory_channel_t *ch = i + (memory_channel_t *)&radio_mem[0x10];
+    memory_channel_t *ch = i + (memory_channel_t *)&s->mem[0x10];
 
     ch->rxfreq    = int_to_bcd((int)(rx_mhz * 100000.0));
     ch->txfreq    = int_to_bcd((int)(tx_mhz * 100000.0));
@@ -361,7 +375,7 @@ typedef struct {
 //
 // Print full information about the device configuration.
 //
-static void bf888s_print_config(FILE *out, int verbose)
+static void bf888s_print_config(radio_session_t *s, FILE *out, int verbose)
 {
     int i;
 
@@ -386,7 +400,7 @@ static void bf888s_print_config(FILE *out, int verbose)
         int rx_hz, tx_hz, rx_ctcs, tx_ctcs, rx_dcs, tx_dcs;
         int lowpower, wide, scan, bcl, scramble;
 
-        decode_channel(i, &rx_hz, &tx_hz, &rx_ctcs, &tx_ctcs, &rx_dcs, &tx_dcs, &lowpower, &wide,
+        decode_channel(s, i, &rx_hz, &tx_hz, &rx_ctcs, &tx_ctcs, &rx_dcs, &tx_dcs, &lowpower, &wide,
                        &scan, &bcl, &scramble);
         if (rx_hz == 0) {
             // Channel is disabled
@@ -407,8 +421,8 @@ static void bf888s_print_config(FILE *out, int verbose)
         print_squelch_tones(out, 0);
 
     // Print other settings.
-    settings_t *mode        = (settings_t *)&radio_mem[0x2b0];
-    extra_settings_t *extra = (extra_settings_t *)&radio_mem[0x3c0];
+    settings_t *mode        = (settings_t *)&s->mem[0x2b0];
+    extra_settings_t *extra = (extra_settings_t *)&s->mem[0x3c0];
     fprintf(out, "\n");
 
     if (verbose) {
@@ -488,7 +502,7 @@ static void bf888s_print_config(FILE *out, int verbose)
 // Read memory image from the binary file.
 // Try to be compatible with Baofeng BF-480 software.
 //
-static void bf888s_read_image(FILE *img, unsigned char *ident)
+static void bf888s_read_image(radio_session_t *s, FILE *img, unsigned char *ident)
 {
     char buf[8];
 
@@ -501,36 +515,36 @@ static void bf888s_read_image(FILE *img, unsigned char *ident)
         fprintf(stderr, "Error reading header.\n");
         exit(-1);
     }
-    if (fread(&radio_mem[0x10], 1, 0x3d0, img) != 0x3d0) {
+    if (fread(&s->mem[0x10], 1, 0x3d0, img) != 0x3d0) {
         fprintf(stderr, "Error reading image data.\n");
         exit(-1);
     }
 
     // Move 16 bytes from 0x370 to 0x2b0.
-    memcpy(radio_mem + 0x2b0, radio_mem + 0x370, 0x10);
-    memset(radio_mem + 0x370, 0xff, 0x10);
+    memcpy(s->mem + 0x2b0, s->mem + 0x370, 0x10);
+    memset(s->mem + 0x370, 0xff, 0x10);
 }
 
 //
 // Save memory image to the binary file.
 // Try to be compatible with Baofeng BF-480 software.
 //
-static void bf888s_save_image(FILE *img)
+static void bf888s_save_image(radio_session_t *s, FILE *img)
 {
-    fwrite(radio_ident, 1, 8, img);
+    fwrite(s->ident, 1, 8, img);
     fwrite("\xff\xff\xff\xff\xff\xff\xff\xff", 1, 8, img);
-    fwrite(&radio_mem[0x10], 1, 0x2b0 - 0x10, img);
+    fwrite(&s->mem[0x10], 1, 0x2b0 - 0x10, img);
     fwrite("\xff\xff\xff\xff\xff\xff\xff\xff", 1, 8, img);
     fwrite("\xff\xff\xff\xff\xff\xff\xff\xff", 1, 8, img);
-    fwrite(&radio_mem[0x2c0], 1, 0x370 - 0x2c0, img);
-    fwrite(&radio_mem[0x2b0], 1, 0x10, img);
-    fwrite(&radio_mem[0x380], 1, 0x3e0 - 0x380, img);
+    fwrite(&s->mem[0x2c0], 1, 0x370 - 0x2c0, img);
+    fwrite(&s->mem[0x2b0], 1, 0x10, img);
+    fwrite(&s->mem[0x380], 1, 0x3e0 - 0x380, img);
 }
 
-static void bf888s_parse_parameter(char *param, char *value)
+static void bf888s_parse_parameter(radio_session_t *s, char *param, char *value)
 {
-    settings_t *mode        = (settings_t *)&radio_mem[0x2b0];
-    extra_settings_t *extra = (extra_settings_t *)&radio_mem[0x3c0];
+    settings_t *mode        = (settings_t *)&s->mem[0x2b0];
+    extra_settings_t *extra = (extra_settings_t *)&s->mem[0x3c0];
     int i;
 
     if (strcasecmp("Radio", param) == 0) {
@@ -637,7 +651,7 @@ static int is_valid_frequency(int mhz)
 // Parse table header.
 // Return table id, or 0 in case of error.
 //
-static int bf888s_parse_header(char *line)
+static int bf888s_parse_header(radio_session_t *s, char *line)
 {
     if (strncasecmp(line, "Channel", 7) == 0)
         return 'C';
@@ -650,7 +664,7 @@ static int bf888s_parse_header(char *line)
 // Start_flag is 1 for the first table row.
 // Return 0 on failure.
 //
-static int bf888s_parse_row(int table_id, int first_row, char *line)
+static int bf888s_parse_row(radio_session_t *s, int table_id, int first_row, char *line)
 {
     char num_str[256], rxfreq_str[256], offset_str[256], rq_str[256];
     char tq_str[256], power_str[256], wide_str[256], scan_str[256];
@@ -727,10 +741,10 @@ static int bf888s_parse_row(int table_id, int first_row, char *line)
         // On first entry, erase the channel table.
         int i;
         for (i = 0; i < NCHAN; i++) {
-            setup_channel(i, 0, 0, 0, 0, 1, 1, 0, 0, 0);
+            setup_channel(s, i, 0, 0, 0, 0, 1, 1, 0, 0, 0);
         }
     }
-    setup_channel(num - 1, rx_mhz, rx_mhz + txoff_mhz, rq, tq, highpower, wide, scan, bcl,
+    setup_channel(s, num - 1, rx_mhz, rx_mhz + txoff_mhz, rq, tq, highpower, wide, scan, bcl,
                   scramble);
     return 1;
 }
@@ -741,5 +755,6 @@ static int bf888s_parse_row(int table_id, int first_row, char *line)
 radio_device_t radio_bf888s = {
     "Baofeng BF-888S",   bf888s_download,      bf888s_upload,       bf888s_read_image,
     bf888s_save_image,   bf888s_print_version, bf888s_print_config, bf888s_parse_parameter,
-    bf888s_parse_header, bf888s_parse_row,
+    bf888s_parse_header, bf888s_parse_row,      NULL,                try_read_block,
+    try_write_block,     8,                    8,                   0x10,
 };
@@ -30,6 +30,7 @@
 #include <string.h>
 #include <unistd.h>
 
+#include "latency.h"
 #include "radio.h"
 #include "util.h"
 
@@ -47,44 +48,40 @@ static const char *SCAN_MODE[]  = { "Timeout", "Carrier", "Search" };
 //
 // Print a generic information about the device.
 //
-static void bft1_print_version(FILE *out, int show_version)
+static void bft1_print_version(radio_session_t *s, FILE *out, int show_version)
 {
     // Nothing to print.
 }
 
 //
-// Read block of data, up to 8 bytes.
-// Halt the program on any error.
+// Read block of data, 16 bytes or as calibrated.
+// Return 0 on any error.
 //
-static void read_block(int fd, int start, unsigned char *data, int nbytes)
+static int try_read_block(radio_session_t *s, int start, unsigned char *data, int nbytes)
 {
-    unsigned char cmd[4], reply[4];
+    unsigned char reply[4];
     int addr, len;
 
     // Send command.
-    cmd[0] = 'R';
-    cmd[1] = start >> 8;
-    cmd[2] = start;
-    cmd[3] = nbytes;
-    serial_write(fd, cmd, 4);
+    radio_send_frame(s, 'R', start, NULL, nbytes);
 
     // Read reply.
-    if (serial_read(fd, reply, 4) != 4) {
+    if (radio_read(s, LAT_READ_HEADER, reply, 4) != 4) {
         fprintf(stderr, "Radio refused to send block 0x%04x.\n", start);
-        exit(-1);
+        return 0;
     }
     addr = reply[1] << 8 | reply[2];
     if (reply[0] != 'W' || addr != start || reply[3] != nbytes) {
         fprintf(stderr, "Bad reply for block 0x%04x of %d bytes: %02x-%02x-%02x-%02x\n", start,
                 nbytes, reply[0], reply[1], reply[2], reply[3]);
-        exit(-1);
+        return 0;
     }
 
     // Read data.
-    len = serial_read(fd, data, nbytes);
+    len = radio_read(s, LAT_READ_DATA, data, nbytes);
     if (len != nbytes) {
         fprintf(stderr, "Reading block 0x%04x: got only %d bytes.\n", start, len);
-        exit(-1);
+        return 0;
     }
 
     if (trace_flag) {
@@ -92,38 +89,34 @@ static void read_block(int fd, int start, unsigned char *data, int nbytes)
         print_hex(data, nbytes);
         printf("\n");
     } else {
-        ++radio_progress;
-        if (radio_progress % 4 == 0) {
+        ++s->progress;
+        if (s->progress % 4 == 0) {
             fprintf(stderr, "#");
             fflush(stderr);
         }
     }
+    return 1;
 }
 
 //
-// Write block of data, up to 8 bytes.
-// Halt the program on any error.
+// Write block of data, 16 bytes or as calibrated.
+// Return 0 on any error.
 //
-static void write_block(int fd, int start, const unsigned char *data, int nbytes)
+static int try_write_block(radio_session_t *s, int start, const unsigned char *data, int nbytes)
 {
-    unsigned char cmd[4], reply;
+    unsigned char reply;
 
-    // Send command.
-    cmd[0] = 'W';
-    cmd[1] = start >> 8;
-    cmd[2] = start;
-    cmd[3] = nbytes;
-    serial_write(fd, cmd, 4);
-    serial_write(fd, data, nbytes);
+    // Send command and data in one write: one USB transfer.
+    radio_send_frame(s, 'W', start, data, nbytes);
 
     // Get acknowledge.
-    if (serial_read(fd, &reply, 1) != 1) {
+    if (radio_read(s, LAT_WRITE_ACK, &reply, 1) != 1) {
         fprintf(stderr, "No acknowledge after block 0x%04x.\n", start);
-        exit(-1);
+        return 0;
     }
     if (reply != 0x06) {
         fprintf(stderr, "Bad acknowledge after block 0x%04x: %02x\n", start, reply);
-        exit(-1);
+        return 0;
     }
 
     if (trace_flag) {
@@ -131,46 +124,56 @@ static void write_block(int fd, int start, const unsigned char *data, int nbytes
         print_hex(data, nbytes);
         printf("\n");
     } else {
-        ++radio_progress;
-        if (radio_progress % 4 == 0) {
+        ++s->progress;
+        if (s->progress % 4 == 0) {
             fprintf(stderr, "#");
             fflush(stderr);
         }
     }
+    return 1;
 }
 
 //
 // Read memory image from the device.
 //
-static void bft1_download()
+static int bft1_download(radio_session_t *s)
 {
-    int addr;
+    int addr, nbytes;
 
-    memset(radio_mem, 0xff, MEMSZ);
-    for (addr = 0; addr < MEMSZ; addr += BLKSZ)
-        read_block(radio_port, addr, &radio_mem[addr], BLKSZ);
+    memset(s->mem, 0xff, MEMSZ);
+    for (addr = 0; addr < MEMSZ; addr += nbytes) {
+        nbytes = radio_block_size(s, 0, addr, MEMSZ);
+        if (!radio_read_block(s, addr, &s->mem[addr], nbytes))
+            return 0;
+    }
+    return 1;
 }
 
 //
 // Write memory image to the device.
 //
-static void bft1_upload(int cont_flag)
+static int bft1_upload(radio_session_t *s, int cont_flag)
 {
-    int addr;
+    int addr, nbytes, retry;
     unsigned char reply[1];
 
-    for (addr = 0; addr < 0x180; addr += BLKSZ)
-        write_block(radio_port, addr, &radio_mem[addr], BLKSZ);
-
-    // 'Bye'.
-    serial_write(radio_port, "b", 1);
-    if (serial_read(radio_port, reply, 1) != 1) {
-        fprintf(stderr, "No acknowledge after upload.\n");
-        exit(-1);
+    for (addr = 0; addr < 0x180; addr += nbytes) {
+        nbytes = radio_block_size(s, 1, addr, 0x180);
+        if (radio_block_dirty(s, addr, nbytes) && !radio_write_block(s, addr, &s->mem[addr], nbytes))
+            return 0;
     }
-    if (reply[0] != 0x00) {
-        fprintf(stderr, "Bad acknowledge after upload: %02x\n", reply[0]);
-        exit(-1);
+
+    // 'Bye', retried like a block past the end of the image.
+    for (retry = 0;; retry++) {
+        serial_write(s->port, "b", 1);
+        if (serial_read(s->port, reply, 1) != 1)
+            fprintf(stderr, "No acknowledge after upload.\n");
+        else if (reply[0] != 0x00)
+            fprintf(stderr, "Bad acknowledge after upload: %02x\n", reply[0]);
+        else
+            return 1;
+        if (!radio_retry(s, 0x180, retry))
+            return 0;
     }
 }
 
@@ -300,10 +303,10 @@ static int channel_is_defined(memory_channel_t *ch)
     return 1;
 }
 
-static void decode_channel(int i, int *rx_hz, int *tx_hz, int *rx_ctcs, int *tx_ctcs, int *rx_dcs,
-                           int *tx_dcs, int *wide, int *scan)
+static void decode_channel(radio_session_t *s, int i, int *rx_hz, int *tx_hz, int *rx_ctcs,
+                           int *tx_ctcs, int *rx_dcs, int *tx_dcs, int *wide, int *scan)
 {
-    memory_channel_t *ch = i + (memory_channel_t *)&radio_mem[0];
+    memory_channel_t *ch = i + (memory_channel_t *)&s->mem[0];
 
     *rx_hz = *tx_hz = *rx_ctcs = *tx_ctcs = *rx_dcs = *tx_dcs = 0;
     if (!channel_is_defined(ch))
@@ -330,10 +333,10 @@ static void decode_channel(int i, int *rx_hz, int *tx_hz, int *rx_ctcs, int *tx_
     *scan = ch->scan;
 }
 
-static void setup_channel(int i, double rx_mhz, double tx_mhz, int rq, int tq, int rpol, int tpol,
-                          int wide, int scan)
+static void setup_channel(radio_session_t *s, int i, double rx_mhz, double tx_mhz, int rq, int tq,
+                          int rpol, int tpol, int wide, int scan)
 {
-    memory_channel_t *ch = i + (memory_channel_t *)&radio_mem[0x10];
+    memory_channel_t *ch = i + (memory_channel_t *)&s->mem[0x10];
     int txoff_mhz;
 
     int_to_bcd4(iround(rx_mhz * 100000.0 / 50) * 50, ch->rxfreq);
@@ -434,7 +437,7 @@ typedef struct {
 //
 // Print full information about the device configuration.
 //
-static void bft1_print_config(FILE *out, int verbose)
+static void bft1_print_config(radio_session_t *s, FILE *out, int verbose)
 {
     int i;
 
@@ -459,7 +462,7 @@ static void bft1_print_config(FILE *out, int verbose)
         if (i == 21 || i == 22)
             continue;
 
-        decode_channel(i, &rx_hz, &tx_hz, &rx_ctcs, &tx_ctcs, &rx_dcs, &tx_dcs, &wide, &scan);
+        decode_channel(s, i, &rx_hz, &tx_hz, &rx_ctcs, &tx_ctcs, &rx_dcs, &tx_dcs, &wide, &scan);
         if (rx_hz == 0) {
             // Channel is disabled
             continue;
@@ -482,7 +485,7 @@ static void bft1_print_config(FILE *out, int verbose)
         print_squelch_tones(out, 0);
 
     // Print other settings.
-    settings_t *mode = (settings_t *)&radio_mem[0x150];
+    settings_t *mode = (settings_t *)&s->mem[0x150];
     fprintf(out, "\n");
 
     // Current Channel
@@ -633,9 +636,9 @@ static void bft1_print_config(FILE *out, int verbose)
 // Read memory image from the binary file.
 // Try to be compatible with Baofeng BF-480 software.
 //
-static void bft1_read_image(FILE *img, unsigned char *ident)
+static void bft1_read_image(radio_session_t *s, FILE *img, unsigned char *ident)
 {
-    if (fread(&radio_mem[0], 1, MEMSZ, img) != MEMSZ) {
+    if (fread(&s->mem[0], 1, MEMSZ, img) != MEMSZ) {
         fprintf(stderr, "Error reading image data.\n");
         exit(-1);
     }
@@ -646,14 +649,14 @@ static void bft1_read_image(FILE *img, unsigned char *ident)
 // Save memory image to the binary file.
 // Try to be compatible with Baofeng BF-480 software.
 //
-static void bft1_save_image(FILE *img)
+static void bft1_save_image(radio_session_t *s, FILE *img)
 {
-    fwrite(radio_mem, 1, MEMSZ, img);
+    fwrite(s->mem, 1, MEMSZ, img);
 }
 
-static void bft1_parse_parameter(char *param, char *value)
+static void bft1_parse_parameter(radio_session_t *s, char *param, char *value)
 {
-    settings_t *mode = (settings_t *)&radio_mem[0x150];
+    settings_t *mode = (settings_t *)&s->mem[0x150];
     int i;
 
     if (strcasecmp("Radio", param) == 0) {
@@ -830,7 +833,7 @@ static int is_valid_frequency(int mhz)
 // Parse table header.
 // Return table id, or 0 in case of error.
 //
-static int bft1_parse_header(char *line)
+static int bft1_parse_header(radio_session_t *s, char *line)
 {
     if (strncasecmp(line, "Channel", 7) == 0)
         return 'C';
@@ -843,7 +846,7 @@ static int bft1_parse_header(char *line)
 // Start_flag is 1 for the first table row.
 // Return 0 on failure.
 //
-static int bft1_parse_row(int table_id, int first_row, char *line)
+static int bft1_parse_row(radio_session_t *s, int table_id, int first_row, char *line)
 {
     char num_str[256], rxfreq_str[256], offset_str[256], rq_str[256];
     char tq_str[256], wide_str[256], scan_str[256];
@@ -890,10 +893,10 @@ static int bft1_parse_row(int table_id, int first_row, char *line)
 
     if (first_row) {
         // On first entry, erase the channel table.
-        memset(radio_mem, 0xff, 21 * 0x10);
-        memset(&radio_mem[0x170], 0xff, 0x10);
+        memset(s->mem, 0xff, 21 * 0x10);
+        memset(&s->mem[0x170], 0xff, 0x10);
     }
-    setup_channel(num - 1, rx_mhz, rx_mhz + txoff_mhz, rq, tq, rpol, tpol, wide, scan);
+    setup_channel(s, num - 1, rx_mhz, rx_mhz + txoff_mhz, rq, tq, rpol, tpol, wide, scan);
     return 1;
 }
 
@@ -903,4 +906,6 @@ static int bft1_parse_row(int table_id, int first_row, char *line)
 radio_device_t radio_bft1 = {
     "Baofeng BF-T1",    bft1_download,     bft1_upload,          bft1_read_image,   bft1_save_image,
     bft1_print_version, bft1_print_config, bft1_parse_parameter, bft1_parse_header, bft1_parse_row,
+    NULL,               try_read_block,    try_write_block,      BLKSZ,             BLKSZ,
+    0,
 };
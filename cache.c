@@ -0,0 +1,155 @@
+/*
+ * Cache of data learned about radios and ports, kept between runs.
+ *
+ * Copyright (C) 2013-2023 Serge Vakulenko, KK6ABQ
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   1. Redistributions of source code must retain the above copyright notice,
+ *      this list of conditions and the following disclaimer.
+ *   2. Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in the
+ *      documentation and/or other materials provided with the distribution.
+ *   3. The name of the author may not be used to endorse or promote products
+ *      derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO
+ * EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#include "cache.h"
+
+#include <errno.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#ifndef MINGW32
+#include <fcntl.h>
+#include <sys/file.h>
+#endif
+
+#ifndef PATH_MAX
+#define PATH_MAX 1024
+#endif
+
+//
+// Get name of directory for cached data, create it when needed.
+//
+const char *cache_dir()
+{
+#ifdef MINGW32
+    return NULL;
+#else
+    static char path[PATH_MAX];
+    const char *base = getenv("XDG_CACHE_HOME");
+    const char *home = getenv("HOME");
+    char parent[PATH_MAX];
+
+    if (base && *base) {
+        snprintf(parent, sizeof(parent), "%s", base);
+    } else if (home && *home) {
+        snprintf(parent, sizeof(parent), "%s/.cache", home);
+    } else {
+        return NULL;
+    }
+    if (snprintf(path, sizeof(path), "%s/baoclone", parent) >= (int)sizeof(path))
+        return NULL;
+    if ((mkdir(parent, 0755) < 0 && errno != EEXIST) ||
+        (mkdir(path, 0755) < 0 && errno != EEXIST))
+        return NULL;
+    return path;
+#endif
+}
+
+//
+// Find a value by key in the cache file with given name.
+// File consists of lines 'key value'.
+//
+int cache_get(const char *name, const char *key, char *value, int size)
+{
+    const char *dir = cache_dir();
+    char filename[PATH_MAX], line[1024];
+    int keylen = strlen(key);
+    int found  = 0;
+    FILE *fd;
+
+    if (!dir)
+        return 0;
+    snprintf(filename, sizeof(filename), "%s/%s", dir, name);
+    fd = fopen(filename, "r");
+    if (!fd)
+        return 0;
+
+    while (fgets(line, sizeof(line), fd)) {
+        if (strncmp(line, key, keylen) != 0 || line[keylen] != ' ')
+            continue;
+
+        // Last entry wins.
+        snprintf(value, size, "%s", line + keylen + 1);
+        value[strcspn(value, "\r\n")] = 0;
+        found                         = 1;
+    }
+    fclose(fd);
+    return found;
+}
+
+//
+// Store a value by key in the cache file with given name.
+// The file is rewritten under a temporary name, and then renamed,
+// so a reader never sees it half-written.  Writers are serialized
+// by a lock file, as jobs on many ports update the cache in parallel.
+//
+void cache_put(const char *name, const char *key, const char *value)
+{
+    const char *dir = cache_dir();
+    char filename[PATH_MAX], tmpname[PATH_MAX], line[1024];
+    int keylen = strlen(key);
+    int lock   = -1;
+    FILE *in, *out;
+
+    if (!dir)
+        return;
+    snprintf(filename, sizeof(filename), "%s/%s", dir, name);
+    if (snprintf(tmpname, sizeof(tmpname), "%s.%d", filename, (int)getpid()) >=
+        (int)sizeof(tmpname))
+        return;
+#ifndef MINGW32
+    if (snprintf(line, sizeof(line), "%s.lock", filename) < (int)sizeof(line)) {
+        lock = open(line, O_RDWR | O_CREAT, 0644);
+        if (lock >= 0)
+            flock(lock, LOCK_EX);
+    }
+#endif
+    out = fopen(tmpname, "w");
+    if (!out)
+        goto done;
+
+    // Copy other entries.
+    in = fopen(filename, "r");
+    if (in) {
+        while (fgets(line, sizeof(line), in)) {
+            if (strncmp(line, key, keylen) == 0 && line[keylen] == ' ')
+                continue;
+            fputs(line, out);
+        }
+        fclose(in);
+    }
+    fprintf(out, "%s %s\n", key, value);
+
+    if (fclose(out) != 0 || rename(tmpname, filename) != 0)
+        unlink(tmpname);
+done:
+    if (lock >= 0)
+        close(lock);
+}
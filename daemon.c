@@ -0,0 +1,1190 @@
+/*
+ * Daemon: queue of jobs for many radios, served over a Unix socket.
+ *
+ * Copyright (C) 2013-2023 Serge Vakulenko, KK6ABQ
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   1. Redistributions of source code must retain the above copyright notice,
+ *      this list of conditions and the following disclaimer.
+ *   2. Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in the
+ *      documentation and/or other materials provided with the distribution.
+ *   3. The name of the author may not be used to endorse or promote products
+ *      derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO
+ * EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#define _GNU_SOURCE // for struct ucred
+#include "daemon.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "radio.h"
+#include "util.h"
+
+//
+// Types of jobs, and their names in the protocol.
+//
+enum {
+    JOB_DOWNLOAD,
+    JOB_UPLOAD,
+    JOB_CONFIGURE,
+    JOB_VFO,
+    JOB_IDENTIFY,
+    NJOBTYPES
+};
+
+static const char *job_name[NJOBTYPES] = { "download", "upload", "configure", "set-vfo",
+                                           "identify" };
+
+//
+// States of a job.
+//
+enum {
+    JOB_QUEUED,
+    JOB_RUNNING,
+    JOB_DONE,
+    JOB_FAILED,
+};
+
+static const char *state_name[] = { "queued", "running", "done", "failed" };
+
+//
+// Job for one radio.
+//
+typedef struct {
+    int id;                // Number of the job, from 1
+    int type;              // JOB_DOWNLOAD etc
+    int state;             // JOB_QUEUED etc
+    char port[256];        // Name of serial port
+    char model[32];        // Type of radio, to skip probing, or empty
+    char image[1024];      // Image file
+    char conf[1024];       // Text configuration file
+    char backup[1024];     // Backup image for configure
+    int vfo_b;             // Set-vfo: 0 for VFO A, 1 for B
+    double mhz;            // Set-vfo: frequency
+    int client_fd;         // Client which has submitted the job, or -1
+    struct timeval start;  // Time when the job started
+    double seconds;        // Duration of the job
+    char found[64];        // Detected radio model
+    char result[256];      // Result: identity line, or name of image
+} job_t;
+
+//
+// Worker: child process which keeps the port open and the radio
+// detected, and runs the jobs of this port one after another.
+//
+typedef struct {
+    char port[256];       // Name of serial port
+    pid_t pid;            // Child process, or 0 when not running
+    int job_fd;           // Send jobs to the worker, or -1 when told to finish
+    int output_fd;        // Receive output of the worker
+    int report_fd;        // Receive results of jobs
+    int job;              // Index of the running job, or -1 when idle
+    struct timeval idle;  // Time when the last job has finished
+} worker_t;
+
+//
+// Result of the job, sent by the worker in one write.
+//
+typedef struct {
+    int ok;           // Job succeeded
+    int last;         // Worker exits after this job
+    char found[64];   // Detected radio model
+    char result[256]; // Result: identity line, or name of image
+} report_t;
+
+//
+// Worker finishes after this time without jobs, to free the port.
+//
+#define WORKER_IDLE_SEC 10
+
+//
+// Connection of a client.
+//
+typedef struct {
+    int fd;          // Socket, or -1 when closed
+    uid_t uid;       // User of the client process
+    gid_t gid;       // Primary group of the client process
+    int subscribed;  // Receive events of all jobs
+    int len;         // Bytes in the buffer
+    char buf[4096];  // Partial request line
+} client_t;
+
+#define MAX_CLIENTS 32
+
+static volatile sig_atomic_t stop_flag; // Request to stop
+static int listen_fd = -1;              // Listening socket
+static client_t clients[MAX_CLIENTS];   // Connected clients
+static job_t *jobs;                     // All jobs, in order of submission
+static int njobs;                       // Number of jobs
+static worker_t *workers;               // Workers, one per port
+static int nworkers;                    // Number of workers
+
+//
+// In the worker process: the job and the session with the radio.
+//
+static job_t *child_job;
+static radio_session_t *child_session;
+static int child_report_fd = -1;
+
+//
+// Request the daemon to stop.
+//
+void daemon_stop()
+{
+    stop_flag = 1;
+}
+
+//
+// Create the directory accessible only by the user, or check the existing
+// one: it must not be a symlink, belong to another user, or be open
+// to others.  Halt otherwise.
+//
+static void private_dir(const char *dir)
+{
+    struct stat st;
+
+    if (mkdir(dir, 0700) < 0 && errno != EEXIST) {
+        perror(dir);
+        exit(-1);
+    }
+    if (lstat(dir, &st) < 0) {
+        perror(dir);
+        exit(-1);
+    }
+    if (!S_ISDIR(st.st_mode) || st.st_uid != getuid() || (st.st_mode & 077) != 0) {
+        fprintf(stderr, "%s: Not a private directory.\n", dir);
+        exit(-1);
+    }
+}
+
+//
+// Get default name of the socket.
+//
+const char *daemon_socket_name()
+{
+    static char path[sizeof(((struct sockaddr_un *)0)->sun_path)];
+    const char *dir = getenv("XDG_RUNTIME_DIR");
+    char tmp_dir[64];
+
+    if (dir && *dir && snprintf(path, sizeof(path), "%s/baoclone.sock", dir) < (int)sizeof(path))
+        return path;
+
+    // Anybody can create files in /tmp: use a directory of our own.
+    snprintf(tmp_dir, sizeof(tmp_dir), "/tmp/baoclone-%d", (int)getuid());
+    private_dir(tmp_dir);
+    snprintf(path, sizeof(path), "%s/baoclone.sock", tmp_dir);
+    return path;
+}
+
+//
+// Append the character to the buffer as UTF-8.  Return new length.
+//
+static int utf8_put(char *buf, int n, int size, unsigned u)
+{
+    if (u < 0x80 && n < size - 1) {
+        buf[n++] = u;
+    } else if (u < 0x800 && n < size - 2) {
+        buf[n++] = 0xc0 | u >> 6;
+        buf[n++] = 0x80 | (u & 0x3f);
+    } else if (u >= 0x800 && n < size - 3) {
+        buf[n++] = 0xe0 | u >> 12;
+        buf[n++] = 0x80 | ((u >> 6) & 0x3f);
+        buf[n++] = 0x80 | (u & 0x3f);
+    }
+    return n;
+}
+
+//
+// Get value of the key from flat JSON object: string without quotes,
+// or a bare token like number.  Return 0 when not found.
+//
+static int json_get(const char *line, const char *key, char *value, int size)
+{
+    int keylen = strlen(key);
+    const char *p;
+    int n = 0;
+
+    for (p = strchr(line, '"'); p; p = strchr(p + 1, '"')) {
+        if (strncmp(p + 1, key, keylen) != 0 || p[keylen + 1] != '"')
+            continue;
+        p += keylen + 2;
+        while (*p == ' ' || *p == '\t')
+            p++;
+        if (*p != ':')
+            continue;
+        p++;
+        while (*p == ' ' || *p == '\t')
+            p++;
+        if (*p != '"') {
+            // Number, true, false or null.
+            while (*p && !strchr(",} \t\r\n", *p) && n < size - 1)
+                value[n++] = *p++;
+            value[n] = 0;
+            return n > 0;
+        }
+        for (p++; *p && *p != '"' && n < size - 1; p++) {
+            if (*p == '\\' && p[1]) {
+                p++;
+                switch (*p) {
+                case 'n': value[n++] = '\n'; continue;
+                case 't': value[n++] = '\t'; continue;
+                case 'r': value[n++] = '\r'; continue;
+                case 'u':
+                    // Only the Basic Multilingual Plane, no surrogate pairs.
+                    if (strlen(p) >= 5) {
+                        n = utf8_put(value, n, size,
+                                     strtol((char[]){ p[1], p[2], p[3], p[4], 0 }, NULL, 16));
+                        p += 4;
+                    }
+                    continue;
+                }
+            }
+            value[n++] = *p;
+        }
+        value[n] = 0;
+        return 1;
+    }
+    return 0;
+}
+
+//
+// Append a string to the buffer as JSON string, with quotes.
+// Bytes above ASCII are passed as is: text is in UTF-8.
+//
+static void json_string(char *buf, int size, const char *str)
+{
+    int n = strlen(buf);
+
+    if (n < size - 1)
+        buf[n++] = '"';
+    for (; *str && n < size - 8; str++) {
+        unsigned char c = *str;
+
+        if (c == '"' || c == '\\') {
+            buf[n++] = '\\';
+            buf[n++] = c;
+        } else if (c == '\n') {
+            buf[n++] = '\\';
+            buf[n++] = 'n';
+        } else if (c == '\t') {
+            buf[n++] = '\\';
+            buf[n++] = 't';
+        } else if (c < ' ') {
+            n += sprintf(&buf[n], "\\u%04x", c);
+        } else {
+            buf[n++] = c;
+        }
+    }
+    if (n < size - 1)
+        buf[n++] = '"';
+    buf[n] = 0;
+}
+
+//
+// Append "key":"value" to the object in the buffer.
+//
+static void json_add(char *buf, int size, const char *key, const char *value)
+{
+    int n = strlen(buf);
+
+    snprintf(buf + n, size - n, "%s\"%s\":", buf[n - 1] == '{' ? "" : ",", key);
+    json_string(buf, size, value);
+}
+
+//
+// Close connection to the client.  Its jobs continue,
+// with events sent only to subscribers.
+//
+static void close_client(client_t *c)
+{
+    int k;
+
+    for (k = 0; k < njobs; k++)
+        if (jobs[k].client_fd == c->fd)
+            jobs[k].client_fd = -1;
+    close(c->fd);
+    c->fd = -1;
+}
+
+//
+// Send line to the client.  Close the connection when the client
+// does not read: the daemon must not wait for anybody.
+//
+static void send_line(client_t *c, const char *line)
+{
+    int len = strlen(line);
+
+    if (c->fd < 0)
+        return;
+    if (send(c->fd, line, len, MSG_NOSIGNAL | MSG_DONTWAIT) != len ||
+        send(c->fd, "\n", 1, MSG_NOSIGNAL | MSG_DONTWAIT) != 1)
+        close_client(c);
+}
+
+//
+// Send event of the job to its client and to subscribers.
+//
+static void send_event(job_t *j, const char *line)
+{
+    int i;
+
+    for (i = 0; i < MAX_CLIENTS; i++) {
+        client_t *c = &clients[i];
+
+        if (c->fd >= 0 && (c->subscribed || c->fd == j->client_fd))
+            send_line(c, line);
+    }
+}
+
+//
+// Describe the job as JSON object.
+//
+static void job_json(job_t *j, char *buf, int size)
+{
+    int n;
+
+    snprintf(buf, size, "{\"id\":%d", j->id);
+    json_add(buf, size, "op", job_name[j->type]);
+    json_add(buf, size, "port", j->port);
+    json_add(buf, size, "state", state_name[j->state]);
+    if (j->found[0])
+        json_add(buf, size, "model", j->found);
+    if (j->state >= JOB_DONE) {
+        n = strlen(buf);
+        snprintf(buf + n, size - n, ",\"seconds\":%.1f", j->seconds);
+        json_add(buf, size, "result", j->result);
+    }
+    n = strlen(buf);
+    snprintf(buf + n, size - n, "}");
+}
+
+//
+// Send the change of state of the job.
+//
+static void send_state(job_t *j)
+{
+    char obj[2048], buf[2100];
+
+    job_json(j, obj, sizeof(obj));
+    snprintf(buf, sizeof(buf), "{\"event\":\"state\",%s", obj + 1);
+    send_event(j, buf);
+}
+
+//
+// In the worker process: send the detected model and the result
+// of the job to the daemon.
+//
+static void send_report(int ok, int last)
+{
+    const char *model = radio_name(child_session);
+    report_t r;
+
+    memset(&r, 0, sizeof(r));
+    r.ok   = ok;
+    r.last = last;
+    snprintf(r.found, sizeof(r.found), "%s", model ? model : "");
+    snprintf(r.result, sizeof(r.result), "%s", child_job->result);
+    fflush(stdout);
+    if (write(child_report_fd, &r, sizeof(r)) < 0) {
+        // Daemon has gone, nothing to do.
+    }
+}
+
+//
+// In the worker process: called on exit.  When a job has failed
+// by exit(), report it, so the daemon knows the result.  The port
+// is closed, to let the next worker wait until the radio has reset.
+//
+static void report_exit(void)
+{
+    if (child_job)
+        send_report(0, 1);
+    if (child_session->port)
+        radio_disconnect(child_session);
+}
+
+//
+// In the worker process: start the session for the job.  The radio
+// detected by the previous job is connected again on the port kept open;
+// when it does not answer, the port is opened again and probed.
+//
+static void job_connect(job_t *j, radio_session_t *s)
+{
+    if (s->port && radio_reconnect(s))
+        return;
+    if (s->port)
+        radio_disconnect(s);
+    radio_set_model(s, j->model[0] ? j->model : NULL);
+    radio_connect(s, j->port);
+}
+
+//
+// In the worker process: run the job, like the baoclone command does.
+// The port is kept open for the next job.  Return 0 when failed.
+//
+static int run_job(job_t *j, radio_session_t *s)
+{
+    int ok = 1;
+
+    job_connect(j, s);
+    switch (j->type) {
+    case JOB_DOWNLOAD:
+        ok = radio_download(s);
+        radio_hold(s);
+        if (!ok)
+            break;
+        radio_print_version(s, stdout, 1);
+        radio_save_image(s, j->image);
+        if (j->conf[0]) {
+            FILE *conf = fopen(j->conf, "w");
+
+            if (!conf) {
+                perror(j->conf);
+                return 0;
+            }
+            radio_print_version(s, conf, 0);
+            radio_print_config(s, conf, 1);
+            fclose(conf);
+        }
+        snprintf(j->result, sizeof(j->result), "%.255s", j->image);
+        break;
+    case JOB_UPLOAD:
+        radio_read_image(s, j->image);
+        radio_print_version(s, stdout, 1);
+        ok = radio_upload(s, 0);
+        radio_hold(s);
+        break;
+    case JOB_CONFIGURE:
+        ok = radio_download(s);
+        if (ok) {
+            radio_print_version(s, stdout, 1);
+            if (j->backup[0])
+                radio_save_image(s, j->backup);
+            radio_parse_config(s, j->conf);
+            ok = radio_upload(s, 1);
+        }
+        radio_hold(s);
+        break;
+    case JOB_VFO:
+        ok = radio_set_vfo(s, j->vfo_b, j->mhz);
+        radio_hold(s);
+        break;
+    case JOB_IDENTIFY:
+        ok = radio_identify(s, j->result, sizeof(j->result));
+        radio_hold(s);
+        break;
+    }
+    return ok;
+}
+
+//
+// Read exactly len bytes.  Return 0 at end of file.
+//
+static int read_full(int fd, void *data, int len)
+{
+    char *p = data;
+    int n;
+
+    while (len > 0) {
+        n = read(fd, p, len);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return 0;
+        p += n;
+        len -= n;
+    }
+    return 1;
+}
+
+//
+// In the worker process: run jobs until the daemon closes the channel.
+// A job which fails by exit() takes the worker with it: the next job
+// on this port starts a new one.
+//
+static void worker_loop(int job_fd)
+{
+    job_t j;
+    int ok;
+
+    child_session = radio_session_new();
+    atexit(report_exit);
+    while (read_full(job_fd, &j, sizeof(j))) {
+        child_job = &j;
+        ok        = run_job(&j, child_session);
+        send_report(ok, 0);
+        child_job = NULL;
+    }
+    exit(0);
+}
+
+//
+// Start the worker for the port, with output to a pipe.
+//
+static worker_t *start_worker(const char *port)
+{
+    int chan[2], out[2], report[2], i;
+    worker_t *w;
+
+    // Slot of the port is reused.
+    for (i = 0; i < nworkers; i++)
+        if (strcmp(workers[i].port, port) == 0)
+            break;
+    if (i == nworkers) {
+        workers = realloc(workers, (nworkers + 1) * sizeof(worker_t));
+        if (!workers) {
+            fprintf(stderr, "Out of memory.\n");
+            exit(-1);
+        }
+        memset(&workers[i], 0, sizeof(worker_t));
+        snprintf(workers[i].port, sizeof(workers[i].port), "%s", port);
+        nworkers++;
+    }
+    w = &workers[i];
+
+    // Jobs go through a socket: send() to a finished worker must not raise SIGPIPE.
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, chan) < 0 || pipe(out) < 0 || pipe(report) < 0) {
+        perror("pipe");
+        exit(-1);
+    }
+
+    // Output must be flushed before fork.
+    fflush(stdout);
+    fflush(stderr);
+    w->pid = fork();
+    if (w->pid < 0) {
+        perror("fork");
+        exit(-1);
+    }
+    if (w->pid == 0) {
+        // Child: the sockets and other workers belong to the daemon.
+        close(listen_fd);
+        for (i = 0; i < MAX_CLIENTS; i++)
+            if (clients[i].fd >= 0)
+                close(clients[i].fd);
+        for (i = 0; i < nworkers; i++) {
+            if (workers[i].pid != 0 && &workers[i] != w) {
+                if (workers[i].job_fd >= 0)
+                    close(workers[i].job_fd);
+                close(workers[i].output_fd);
+                close(workers[i].report_fd);
+            }
+        }
+        close(chan[0]);
+        close(out[0]);
+        close(report[0]);
+        dup2(out[1], 1);
+        dup2(out[1], 2);
+        close(out[1]);
+        setvbuf(stdout, 0, _IOLBF, 0);
+        setvbuf(stderr, 0, _IONBF, 0);
+
+        child_report_fd = report[1];
+        worker_loop(chan[1]);
+    }
+
+    // Parent.
+    close(chan[1]);
+    close(out[1]);
+    close(report[1]);
+    fcntl(out[0], F_SETFL, O_NONBLOCK);
+    fcntl(report[0], F_SETFL, O_NONBLOCK);
+    w->job_fd    = chan[0];
+    w->output_fd = out[0];
+    w->report_fd = report[0];
+    w->job       = -1;
+    return w;
+}
+
+//
+// Send the job to the worker.
+//
+static void start_job(worker_t *w, int k)
+{
+    job_t *j = &jobs[k];
+
+    gettimeofday(&j->start, NULL);
+    if (send(w->job_fd, j, sizeof(*j), MSG_NOSIGNAL) != sizeof(*j)) {
+        // Worker has gone: the job fails when it is reaped.
+    }
+    w->job   = k;
+    j->state = JOB_RUNNING;
+    send_state(j);
+}
+
+//
+// Forward output of the worker to clients of its job.
+// Return 0 when no more data.
+//
+static int forward_output(worker_t *w)
+{
+    char text[1024], buf[4096];
+    int len = read(w->output_fd, text, sizeof(text) - 1);
+
+    if (len <= 0)
+        return 0;
+    if (w->job < 0) {
+        // Between jobs: nobody to send it to.
+        return 1;
+    }
+    text[len] = 0;
+    snprintf(buf, sizeof(buf), "{\"event\":\"output\",\"id\":%d", jobs[w->job].id);
+    json_add(buf, sizeof(buf), "text", text);
+    strcat(buf, "}");
+    send_event(&jobs[w->job], buf);
+    return 1;
+}
+
+//
+// Job has finished: collect the rest of output and the result.
+// Report is NULL when the worker died without it.
+//
+static void finish_job(worker_t *w, const report_t *r)
+{
+    job_t *j = &jobs[w->job];
+    struct timeval now;
+
+    // Output of the job was written before the report.
+    while (forward_output(w))
+        continue;
+    if (r) {
+        snprintf(j->found, sizeof(j->found), "%.63s", r->found);
+        snprintf(j->result, sizeof(j->result), "%.255s", r->result);
+    }
+
+    gettimeofday(&now, NULL);
+    j->seconds = (now.tv_sec - j->start.tv_sec) + (now.tv_usec - j->start.tv_usec) / 1e6;
+    j->state   = (r && r->ok) ? JOB_DONE : JOB_FAILED;
+    w->job     = -1;
+    w->idle    = now;
+    send_state(j);
+}
+
+//
+// Tell the worker to finish: it closes the port and exits.
+//
+static void stop_worker(worker_t *w)
+{
+    if (w->job_fd >= 0)
+        close(w->job_fd);
+    w->job_fd = -1;
+}
+
+//
+// Get the report of the running job, when the worker has sent it.
+// A worker which exits after the job gets no more jobs.
+//
+static void receive_report(worker_t *w)
+{
+    report_t r;
+
+    if (w->job < 0 || read(w->report_fd, &r, sizeof(r)) != sizeof(r))
+        return;
+    if (r.last)
+        stop_worker(w);
+    finish_job(w, &r);
+}
+
+//
+// Worker has exited: finish its job, and release the port.
+//
+static void worker_exited(worker_t *w)
+{
+    receive_report(w);
+    if (w->job >= 0)
+        finish_job(w, NULL);
+    while (forward_output(w))
+        continue;
+    stop_worker(w);
+    close(w->output_fd);
+    close(w->report_fd);
+    w->pid = 0;
+}
+
+//
+// Start queued jobs on ports which are free, in order of submission.
+// Idle workers free their ports after a while.
+//
+static void schedule(void)
+{
+    struct timeval now;
+    worker_t *w;
+    int i, k;
+
+    for (k = 0; k < njobs; k++) {
+        if (jobs[k].state != JOB_QUEUED)
+            continue;
+        for (i = 0; i < nworkers; i++)
+            if (strcmp(workers[i].port, jobs[k].port) == 0)
+                break;
+        w = (i < nworkers) ? &workers[i] : NULL;
+        if (w && w->pid != 0 && (w->job >= 0 || w->job_fd < 0)) {
+            // Port is busy, or the worker is finishing.
+            continue;
+        }
+        if (!w || w->pid == 0)
+            w = start_worker(jobs[k].port);
+        start_job(w, k);
+    }
+
+    gettimeofday(&now, NULL);
+    for (i = 0; i < nworkers; i++) {
+        w = &workers[i];
+        if (w->pid != 0 && w->job < 0 && w->job_fd >= 0 &&
+            now.tv_sec - w->idle.tv_sec >= WORKER_IDLE_SEC)
+            stop_worker(w);
+    }
+}
+
+//
+// Check whether the client may access the existing file, by permission
+// bits for its user and primary group.  Supplementary groups of the
+// client are not known, so access granted only by them is refused.
+//
+static int peer_access(const client_t *c, const char *path, int mode)
+{
+    struct stat st;
+    int bits;
+
+    if (stat(path, &st) < 0)
+        return 0;
+    if (c->uid == 0)
+        return 1;
+    if (c->uid == st.st_uid)
+        bits = st.st_mode >> 6;
+    else if (c->gid == st.st_gid)
+        bits = st.st_mode >> 3;
+    else
+        bits = st.st_mode;
+    return (bits & mode) == mode;
+}
+
+//
+// Check whether the client may write the file, or create it
+// in the directory.
+//
+static int peer_can_write(const client_t *c, const char *path)
+{
+    char dir[sizeof(((job_t *)0)->image)], *slash;
+
+    if (access(path, F_OK) == 0)
+        return peer_access(c, path, W_OK);
+
+    snprintf(dir, sizeof(dir), "%s", path);
+    slash = strrchr(dir, '/');
+    if (!slash)
+        strcpy(dir, ".");
+    else if (slash == dir)
+        dir[1] = 0;
+    else
+        *slash = 0;
+    return peer_access(c, dir, W_OK | X_OK);
+}
+
+//
+// Check that the client could open the port and files of the job itself:
+// the daemon must not read or write files on behalf of somebody else.
+// Return error message, or NULL.
+//
+static const char *check_access(const client_t *c, const job_t *j)
+{
+    if (strncmp(j->port, "emu:", 4) == 0 || strncmp(j->port, "replay:", 7) == 0) {
+        // Radio emulated from a file.
+        if (!peer_access(c, strchr(j->port, ':') + 1, R_OK))
+            return "port not accessible";
+    } else if (strncmp(j->port, "tcp:", 4) != 0) {
+        if (!peer_access(c, j->port, R_OK | W_OK))
+            return "port not accessible";
+    }
+
+    switch (j->type) {
+    case JOB_DOWNLOAD:
+        if (!peer_can_write(c, j->image))
+            return "image not writable";
+        if (j->conf[0] && !peer_can_write(c, j->conf))
+            return "conf not writable";
+        break;
+    case JOB_UPLOAD:
+        if (!peer_access(c, j->image, R_OK))
+            return "image not readable";
+        break;
+    case JOB_CONFIGURE:
+        if (!peer_access(c, j->conf, R_OK))
+            return "conf not readable";
+        if (j->backup[0] && !peer_can_write(c, j->backup))
+            return "backup not writable";
+        break;
+    }
+    return NULL;
+}
+
+//
+// Parse the job from request line.  Return error message, or NULL.
+//
+static const char *parse_job(job_t *j, const char *line, const char *op)
+{
+    char value[64];
+
+    memset(j, 0, sizeof(*j));
+    for (j->type = 0; j->type < NJOBTYPES; j->type++)
+        if (strcmp(op, job_name[j->type]) == 0)
+            break;
+    if (j->type == NJOBTYPES)
+        return "unknown op";
+    if (!json_get(line, "port", j->port, sizeof(j->port)) || !j->port[0])
+        return "port required";
+    json_get(line, "model", j->model, sizeof(j->model));
+    json_get(line, "image", j->image, sizeof(j->image));
+    json_get(line, "conf", j->conf, sizeof(j->conf));
+    json_get(line, "backup", j->backup, sizeof(j->backup));
+
+    switch (j->type) {
+    case JOB_DOWNLOAD:
+    case JOB_UPLOAD:
+        if (!j->image[0])
+            return "image required";
+        break;
+    case JOB_CONFIGURE:
+        if (!j->conf[0])
+            return "conf required";
+        break;
+    case JOB_VFO:
+        if (!json_get(line, "vfo", value, sizeof(value)) ||
+            (strcasecmp(value, "a") != 0 && strcasecmp(value, "b") != 0))
+            return "vfo must be a or b";
+        j->vfo_b = (strcasecmp(value, "b") == 0);
+        if (!json_get(line, "mhz", value, sizeof(value)))
+            return "mhz required";
+        j->mhz = strtod(value, NULL);
+        break;
+    }
+    return NULL;
+}
+
+//
+// Reply with status of one job, or of all jobs.
+//
+static void send_status(client_t *c, const char *line)
+{
+    char value[32], *buf;
+    int size = 2048 * (njobs + 1), i, id = 0;
+
+    if (json_get(line, "id", value, sizeof(value)))
+        id = atoi(value);
+    buf = malloc(size);
+    if (!buf) {
+        fprintf(stderr, "Out of memory.\n");
+        exit(-1);
+    }
+    strcpy(buf, "{\"jobs\":[");
+    for (i = 0; i < njobs; i++) {
+        if (id && jobs[i].id != id)
+            continue;
+        if (buf[strlen(buf) - 1] == '}')
+            strcat(buf, ",");
+        job_json(&jobs[i], buf + strlen(buf), size - strlen(buf));
+    }
+    strcat(buf, "]}");
+    send_line(c, buf);
+    free(buf);
+}
+
+//
+// Process one request from the client.
+//
+static void request(client_t *c, const char *line)
+{
+    char op[32], buf[256];
+    const char *error;
+    job_t j;
+
+    if (trace_flag)
+        printf("# Request: %s\n", line);
+    if (!json_get(line, "op", op, sizeof(op))) {
+        send_line(c, "{\"error\":\"op required\"}");
+        return;
+    }
+    if (strcmp(op, "status") == 0) {
+        send_status(c, line);
+        return;
+    }
+    if (strcmp(op, "subscribe") == 0) {
+        c->subscribed = 1;
+        send_line(c, "{\"subscribed\":true}");
+        return;
+    }
+    error = parse_job(&j, line, op);
+    if (!error)
+        error = check_access(c, &j);
+    if (error) {
+        snprintf(buf, sizeof(buf), "{");
+        json_add(buf, sizeof(buf), "error", error);
+        strcat(buf, "}");
+        send_line(c, buf);
+        return;
+    }
+
+    // Add to the queue.
+    jobs = realloc(jobs, (njobs + 1) * sizeof(job_t));
+    if (!jobs) {
+        fprintf(stderr, "Out of memory.\n");
+        exit(-1);
+    }
+    j.id        = njobs + 1;
+    j.state     = JOB_QUEUED;
+    j.client_fd = c->fd;
+    jobs[njobs++] = j;
+    snprintf(buf, sizeof(buf), "{\"id\":%d,\"state\":\"queued\"}", j.id);
+    send_line(c, buf);
+}
+
+//
+// Read requests from the client.
+//
+static void receive(client_t *c)
+{
+    int len = read(c->fd, c->buf + c->len, sizeof(c->buf) - 1 - c->len);
+    char *newline;
+
+    if (len <= 0) {
+        close_client(c);
+        return;
+    }
+    c->len += len;
+    c->buf[c->len] = 0;
+    while ((newline = strchr(c->buf, '\n')) != NULL) {
+        *newline = 0;
+        if (newline > c->buf)
+            request(c, c->buf);
+        if (c->fd < 0)
+            return;
+        c->len -= newline + 1 - c->buf;
+        memmove(c->buf, newline + 1, c->len + 1);
+    }
+    if (c->len == sizeof(c->buf) - 1) {
+        send_line(c, "{\"error\":\"line too long\"}");
+        c->len = 0;
+    }
+}
+
+//
+// Get user and group of the process on the other end of the socket.
+// Return 0 on failure.
+//
+static int peer_credentials(int fd, uid_t *uid, gid_t *gid)
+{
+#ifdef SO_PEERCRED
+    struct ucred cred;
+    socklen_t len = sizeof(cred);
+
+    if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &len) < 0)
+        return 0;
+    *uid = cred.uid;
+    *gid = cred.gid;
+    return 1;
+#else
+    return getpeereid(fd, uid, gid) == 0;
+#endif
+}
+
+//
+// Accept new client.  Only processes of the same user are served.
+//
+static void accept_client(void)
+{
+    int fd = accept(listen_fd, NULL, NULL);
+    uid_t uid;
+    gid_t gid;
+    int i;
+
+    if (fd < 0)
+        return;
+    if (!peer_credentials(fd, &uid, &gid) || uid != getuid()) {
+        if (write(fd, "{\"error\":\"permission denied\"}\n", 30) < 0) {
+            // Nothing to do.
+        }
+        close(fd);
+        return;
+    }
+    for (i = 0; i < MAX_CLIENTS; i++) {
+        if (clients[i].fd < 0) {
+            memset(&clients[i], 0, sizeof(clients[i]));
+            clients[i].fd  = fd;
+            clients[i].uid = uid;
+            clients[i].gid = gid;
+            return;
+        }
+    }
+    if (write(fd, "{\"error\":\"too many clients\"}\n", 29) < 0) {
+        // Nothing to do.
+    }
+    close(fd);
+}
+
+//
+// Create the listening socket.  When another daemon is running there,
+// halt; a stale socket from a killed daemon is removed.
+// The socket is accessible only by the user.
+//
+static void open_socket(const char *socket_path)
+{
+    struct sockaddr_un addr;
+    mode_t mask;
+    int fd;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(socket_path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "%s: Name too long.\n", socket_path);
+        exit(-1);
+    }
+    strcpy(addr.sun_path, socket_path);
+
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) {
+        perror("socket");
+        exit(-1);
+    }
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0) {
+        fprintf(stderr, "%s: Daemon is already running.\n", socket_path);
+        exit(-1);
+    }
+    unlink(socket_path);
+    mask = umask(077);
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        perror(socket_path);
+        exit(-1);
+    }
+    umask(mask);
+    if (chmod(socket_path, 0600) < 0 || listen(fd, 8) < 0) {
+        perror(socket_path);
+        exit(-1);
+    }
+    fcntl(fd, F_SETFL, O_NONBLOCK);
+    listen_fd = fd;
+}
+
+//
+// Reap finished workers.
+//
+static void reap_workers(void)
+{
+    int status, i;
+    pid_t pid;
+
+    while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+        for (i = 0; i < nworkers; i++) {
+            if (workers[i].pid == pid) {
+                worker_exited(&workers[i]);
+                break;
+            }
+        }
+    }
+}
+
+//
+// Serve clients until stopped.
+//
+int daemon_serve(const char *socket_path)
+{
+    struct pollfd *fds = NULL;
+    int i, n, npolled;
+
+    for (i = 0; i < MAX_CLIENTS; i++)
+        clients[i].fd = -1;
+    open_socket(socket_path);
+    stop_flag = 0;
+
+    while (!stop_flag) {
+        schedule();
+
+        // Wait for requests, or output and results of jobs.
+        fds = realloc(fds, (1 + MAX_CLIENTS + 2 * nworkers) * sizeof(struct pollfd));
+        if (!fds) {
+            fprintf(stderr, "Out of memory.\n");
+            exit(-1);
+        }
+        n = 0;
+        fds[n].fd       = listen_fd;
+        fds[n++].events = POLLIN;
+        for (i = 0; i < MAX_CLIENTS; i++) {
+            fds[n].fd       = clients[i].fd;
+            fds[n++].events = POLLIN;
+        }
+        npolled = nworkers;
+        for (i = 0; i < npolled; i++) {
+            fds[n].fd       = workers[i].pid ? workers[i].output_fd : -1;
+            fds[n++].events = POLLIN;
+            fds[n].fd       = workers[i].pid ? workers[i].report_fd : -1;
+            fds[n++].events = POLLIN;
+        }
+
+        // Timeout is needed to notice finished jobs and the stop request.
+        if (poll(fds, n, 100) < 0) {
+            if (errno == EINTR)
+                continue;
+            perror("poll");
+            break;
+        }
+        if (fds[0].revents & POLLIN)
+            accept_client();
+        for (i = 0; i < MAX_CLIENTS; i++)
+            if (clients[i].fd >= 0 && (fds[1 + i].revents & (POLLIN | POLLHUP)))
+                receive(&clients[i]);
+        for (i = 0; i < npolled; i++) {
+            if (fds[1 + MAX_CLIENTS + 2 * i].revents & POLLIN)
+                forward_output(&workers[i]);
+            if (fds[2 + MAX_CLIENTS + 2 * i].revents & POLLIN)
+                receive_report(&workers[i]);
+        }
+        reap_workers();
+    }
+
+    // Running jobs are left to finish: killing them in the middle
+    // of an upload would leave the radio with partial contents.
+    // Workers exit after their jobs, and close the ports.
+    free(fds);
+    for (i = 0; i < nworkers; i++) {
+        if (workers[i].pid != 0) {
+            stop_worker(&workers[i]);
+            close(workers[i].output_fd);
+            close(workers[i].report_fd);
+        }
+    }
+    free(workers);
+    workers  = NULL;
+    nworkers = 0;
+    for (i = 0; i < MAX_CLIENTS; i++) {
+        if (clients[i].fd >= 0)
+            close_client(&clients[i]);
+    }
+    close(listen_fd);
+    listen_fd = -1;
+    unlink(socket_path);
+    return 0;
+}
@@ -0,0 +1,82 @@
+/*
+ * Daemon: queue of jobs for many radios, served over a Unix socket.
+ *
+ * Copyright (C) 2013-2023 Serge Vakulenko, KK6ABQ
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   1. Redistributions of source code must retain the above copyright notice,
+ *      this list of conditions and the following disclaimer.
+ *   2. Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in the
+ *      documentation and/or other materials provided with the distribution.
+ *   3. The name of the author may not be used to endorse or promote products
+ *      derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO
+ * EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifndef DAEMON_H
+#define DAEMON_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+//
+// Serve clients on the Unix socket, until daemon_stop() is called.
+// Protocol is JSON lines: one flat object per line in both directions.
+//
+// Requests:
+//  {"op":"download", "port":P, "image":FILE [,"conf":FILE]}
+//  {"op":"upload", "port":P, "image":FILE}
+//  {"op":"configure", "port":P, "conf":FILE [,"backup":FILE]}
+//  {"op":"set-vfo", "port":P, "vfo":"a"|"b", "mhz":N}
+//  {"op":"identify", "port":P}
+//  {"op":"status" [,"id":N]}
+//  {"op":"subscribe"}
+// Jobs take optional "model", like option --model.  Names of files
+// are relative to the current directory of the daemon.  Text is UTF-8.
+//
+// Only processes of the same user may connect, and a job is refused
+// when the client could not open its port or files itself.
+//
+// A job is answered by {"id":N,"state":"queued"}, status by
+// {"jobs":[...]}, a bad request by {"error":TEXT}.  Events of a job
+// are sent to the client which has submitted it, and to subscribers:
+//  {"event":"state", "id":N, "state":"running"|"done"|"failed", ...}
+//  {"event":"output", "id":N, "text":TEXT}
+//
+// Jobs on the same port run one after another, in order of submission,
+// by a worker process which keeps the port open; jobs on different ports
+// run in parallel.
+// Return 0 when stopped.
+//
+int daemon_serve(const char *socket_path);
+
+//
+// Request the daemon to stop.  Can be called from a signal handler.
+//
+void daemon_stop(void);
+
+//
+// Get default name of the socket: $XDG_RUNTIME_DIR/baoclone.sock,
+// or /tmp/baoclone-<uid>/baoclone.sock.  That directory is created
+// accessible only by the user; halt when it exists and is not private.
+//
+const char *daemon_socket_name(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // DAEMON_H
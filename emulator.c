@@ -0,0 +1,467 @@
+/*
+ * Emulator of Baofeng radios on a pseudo-terminal.
+ *
+ * Copyright (C) 2013-2023 Serge Vakulenko, KK6ABQ
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   1. Redistributions of source code must retain the above copyright notice,
+ *      this list of conditions and the following disclaimer.
+ *   2. Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in the
+ *      documentation and/or other materials provided with the distribution.
+ *   3. The name of the author may not be used to endorse or promote products
+ *      derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO
+ * EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#define _GNU_SOURCE // for posix_openpt() and ptsname()
+
+#include "emulator.h"
+
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "util.h"
+
+//
+// Protocol state.
+//
+enum {
+    EMU_IDLE,  // Waiting for magic
+    EMU_IDENT, // Magic accepted, waiting for identifier query
+    EMU_CLONE, // Clone mode
+};
+
+//
+// Radio is reset when no commands received for this time.
+//
+#define RESET_MSEC 1000
+
+struct emulator {
+    radio_session_t *radio;    // Device type and memory contents
+    int master_fd;             // Master side of pseudo-terminal
+    int slave_fd;              // Keep the slave open between connections
+    char port_name[64];        // Name of the slave device
+    int byte_usec;             // Time to transfer one byte
+    int latency_usec;          // Delay before every reply
+    int write_latency_usec;    // Delay before acknowledge of block write, or 0 for the same
+    int delayed_ack;           // Send acknowledge before next reply, like BF-F8HP
+    volatile int stop;         // Request to terminate the thread
+    pthread_t thread;          // Thread running the protocol
+    int state;                 // Protocol state
+    int ack_deferred;          // Acknowledge is waiting for the next command
+    unsigned char magic[8];    // Last bytes received in idle state
+    long long rx_done;         // Time when the last received byte has passed the wire
+    emu_counters_t count;      // Traffic statistics
+    int fault_every;           // Corrupt every n-th block reply, or 0
+    int nblocks;               // Count of block commands
+    int read_max;              // Largest block read, or 0 for any
+    int write_max;             // Largest block write, or 0 for any
+    int writes_left;           // Block writes until the radio goes silent, or -1 for no limit
+};
+
+//
+// Get time in microseconds.
+//
+static long long now_usec()
+{
+    struct timespec t;
+
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec * 1000000LL + t.tv_nsec / 1000;
+}
+
+//
+// Sleep until the given time in microseconds.
+//
+static void sleep_until(long long usec)
+{
+    long long delta = usec - now_usec();
+
+    if (delta > 0)
+        usleep(delta);
+}
+
+//
+// Receive one byte from the host, at the speed of the wire.
+// Return -1 on timeout or when the emulator is stopped.
+//
+static int get_byte(emulator_t *e, int timeout_msec)
+{
+    struct pollfd pfd;
+    unsigned char c;
+
+    pfd.fd     = e->master_fd;
+    pfd.events = POLLIN;
+    while (!e->stop) {
+        // Wake up periodically to check for stop request.
+        int msec = timeout_msec < 50 ? timeout_msec : 50;
+
+        if (poll(&pfd, 1, msec) == 1 && read(e->master_fd, &c, 1) == 1) {
+            if (e->byte_usec > 0) {
+                // Wait until the byte would come through the wire.
+                long long t = now_usec();
+
+                if (e->rx_done < t)
+                    e->rx_done = t;
+                e->rx_done += e->byte_usec;
+                sleep_until(e->rx_done);
+            }
+            e->count.rx_bytes++;
+            return c;
+        }
+        timeout_msec -= msec;
+        if (timeout_msec <= 0)
+            break;
+    }
+    return -1;
+}
+
+//
+// Receive the rest of a command from the host:
+// bytes from index 'first' up to 'len'.
+// Return 0 on timeout.
+//
+static int get_command(emulator_t *e, unsigned char *cmd, int first, int len)
+{
+    int i, c;
+
+    for (i = first; i < len; i++) {
+        c = get_byte(e, RESET_MSEC);
+        if (c < 0)
+            return 0;
+        cmd[i] = c;
+    }
+    return 1;
+}
+
+//
+// Send data to the host, at the speed of the wire.
+//
+static void send_bytes(emulator_t *e, const void *data, int len)
+{
+    const unsigned char *p = data;
+    long long t            = now_usec();
+    int i;
+
+    if (e->byte_usec == 0) {
+        if (write(e->master_fd, p, len) != len)
+            perror("Emulator");
+        e->count.tx_bytes += len;
+        return;
+    }
+    for (i = 0; i < len; i++) {
+        if (write(e->master_fd, &p[i], 1) != 1) {
+            perror("Emulator");
+            return;
+        }
+        e->count.tx_bytes++;
+        t += e->byte_usec;
+        sleep_until(t);
+    }
+}
+
+//
+// Send a reply after the given processing delay.
+// Deferred acknowledge goes first.
+//
+static void send_reply_after(emulator_t *e, int usec, const void *data, int len)
+{
+    if (usec > 0)
+        usleep(usec);
+    if (e->ack_deferred) {
+        send_bytes(e, "\x06", 1);
+        e->ack_deferred = 0;
+    }
+    send_bytes(e, data, len);
+}
+
+//
+// Send a reply after the processing delay.
+//
+static void send_reply(emulator_t *e, const void *data, int len)
+{
+    send_reply_after(e, e->latency_usec, data, len);
+}
+
+//
+// Check whether the magic is valid for this radio.
+//
+static int magic_matches(emulator_t *e)
+{
+    static const unsigned char UV5R_MODEL_AGED[] = "\x50\xBB\xFF\x01\x25\x98\x4D";
+    static const unsigned char UV5R_MODEL_291[]  = "\x50\xBB\xFF\x20\x12\x07\x25";
+    const unsigned char *tail                    = &e->magic[1];
+    radio_device_t *device                       = e->radio->device;
+
+    if (device == &radio_uv5r)
+        return memcmp(tail, UV5R_MODEL_291, 7) == 0;
+    if (device == &radio_uv5r_aged)
+        return memcmp(tail, UV5R_MODEL_AGED, 7) == 0;
+
+    // UV-B5, BF-888S and BF-T1 accept both "PROGRAM" and "\2PROGRAM".
+    return memcmp(tail, "PROGRAM", 7) == 0;
+}
+
+//
+// Check whether the reply to this block command must be corrupted.
+//
+static int fault(emulator_t *e)
+{
+    e->nblocks++;
+    return e->fault_every > 0 && e->nblocks % e->fault_every == 0;
+}
+
+//
+// Process one command in clone mode.
+// Return 0 when the radio leaves clone mode.
+//
+static int clone_command(emulator_t *e, int c)
+{
+    radio_device_t *device = e->radio->device;
+    int is_uv5r            = (device == &radio_uv5r || device == &radio_uv5r_aged);
+    unsigned char cmd[4 + 0x100];
+    int addr, nbytes;
+
+    if (c == 0x06) {
+        // Host confirms the block.
+        if (e->delayed_ack) {
+            e->ack_deferred = 1;
+        } else if (device == &radio_uvb5) {
+            send_reply(e, "\x74", 1);
+        } else if (device != &radio_bft1) {
+            send_reply(e, "\x06", 1);
+        }
+        return 1;
+    }
+    if (c == 'b' && device == &radio_bft1) {
+        // Bye.
+        send_reply(e, "\x00", 1);
+        return 0;
+    }
+    if (c != (is_uv5r ? 'S' : 'R') && c != (is_uv5r ? 'X' : 'W')) {
+        // Unknown command: ignore.
+        return 1;
+    }
+
+    cmd[0] = c;
+    if (!get_command(e, cmd, 1, 4))
+        return 0;
+    addr   = cmd[1] << 8 | cmd[2];
+    nbytes = cmd[3];
+    if (addr + nbytes > (int)sizeof(e->radio->mem))
+        return 1;
+
+    if (c == 'S' || c == 'R') {
+        // Read block.
+        if (trace_flag)
+            printf("# Emulator: read 0x%04x\n", addr);
+        cmd[0] = is_uv5r ? 'X' : 'W';
+        if (e->read_max > 0 && nbytes > e->read_max)
+            cmd[3] = nbytes = e->read_max;
+        memcpy(&cmd[4], &e->radio->mem[addr], nbytes);
+        e->count.data_read += nbytes;
+        if (fault(e))
+            cmd[0] ^= 0x80;
+        send_reply(e, cmd, 4 + nbytes);
+    } else {
+        // Write block.
+        if (trace_flag)
+            printf("# Emulator: write 0x%04x\n", addr);
+        if (!get_command(e, cmd, 4, 4 + nbytes))
+            return 0;
+        if (e->write_max > 0 && nbytes > e->write_max) {
+            send_reply(e, "\x15", 1);
+            return 1;
+        }
+        if (e->writes_left == 0) {
+            // Battery is dead: no reply.
+            return 1;
+        }
+        if (e->writes_left > 0)
+            e->writes_left--;
+        memcpy(&e->radio->mem[addr], &cmd[4], nbytes);
+        e->count.data_written += nbytes;
+        send_reply_after(e, e->write_latency_usec > 0 ? e->write_latency_usec : e->latency_usec,
+                         fault(e) ? "\x15" : "\x06", 1);
+    }
+    return 1;
+}
+
+//
+// Thread: run the protocol.
+//
+static void *emu_thread(void *arg)
+{
+    emulator_t *e = arg;
+    int c;
+
+    while (!e->stop) {
+        c = get_byte(e, e->state == EMU_IDLE ? 50 : RESET_MSEC);
+        if (c < 0) {
+            // Radio resets when the host is silent.
+            e->state        = EMU_IDLE;
+            e->ack_deferred = 0;
+            continue;
+        }
+
+        switch (e->state) {
+        case EMU_IDLE:
+            memmove(&e->magic[0], &e->magic[1], sizeof(e->magic) - 1);
+            e->magic[sizeof(e->magic) - 1] = c;
+            if (magic_matches(e)) {
+                memset(e->magic, 0, sizeof(e->magic));
+                send_reply(e, "\x06", 1);
+                e->state = EMU_IDENT;
+            }
+            break;
+        case EMU_IDENT:
+            if (c == 0x02) {
+                send_reply(e, e->radio->image_ident, 8);
+            } else if (c == 0x06) {
+                send_reply(e, "\x06", 1);
+                e->state = EMU_CLONE;
+            } else {
+                e->state = EMU_IDLE;
+            }
+            break;
+        case EMU_CLONE:
+            if (!clone_command(e, c))
+                e->state = EMU_IDLE;
+            break;
+        }
+    }
+    return NULL;
+}
+
+//
+// Start emulator of the radio on a pseudo-terminal.
+//
+emulator_t *emu_start(const char *filename, int byte_usec, int latency_usec, int delayed_ack)
+{
+    emulator_t *e = calloc(1, sizeof(emulator_t));
+    struct termios mode;
+
+    if (!e) {
+        fprintf(stderr, "Out of memory.\n");
+        exit(-1);
+    }
+    e->byte_usec    = byte_usec;
+    e->latency_usec = latency_usec;
+    e->delayed_ack  = delayed_ack;
+    e->writes_left  = -1;
+    e->radio        = radio_session_new();
+    radio_read_image(e->radio, filename);
+
+    // Create pseudo-terminal.
+    e->master_fd = posix_openpt(O_RDWR | O_NOCTTY);
+    if (e->master_fd < 0 || grantpt(e->master_fd) < 0 || unlockpt(e->master_fd) < 0) {
+        perror("Pseudo-terminal");
+        exit(-1);
+    }
+    strncpy(e->port_name, ptsname(e->master_fd), sizeof(e->port_name) - 1);
+    e->slave_fd = open(e->port_name, O_RDWR | O_NOCTTY);
+    if (e->slave_fd < 0) {
+        perror(e->port_name);
+        exit(-1);
+    }
+
+    // Binary data: no echo, no processing of special characters.
+    tcgetattr(e->slave_fd, &mode);
+    cfmakeraw(&mode);
+    tcsetattr(e->slave_fd, TCSANOW, &mode);
+
+    if (pthread_create(&e->thread, NULL, emu_thread, e) != 0) {
+        perror("Emulator thread");
+        exit(-1);
+    }
+    return e;
+}
+
+//
+// Stop the emulator.
+//
+void emu_stop(emulator_t *e)
+{
+    e->stop = 1;
+    pthread_join(e->thread, NULL);
+    close(e->slave_fd);
+    close(e->master_fd);
+    radio_session_free(e->radio);
+    free(e);
+}
+
+//
+// Get name of the serial port.
+//
+const char *emu_port_name(emulator_t *e)
+{
+    return e->port_name;
+}
+
+//
+// Get the emulated radio.
+//
+radio_session_t *emu_radio(emulator_t *e)
+{
+    return e->radio;
+}
+
+//
+// Get traffic counters.
+//
+void emu_get_counters(emulator_t *e, emu_counters_t *count)
+{
+    *count = e->count;
+}
+
+//
+// Change the delays before replies.
+//
+void emu_set_latency(emulator_t *e, int latency_usec, int write_latency_usec)
+{
+    e->latency_usec       = latency_usec;
+    e->write_latency_usec = write_latency_usec;
+}
+
+//
+// Limit the size of blocks.
+//
+void emu_limit_blocks(emulator_t *e, int read_max, int write_max)
+{
+    e->read_max  = read_max;
+    e->write_max = write_max;
+}
+
+//
+// Corrupt every n-th reply to block read or write.
+//
+void emu_inject_faults(emulator_t *e, int every)
+{
+    e->fault_every = every;
+}
+
+//
+// Stop answering block writes after the given number of them.
+//
+void emu_fail_writes(emulator_t *e, int after)
+{
+    e->writes_left = after;
+}
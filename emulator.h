@@ -0,0 +1,108 @@
+/*
+ * Emulator of Baofeng radios on a pseudo-terminal.
+ *
+ * Copyright (C) 2013-2023 Serge Vakulenko, KK6ABQ
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   1. Redistributions of source code must retain the above copyright notice,
+ *      this list of conditions and the following disclaimer.
+ *   2. Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in the
+ *      documentation and/or other materials provided with the distribution.
+ *   3. The name of the author may not be used to endorse or promote products
+ *      derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO
+ * EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifndef EMULATOR_H
+#define EMULATOR_H
+
+#include "radio.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct emulator emulator_t;
+
+//
+// Traffic through the emulated serial line.
+//
+typedef struct {
+    unsigned long rx_bytes;     // Bytes received from the host
+    unsigned long tx_bytes;     // Bytes sent to the host
+    unsigned long data_read;    // Memory bytes read by the host
+    unsigned long data_written; // Memory bytes written by the host
+} emu_counters_t;
+
+//
+// Start emulator of the radio on a pseudo-terminal.
+// Type of radio and memory contents are taken from the image file.
+// Byte_usec is the time to transfer one byte (1042 for 9600 baud),
+// or 0 for no delay.  Latency_usec is a delay before every reply.
+// With delayed_ack, acknowledge of block read is sent only before
+// the reply to the next command, like BF-F8HP does.
+//
+emulator_t *emu_start(const char *filename, int byte_usec, int latency_usec, int delayed_ack);
+
+//
+// Stop the emulator.
+//
+void emu_stop(emulator_t *e);
+
+//
+// Get name of the serial port, to be used by radio_connect().
+//
+const char *emu_port_name(emulator_t *e);
+
+//
+// Get the emulated radio: device type and memory contents.
+//
+radio_session_t *emu_radio(emulator_t *e);
+
+//
+// Simulate a bad cable: corrupt every n-th reply to block read
+// or write.  Zero means no faults.
+//
+void emu_inject_faults(emulator_t *e, int every);
+
+//
+// Change the delays before replies.  Write_latency_usec is the delay
+// before acknowledge of block write, as a radio programs its memory
+// first; zero means the same as latency_usec.
+//
+void emu_set_latency(emulator_t *e, int latency_usec, int write_latency_usec);
+
+//
+// Simulate a radio switched off during upload: after the given number
+// of block writes, writes are not acknowledged.  Negative means no limit.
+//
+void emu_fail_writes(emulator_t *e, int after);
+
+//
+// Limit the size of blocks: a longer read is answered with only
+// read_max bytes, and a longer write is refused.  Zero means no limit.
+//
+void emu_limit_blocks(emulator_t *e, int read_max, int write_max);
+
+//
+// Get traffic counters, accumulated since the start.
+//
+void emu_get_counters(emulator_t *e, emu_counters_t *count);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // EMULATOR_H
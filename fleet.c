@@ -0,0 +1,630 @@
+/*
+ * Clone many radios in parallel.
+ *
+ * Copyright (C) 2013-2023 Serge Vakulenko, KK6ABQ
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   1. Redistributions of source code must retain the above copyright notice,
+ *      this list of conditions and the following disclaimer.
+ *   2. Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in the
+ *      documentation and/or other materials provided with the distribution.
+ *   3. The name of the author may not be used to endorse or promote products
+ *      derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO
+ * EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#include "fleet.h"
+
+#include <fcntl.h>
+#include <glob.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/select.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <sys/inotify.h>
+#endif
+
+//
+// State of one job.
+//
+typedef struct {
+    const char *port_name; // Name of serial port
+    const char *tag;       // Short name of the port
+    pid_t pid;             // Child process
+    int pipe_fd;           // Receive model name and report from the child
+    char model[64];        // Detected radio model
+    char identity[256];    // Identifier and serial number of the radio
+    char report[256];      // Line of result from the child
+    struct timeval start;  // Time when the job started
+    double seconds;        // Duration of the job
+    int status;            // Exit status of the child
+} fleet_job_state_t;
+
+//
+// In the child process: write end of the pipe to the parent,
+// and the session with the radio.
+//
+static int parent_fd = -1;
+static radio_session_t *child_session;
+static char child_identity[256];
+static char child_report[256];
+
+//
+// Expand the list of port names.
+//
+int fleet_expand(int argc, char **argv, char ***ports)
+{
+    glob_t g;
+    int i, flags = GLOB_NOCHECK;
+
+    memset(&g, 0, sizeof(g));
+    for (i = 0; i < argc; i++) {
+        glob(argv[i], flags, NULL, &g);
+        flags |= GLOB_APPEND;
+    }
+
+    // The list is used until the program exits, so don't free it.
+    *ports = g.gl_pathv;
+    return g.gl_pathc;
+}
+
+//
+// Serial ports where a programming cable may be attached.
+//
+static const char *scan_patterns[] = { "/dev/ttyUSB*", "/dev/ttyACM*", "/dev/serial/by-id/*" };
+
+#define NSCAN_PATTERNS (int)(sizeof(scan_patterns) / sizeof(scan_patterns[0]))
+
+//
+// Find existing devices by patterns.  Several names of the same
+// device are reduced to the first one: links in /dev/serial/by-id
+// are added only when the device is not matched by other patterns.
+// Return the list in newly allocated memory, with names from g.
+//
+static int glob_ports(int npatterns, const char *const *patterns, glob_t *g, char ***ports)
+{
+    char **list, real[PATH_MAX], other[PATH_MAX];
+    int nports = 0, p, i, k;
+
+    memset(g, 0, sizeof(*g));
+    for (p = 0; p < npatterns; p++)
+        glob(patterns[p], p > 0 ? GLOB_APPEND : 0, NULL, g);
+
+    list = calloc(g->gl_pathc + 1, sizeof(char *));
+    if (!list) {
+        fprintf(stderr, "Out of memory.\n");
+        exit(-1);
+    }
+    for (i = 0; i < (int)g->gl_pathc; i++) {
+        if (!realpath(g->gl_pathv[i], real))
+            continue;
+        for (k = 0; k < nports; k++)
+            if (realpath(list[k], other) && strcmp(real, other) == 0)
+                break;
+        if (k == nports)
+            list[nports++] = g->gl_pathv[i];
+    }
+    *ports = list;
+    return nports;
+}
+
+//
+// Find serial ports where a programming cable may be attached.
+//
+int fleet_scan_ports(char ***ports)
+{
+    glob_t g;
+
+    // The list is used until the program exits, so don't free it.
+    return glob_ports(NSCAN_PATTERNS, scan_patterns, &g, ports);
+}
+
+//
+// Get short name of the port: /dev/ttyUSB0 -> ttyUSB0.
+//
+static const char *port_tag(const char *port_name)
+{
+    const char *tag = strrchr(port_name, '/');
+
+    return tag ? tag + 1 : port_name;
+}
+
+//
+// In the child process: report the detected model to parent,
+// then identity of the radio and the line of result on next lines.
+// Called on exit, so it works also when the job fails.
+//
+static void report_model(void)
+{
+    const char *model = radio_name(child_session);
+    char buf[sizeof(child_identity) + sizeof(child_report) + 64];
+
+    if (parent_fd >= 0) {
+        snprintf(buf, sizeof(buf), "%.63s\n%s\n%s", model ? model : "", child_identity,
+                 child_report);
+        if (write(parent_fd, buf, strlen(buf)) < 0) {
+            // Parent has gone, nothing to do.
+        }
+    }
+}
+
+//
+// In the job: set the line of result.
+//
+void fleet_report(const char *line)
+{
+    snprintf(child_report, sizeof(child_report), "%s", line);
+}
+
+//
+// In the child process: send all output to the file.
+//
+static void redirect_output(const char *filename)
+{
+    int log = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+
+    if (log < 0) {
+        perror(filename);
+        exit(-1);
+    }
+    fflush(stdout);
+    fflush(stderr);
+    dup2(log, 1);
+    dup2(log, 2);
+    close(log);
+}
+
+//
+// Start the job in a child process, with output to the log file.
+//
+static void start_job(fleet_job_state_t *j, fleet_job_t job, const char *log_filename)
+{
+    int fd[2];
+
+    if (pipe(fd) < 0) {
+        perror("pipe");
+        exit(-1);
+    }
+    gettimeofday(&j->start, NULL);
+    j->pid = fork();
+    if (j->pid < 0) {
+        perror("fork");
+        exit(-1);
+    }
+    if (j->pid == 0) {
+        // Child: send all output to the log file.
+        close(fd[0]);
+        parent_fd     = fd[1];
+        child_session = radio_session_new();
+        atexit(report_model);
+
+        redirect_output(log_filename);
+        job(child_session, j->port_name, j->tag);
+        exit(0);
+    }
+
+    // Parent.
+    close(fd[1]);
+    j->pipe_fd = fd[0];
+}
+
+//
+// Job has finished: get duration, model and report from the child.
+//
+static void read_report(fleet_job_state_t *j, int status)
+{
+    char buf[sizeof(j->model) + sizeof(j->identity) + sizeof(j->report)], *line, *newline;
+    struct timeval now;
+    int len;
+
+    gettimeofday(&now, NULL);
+    j->pid     = 0;
+    j->status  = status;
+    j->seconds = (now.tv_sec - j->start.tv_sec) + (now.tv_usec - j->start.tv_usec) / 1e6;
+
+    len = read(j->pipe_fd, buf, sizeof(buf) - 1);
+    buf[len > 0 ? len : 0] = 0;
+    close(j->pipe_fd);
+    j->identity[0] = 0;
+    j->report[0]   = 0;
+    line           = strchr(buf, '\n');
+    if (line) {
+        *line++ = 0;
+        newline = strchr(line, '\n');
+        if (newline) {
+            *newline = 0;
+            snprintf(j->report, sizeof(j->report), "%.255s", newline + 1);
+        }
+        snprintf(j->identity, sizeof(j->identity), "%.255s", line);
+    }
+    snprintf(j->model, sizeof(j->model), "%.63s", buf);
+}
+
+//
+// Wait for any job to finish.
+//
+static void finish_job(fleet_job_state_t *jobs, int njobs, int inventory)
+{
+    int status, i;
+    pid_t pid;
+
+    pid = wait(&status);
+    if (pid < 0) {
+        perror("wait");
+        exit(-1);
+    }
+    for (i = 0; i < njobs; i++) {
+        fleet_job_state_t *j = &jobs[i];
+
+        if (j->pid != pid)
+            continue;
+
+        read_report(j, status);
+        if (!inventory)
+            printf("%s: %s\n", j->port_name,
+                   (WIFEXITED(status) && WEXITSTATUS(status) == 0) ? "done" : "failed");
+        return;
+    }
+}
+
+//
+// Run the job on all ports in parallel.
+//
+int fleet_run(int nports, char **ports, fleet_job_t job, int inventory)
+{
+    fleet_job_state_t *jobs = calloc(nports, sizeof(fleet_job_state_t));
+    char log_filename[256];
+    int i, nfailed = 0;
+
+    if (!jobs) {
+        fprintf(stderr, "Out of memory.\n");
+        exit(-1);
+    }
+
+    // Output must be flushed before fork.
+    fflush(stdout);
+    fflush(stderr);
+    for (i = 0; i < nports; i++) {
+        jobs[i].port_name = ports[i];
+        jobs[i].tag       = port_tag(ports[i]);
+        if (!inventory) {
+            printf("%s: started, output to '%s.log'\n", ports[i], jobs[i].tag);
+            fflush(stdout);
+        }
+        snprintf(log_filename, sizeof(log_filename), "%s.log", jobs[i].tag);
+        start_job(&jobs[i], job, log_filename);
+    }
+    for (i = 0; i < nports; i++)
+        finish_job(jobs, nports, inventory);
+
+    if (inventory) {
+        // One line per radio, in order of ports.
+        for (i = 0; i < nports; i++) {
+            fleet_job_state_t *j = &jobs[i];
+
+            if (WIFEXITED(j->status) && WEXITSTATUS(j->status) == 0 && j->report[0]) {
+                printf("%s\n", j->report);
+            } else {
+                fprintf(stderr, "%s: failed, see '%s.log'\n", j->port_name, j->tag);
+                nfailed++;
+            }
+        }
+        free(jobs);
+        return nfailed;
+    }
+
+    // Print summary.
+    printf("\n");
+    printf("%-20s %-20s %7s  %s\n", "Port", "Model", "Time", "Result");
+    for (i = 0; i < nports; i++) {
+        fleet_job_state_t *j = &jobs[i];
+        int ok               = WIFEXITED(j->status) && WEXITSTATUS(j->status) == 0;
+
+        printf("%-20s %-20s %6.1fs  %s\n", j->port_name, j->model[0] ? j->model : "-",
+               j->seconds, ok ? "OK" : "Failed");
+        if (!ok)
+            nfailed++;
+    }
+    free(jobs);
+    return nfailed;
+}
+
+//
+// State of a port in the watch mode.
+//
+enum {
+    PORT_EMPTY, // No radio, or not probed yet
+    PORT_DONE,  // Job finished for the radio attached
+};
+
+typedef struct {
+    fleet_job_state_t job; // Child process, when running
+    char name[PATH_MAX];   // Name of the port
+    int state;             // PORT_EMPTY or PORT_DONE
+    char radio[256];       // Identity of the radio done
+    int serial;            // Radio done has a serial number
+    int present;           // Device exists
+    int open_failed;       // Probe could not open the port
+    int backoff;           // Probe interval of the radio done, in poll intervals
+    long long due;         // Time of next probe, msec
+} watch_port_t;
+
+//
+// Exit codes of the probe in the watch mode.
+//
+#define EXIT_NO_RADIO   2 // Nobody answered on the port
+#define EXIT_SAME_RADIO 3 // Radio is still attached after the job
+
+//
+// Let udev set permissions of a new device before opening it.
+//
+#define SETTLE_MSEC 500
+
+//
+// Radio left attached after the job is probed less often,
+// down to this many poll intervals.
+//
+#define MAX_BACKOFF 8
+
+static fleet_job_t watch_job;   // Job to run for every new radio
+static const char *watch_radio; // In the child: identity of the radio done on this port
+
+//
+// Get time in milliseconds.
+//
+static long long time_msec()
+{
+    struct timeval t;
+
+    gettimeofday(&t, NULL);
+    return t.tv_sec * 1000LL + t.tv_usec / 1000;
+}
+
+//
+// In the child process: probe the port, and run the job for a new radio.
+// A radio is the same when identifier, firmware and serial number
+// match, so a radio swapped between two probes is not missed.
+// Probe output is discarded; output of the job goes to the log file.
+//
+static void watch_probe(radio_session_t *s, const char *port_name, const char *tag)
+{
+    char log_filename[256];
+
+    if (!radio_probe(s, port_name) || !radio_identify(s, child_identity, sizeof(child_identity)))
+        exit(EXIT_NO_RADIO);
+    radio_disconnect(s);
+    if (watch_radio && strcmp(child_identity, watch_radio) == 0)
+        exit(EXIT_SAME_RADIO);
+
+    snprintf(log_filename, sizeof(log_filename), "%s.log", tag);
+    redirect_output(log_filename);
+    watch_job(s, port_name, tag);
+}
+
+//
+// Find ports by patterns: add new ones, and mark the removed.
+//
+static void watch_rescan(watch_port_t **ports, int *nports, int npatterns,
+                         const char *const *patterns)
+{
+    char **list;
+    int n, i, k;
+    glob_t g;
+
+    n = glob_ports(npatterns, patterns, &g, &list);
+    for (k = 0; k < *nports; k++) {
+        watch_port_t *p = &(*ports)[k];
+        int present     = 0;
+
+        for (i = 0; i < n; i++)
+            if (list[i] && strcmp(list[i], p->name) == 0) {
+                present = 1;
+                list[i] = NULL;
+            }
+        if (p->present && !present) {
+            // Adapter removed: next radio on this port is a new one.
+            printf("%s: removed\n", p->name);
+            p->state = PORT_EMPTY;
+        }
+        if (!p->present && present) {
+            // Attached again: probe soon, not after the backoff.
+            p->due = time_msec() + SETTLE_MSEC;
+        }
+        p->present = present;
+    }
+    for (i = 0; i < n; i++) {
+        watch_port_t *p;
+
+        if (!list[i])
+            continue;
+        *ports = realloc(*ports, (*nports + 1) * sizeof(watch_port_t));
+        if (!*ports) {
+            fprintf(stderr, "Out of memory.\n");
+            exit(-1);
+        }
+        p = &(*ports)[(*nports)++];
+        memset(p, 0, sizeof(*p));
+        snprintf(p->name, sizeof(p->name), "%s", list[i]);
+        p->present = 1;
+        p->due     = time_msec() + SETTLE_MSEC;
+        printf("%s: new port\n", p->name);
+    }
+
+    // Names in the job state point into the array, which may have moved.
+    for (k = 0; k < *nports; k++) {
+        (*ports)[k].job.port_name = (*ports)[k].name;
+        (*ports)[k].job.tag       = port_tag((*ports)[k].name);
+    }
+    free(list);
+    globfree(&g);
+}
+
+//
+// Check whether the identity line ends with a serial number, not "-".
+//
+static int has_serial(const char *identity)
+{
+    const char *serial = strrchr(identity, '\t');
+
+    return serial && serial[1] && strcmp(serial + 1, "-") != 0;
+}
+
+//
+// Child process has finished: update state of the port.
+//
+static void watch_finished(watch_port_t *p, int status, int poll_msec)
+{
+    int code;
+
+    read_report(&p->job, status);
+    code = WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+    if (code == EXIT_SAME_RADIO) {
+        if (p->backoff < MAX_BACKOFF)
+            p->backoff *= 2;
+        p->due = time_msec() + p->backoff * (long long)poll_msec;
+        return;
+    }
+    p->backoff = 1;
+    p->due     = time_msec() + poll_msec;
+    if (code == EXIT_NO_RADIO) {
+        if (p->state == PORT_DONE)
+            printf("%s: radio disconnected\n", p->name);
+        p->state       = PORT_EMPTY;
+        p->open_failed = 0;
+        return;
+    }
+    if (!p->job.model[0]) {
+        // Failed before a radio was detected: port not accessible.
+        if (!p->open_failed)
+            printf("%s: cannot open port\n", p->name);
+        p->open_failed = 1;
+        return;
+    }
+
+    // The radio stays done, also when failed: replace it to run the job again.
+    if (p->state == PORT_DONE)
+        printf("%s: radio replaced\n", p->name);
+    p->state  = PORT_DONE;
+    p->serial = has_serial(p->job.identity);
+    snprintf(p->radio, sizeof(p->radio), "%s", p->job.identity);
+    if (code == 0)
+        printf("%s: %s done in %.1f seconds\n", p->name, p->job.model, p->job.seconds);
+    else
+        printf("%s: %s failed, see '%s.log'\n", p->name, p->job.model, p->job.tag);
+    if (!p->serial)
+        printf("%s: no serial number, remove the port for the next radio\n", p->name);
+}
+
+//
+// Open watch for new devices in /dev.  Return -1 when not available.
+//
+static int watch_dev(void)
+{
+#ifdef __linux__
+    int fd = inotify_init1(IN_NONBLOCK);
+
+    if (fd >= 0 && inotify_add_watch(fd, "/dev", IN_CREATE | IN_DELETE | IN_ATTRIB) < 0) {
+        close(fd);
+        fd = -1;
+    }
+    return fd;
+#else
+    return -1;
+#endif
+}
+
+//
+// Wait up to given time for changes in /dev.
+// Return 1 when something has changed.
+//
+static int watch_wait(int fd, int msec)
+{
+    struct timeval timo = { msec / 1000, (msec % 1000) * 1000 };
+    char buf[4096];
+    fd_set rset;
+    int changed = 0;
+
+    FD_ZERO(&rset);
+    if (fd >= 0)
+        FD_SET(fd, &rset);
+    if (select(fd + 1, &rset, NULL, NULL, &timo) <= 0 || fd < 0)
+        return 0;
+
+    // Drain all events: any of them means to rescan.
+    while (read(fd, buf, sizeof(buf)) > 0)
+        changed = 1;
+    return changed;
+}
+
+//
+// Watch for radios on serial ports, run the job for every new one.
+//
+void fleet_watch(int npatterns, char **patterns, fleet_job_t job, int poll_sec)
+{
+    const char *const *names = (const char *const *)patterns;
+    watch_port_t *ports      = NULL;
+    int nports = 0, poll_msec = poll_sec * 1000, fd, status, k;
+    long long rescan_time = 0;
+    pid_t pid;
+
+    if (npatterns == 0) {
+        npatterns = NSCAN_PATTERNS;
+        names     = scan_patterns;
+    }
+    watch_job = job;
+    fd        = watch_dev();
+    printf("Watch for radios, probe idle ports every %d seconds.\n", poll_sec);
+    for (;;) {
+        // Devices are rescanned on changes in /dev, or by timer.
+        if (time_msec() >= rescan_time) {
+            watch_rescan(&ports, &nports, npatterns, names);
+            rescan_time = time_msec() + poll_msec;
+        }
+
+        // Start probes of idle ports.
+        // Without a serial number, another radio could not be told
+        // from the one done: such port waits until removed.
+        for (k = 0; k < nports; k++) {
+            watch_port_t *p = &ports[k];
+
+            if (p->state == PORT_DONE && !p->serial)
+                continue;
+            if (p->job.pid == 0 && p->present && time_msec() >= p->due) {
+                watch_radio = (p->state == PORT_DONE) ? p->radio : NULL;
+                fflush(stdout);
+                fflush(stderr);
+                start_job(&p->job, watch_probe, "/dev/null");
+            }
+        }
+
+        if (watch_wait(fd, 1000))
+            rescan_time = 0;
+
+        // Collect finished children.
+        while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+            for (k = 0; k < nports; k++) {
+                if (ports[k].job.pid == pid) {
+                    watch_finished(&ports[k], status, poll_msec);
+                    break;
+                }
+            }
+        }
+    }
+}
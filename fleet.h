@@ -0,0 +1,87 @@
+/*
+ * Clone many radios in parallel.
+ *
+ * Copyright (C) 2013-2023 Serge Vakulenko, KK6ABQ
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   1. Redistributions of source code must retain the above copyright notice,
+ *      this list of conditions and the following disclaimer.
+ *   2. Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in the
+ *      documentation and/or other materials provided with the distribution.
+ *   3. The name of the author may not be used to endorse or promote products
+ *      derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO
+ * EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifndef FLEET_H
+#define FLEET_H
+
+#include "radio.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+//
+// Job to run on one port.
+// Tag is a short name of the port, to be used in names of output files.
+//
+typedef void (*fleet_job_t)(radio_session_t *s, const char *port_name, const char *tag);
+
+//
+// Expand the list of port names: patterns like /dev/ttyUSB*
+// are replaced by matching device names.
+// Return the number of ports.
+//
+int fleet_expand(int argc, char **argv, char ***ports);
+
+//
+// Find serial ports where a programming cable may be attached:
+// /dev/ttyUSB*, /dev/ttyACM* and other devices in /dev/serial/by-id.
+// Return the number of ports.
+//
+int fleet_scan_ports(char ***ports);
+
+//
+// Run the job on all ports in parallel, print a summary table.
+// Output of every job goes to file '<tag>.log'.
+// With inventory, only the lines from fleet_report() are printed,
+// in order of ports, and failures go to stderr.
+// Return the number of failed jobs.
+//
+int fleet_run(int nports, char **ports, fleet_job_t job, int inventory);
+
+//
+// Watch for radios on serial ports, until killed: new devices are
+// noticed by inotify on /dev, and idle ports are probed every poll_sec
+// seconds.  When a new radio answers, the job is run for it, in a child
+// process with output to '<tag>.log'.  The job is not repeated for
+// the same radio, by identifier, firmware and serial number: only after
+// it is disconnected from the port, or replaced by another radio.
+// Patterns of port names are like in fleet_expand(); none means
+// all USB serial ports, like fleet_scan_ports().
+//
+void fleet_watch(int npatterns, char **patterns, fleet_job_t job, int poll_sec);
+
+//
+// In the job: set one line of result, to be passed to the parent.
+//
+void fleet_report(const char *line);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // FLEET_H
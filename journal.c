@@ -0,0 +1,231 @@
+/*
+ * Journal of transferred blocks, to resume an interrupted download or upload.
+ *
+ * Copyright (C) 2013-2023 Serge Vakulenko, KK6ABQ
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   1. Redistributions of source code must retain the above copyright notice,
+ *      this list of conditions and the following disclaimer.
+ *   2. Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in the
+ *      documentation and/or other materials provided with the distribution.
+ *   3. The name of the author may not be used to endorse or promote products
+ *      derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO
+ * EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "cache.h"
+#include "radio.h"
+#include "util.h"
+
+//
+// Get name of the journal file for the port and direction.
+// Journal belongs to the adapter when it has an identity, else to the port name.
+// Download and upload have separate journals: the download before
+// an upload (-c, -w -d) must not discard the journal of the upload.
+//
+static int journal_filename(radio_session_t *s, int write_flag, char *filename, int size)
+{
+    const char *dir = cache_dir();
+    char key[256], *p;
+
+    if (!dir)
+        return 0;
+    if (!serial_identity(s->port_name, key, sizeof(key)))
+        snprintf(key, sizeof(key), "%s", s->port_name);
+    for (p = key; *p; p++)
+        if (*p == '/' || *p == '\\' || *p == ':' || *p == ' ')
+            *p = '_';
+    return snprintf(filename, size, "%s/journal-%s-%s", dir, key,
+                    write_flag ? "upload" : "download") < size;
+}
+
+//
+// Checksum of the image to be written: FNV-1a.
+//
+static unsigned image_checksum(radio_session_t *s)
+{
+    unsigned sum = 2166136261u;
+    unsigned i;
+
+    for (i = 0; i < sizeof(s->mem); i++)
+        sum = (sum ^ s->mem[i]) * 16777619u;
+    return sum;
+}
+
+//
+// Load the journal of the previous transfer, when it matches this one.
+// For download, contents of completed blocks are loaded too.
+// Return the number of completed blocks.
+//
+static int journal_load(radio_session_t *s, const char *filename, const char *header)
+{
+    FILE *fd = fopen(filename, "r");
+    char line[1024], *p;
+    int nblocks = 0;
+
+    if (!fd)
+        return 0;
+    if (!fgets(line, sizeof(line), fd) || strcmp(line, header) != 0) {
+        fprintf(stderr, "Journal is for another transfer, starting over.\n");
+        fclose(fd);
+        return 0;
+    }
+    while (fgets(line, sizeof(line), fd)) {
+        unsigned addr = strtoul(line, &p, 16);
+        int nbytes    = 0;
+
+        if (*p != ' ')
+            break;
+        nbytes = strtoul(p + 1, &p, 16);
+        if (nbytes <= 0 || addr + nbytes > sizeof(s->mem))
+            break;
+        if (s->journal_write) {
+            if (*p != '\n')
+                break;
+        } else {
+            // Download: block contents follow.
+            unsigned char data[256];
+            int i;
+
+            if (nbytes > (int)sizeof(data))
+                break;
+            for (i = 0; i < nbytes; i++) {
+                unsigned byte;
+
+                if (sscanf(p, " %2x", &byte) != 1)
+                    break;
+                data[i] = byte;
+                p += 3;
+            }
+            if (i < nbytes)
+                break;
+            memcpy(&s->journal_data[addr], data, nbytes);
+        }
+        memset(&s->journal_done[addr], 1, nbytes);
+        nblocks++;
+    }
+    fclose(fd);
+    return nblocks;
+}
+
+//
+// Start the journal of download or upload.
+// With resume, blocks completed by the previous run are skipped.
+//
+void radio_journal_start(radio_session_t *s, int write_flag)
+{
+    char filename[1024], header[128];
+    int nblocks = 0;
+    int i;
+
+    memset(s->journal_done, 0, sizeof(s->journal_done));
+    s->journal_write = write_flag;
+    s->journal       = NULL;
+    if (!journal_filename(s, write_flag, filename, sizeof(filename)))
+        return;
+
+    // Journal must be for the same type of radio, same direction,
+    // and for upload - the same radio, by serial number when it was
+    // downloaded before, and the same image.
+    snprintf(header, sizeof(header), "%s", write_flag ? "upload" : "download");
+    for (i = 0; i < (int)sizeof(s->ident); i++)
+        snprintf(header + strlen(header), sizeof(header) - strlen(header), " %02x", s->ident[i]);
+    if (write_flag) {
+        int addr = s->device->serial_addr;
+
+        strcat(header, " ");
+        if (addr > 0 && s->backup_valid) {
+            for (i = 0; i < 16; i++)
+                snprintf(header + strlen(header), sizeof(header) - strlen(header), "%02x",
+                         s->backup[addr + i]);
+        } else {
+            strcat(header, "-");
+        }
+        snprintf(header + strlen(header), sizeof(header) - strlen(header), " %08x",
+                 image_checksum(s));
+    }
+    strcat(header, "\n");
+
+    if (s->resume)
+        nblocks = journal_load(s, filename, header);
+    if (nblocks > 0) {
+        fprintf(stderr, "Resume: %d blocks done before.\n", nblocks);
+        s->journal = fopen(filename, "a");
+    } else {
+        memset(s->journal_done, 0, sizeof(s->journal_done));
+        s->journal = fopen(filename, "w");
+        if (s->journal)
+            fputs(header, s->journal);
+    }
+    if (s->journal)
+        fflush(s->journal);
+}
+
+//
+// Transfer finished: when done, the journal is not needed anymore.
+// A failed transfer keeps it, to be resumed.
+//
+void radio_journal_finish(radio_session_t *s, int done)
+{
+    char filename[1024];
+
+    if (!s->journal)
+        return;
+    fclose(s->journal);
+    s->journal = NULL;
+    if (done && journal_filename(s, s->journal_write, filename, sizeof(filename)))
+        unlink(filename);
+}
+
+//
+// Check whether the block was transferred by the previous run.
+// For download, get the contents of the block.
+//
+int radio_journal_done(radio_session_t *s, int addr, unsigned char *data, int nbytes)
+{
+    int i;
+
+    if (!s->journal)
+        return 0;
+    for (i = 0; i < nbytes; i++)
+        if (!s->journal_done[addr + i])
+            return 0;
+    if (data)
+        memcpy(data, &s->journal_data[addr], nbytes);
+    return 1;
+}
+
+//
+// Record the block as transferred.
+// For download, the contents are saved too.
+//
+void radio_journal_add(radio_session_t *s, int addr, const unsigned char *data, int nbytes)
+{
+    int i;
+
+    if (!s->journal)
+        return;
+    fprintf(s->journal, "%04x %x", addr, nbytes);
+    if (!s->journal_write) {
+        for (i = 0; i < nbytes; i++)
+            fprintf(s->journal, " %02x", data[i]);
+    }
+    fputc('\n', s->journal);
+    fflush(s->journal);
+}
@@ -0,0 +1,341 @@
+/*
+ * Histograms of reply latency, per cable and per radio model.
+ *
+ * Copyright (C) 2013-2023 Serge Vakulenko, KK6ABQ
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   1. Redistributions of source code must retain the above copyright notice,
+ *      this list of conditions and the following disclaimer.
+ *   2. Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in the
+ *      documentation and/or other materials provided with the distribution.
+ *   3. The name of the author may not be used to endorse or promote products
+ *      derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO
+ * EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#include "latency.h"
+
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#ifndef MINGW32
+#include <fcntl.h>
+#include <sys/file.h>
+#endif
+
+#ifndef PATH_MAX
+#define PATH_MAX 1024
+#endif
+
+//
+// Buckets with 16 steps per power of two, like HDR histogram:
+// values below 32 usec are exact, others within 1/16.
+// Up to 2^27 usec, which is more than two minutes.
+//
+#define SUB_BITS 4
+#define SUB_MASK ((1 << SUB_BITS) - 1)
+#define NBUCKETS ((27 - SUB_BITS + 1) << SUB_BITS)
+
+//
+// Histogram of one type of exchange, for a cable and a model.
+//
+typedef struct {
+    char cable[128];              // Identity of the serial adapter
+    char model[32];               // Name of radio
+    int kind;                     // Type of exchange
+    unsigned long count;          // Number of values
+    unsigned long hist[NBUCKETS]; // Number of values per bucket
+} histogram_t;
+
+static const char *kind_name[LAT_NKINDS] = {
+    "probe", "read-header", "read-data", "read-ack", "write-ack",
+};
+
+//
+// Histograms of one session.
+//
+struct latency {
+    const char *output; // File to merge into
+    histogram_t *table; // Histograms collected
+    int nentries;       // Number of histograms
+    latency_t *next;    // Next open table
+};
+
+static latency_t *open_list; // Tables to merge at exit
+
+//
+// Get bucket index for the value.
+//
+static int bucket_of(unsigned long usec)
+{
+    int msb = 0;
+
+    if (usec < (2 << SUB_BITS))
+        return usec;
+    if (usec >= (1UL << 27))
+        return NBUCKETS - 1;
+    while ((usec >> msb) > 1)
+        msb++;
+    return ((msb - SUB_BITS + 1) << SUB_BITS) + ((usec >> (msb - SUB_BITS)) & SUB_MASK);
+}
+
+//
+// Get the lowest value of the bucket.
+//
+static unsigned long bucket_value(int index)
+{
+    int shift;
+
+    if (index < (2 << SUB_BITS))
+        return index;
+    shift = (index >> SUB_BITS) - 1;
+    return ((1UL << SUB_BITS) + (index & SUB_MASK)) << shift;
+}
+
+//
+// Find the histogram, or create a new one.
+//
+static histogram_t *find(latency_t *l, const char *cable, const char *model, int kind)
+{
+    int i;
+
+    for (i = 0; i < l->nentries; i++) {
+        histogram_t *h = &l->table[i];
+
+        if (h->kind == kind && strncmp(h->cable, cable, sizeof(h->cable) - 1) == 0 &&
+            strncmp(h->model, model, sizeof(h->model) - 1) == 0)
+            return h;
+    }
+    l->table = realloc(l->table, (l->nentries + 1) * sizeof(histogram_t));
+    if (!l->table) {
+        fprintf(stderr, "Out of memory.\n");
+        exit(-1);
+    }
+    histogram_t *h = &l->table[l->nentries++];
+    memset(h, 0, sizeof(*h));
+    snprintf(h->cable, sizeof(h->cable), "%s", cable);
+    snprintf(h->model, sizeof(h->model), "%s", model);
+    h->kind = kind;
+    return h;
+}
+
+//
+// Add the latency of an exchange.
+//
+void latency_add(latency_t *l, const char *cable, const char *model, int kind, long long usec)
+{
+    histogram_t *h;
+
+    if (!l)
+        return;
+    h = find(l, cable, model, kind);
+    h->hist[bucket_of(usec > 0 ? usec : 0)]++;
+    h->count++;
+}
+
+//
+// Load histograms from file, adding them to the table.
+// Line format: cable <tab> model <tab> kind <tab> value:count...
+//
+static void load(latency_t *l, FILE *in)
+{
+    static char line[16384];
+    char *cable, *model, *kind, *p, *end;
+    int k;
+
+    while (fgets(line, sizeof(line), in)) {
+        line[strcspn(line, "\r\n")] = 0;
+        cable = strtok(line, "\t");
+        model = strtok(NULL, "\t");
+        kind  = strtok(NULL, "\t");
+        p     = strtok(NULL, "\t");
+        if (!cable || !model || !kind || !p)
+            continue;
+        for (k = 0; k < LAT_NKINDS; k++)
+            if (strcmp(kind, kind_name[k]) == 0)
+                break;
+        if (k == LAT_NKINDS)
+            continue;
+
+        histogram_t *h = find(l, cable, model, k);
+        while (*p) {
+            unsigned long value = strtoul(p, &end, 10);
+            if (*end != ':')
+                break;
+            unsigned long count = strtoul(end + 1, &p, 10);
+            h->hist[bucket_of(value)] += count;
+            h->count += count;
+            while (*p == ' ')
+                p++;
+        }
+    }
+}
+
+//
+// Write all histograms to file.
+//
+static void save(latency_t *l, FILE *out)
+{
+    int i, b;
+
+    for (i = 0; i < l->nentries; i++) {
+        histogram_t *h  = &l->table[i];
+        const char *sep = "\t";
+
+        fprintf(out, "%s\t%s\t%s", h->cable, h->model, kind_name[h->kind]);
+        for (b = 0; b < NBUCKETS; b++) {
+            if (h->hist[b]) {
+                fprintf(out, "%s%lu:%lu", sep, bucket_value(b), h->hist[b]);
+                sep = " ";
+            }
+        }
+        fprintf(out, "\n");
+    }
+}
+
+//
+// Merge histograms into the file.
+// The file is rewritten under a temporary name, and then renamed.
+// Writers are serialized by a lock file, like in cache_put().
+//
+static void merge(latency_t *l, const char *filename)
+{
+    char tmpname[PATH_MAX];
+    int lock = -1;
+    FILE *in, *out;
+
+    if (snprintf(tmpname, sizeof(tmpname), "%s.%d", filename, (int)getpid()) >=
+        (int)sizeof(tmpname))
+        return;
+#ifndef MINGW32
+    char lockname[PATH_MAX];
+    if (snprintf(lockname, sizeof(lockname), "%s.lock", filename) < (int)sizeof(lockname)) {
+        lock = open(lockname, O_RDWR | O_CREAT, 0644);
+        if (lock >= 0)
+            flock(lock, LOCK_EX);
+    }
+#endif
+    in = fopen(filename, "r");
+    if (in) {
+        load(l, in);
+        fclose(in);
+    }
+    out = fopen(tmpname, "w");
+    if (!out) {
+        perror(tmpname);
+    } else {
+        save(l, out);
+        if (fclose(out) != 0 || rename(tmpname, filename) != 0) {
+            perror(filename);
+            unlink(tmpname);
+        }
+    }
+    if (lock >= 0)
+        close(lock);
+}
+
+//
+// Get the value below which the given fraction of samples falls, in msec.
+//
+static double percentile(const histogram_t *h, double fraction)
+{
+    unsigned long n = 0, need = h->count * fraction;
+    int b;
+
+    for (b = 0; b < NBUCKETS; b++) {
+        n += h->hist[b];
+        if (n > need)
+            break;
+    }
+    if (b == NBUCKETS)
+        b--;
+    return bucket_value(b) / 1000.0;
+}
+
+//
+// Print percentiles for every histogram.
+//
+void latency_print(latency_t *l, FILE *out)
+{
+    int i, b;
+
+    if (l->nentries == 0)
+        return;
+    fprintf(out, "%-32s %-18s %-11s %7s %7s %7s %7s %7s\n", "Cable", "Model", "Exchange",
+            "Count", "p50", "p90", "p99", "Max");
+    for (i = 0; i < l->nentries; i++) {
+        const histogram_t *h = &l->table[i];
+
+        if (h->count == 0)
+            continue;
+        for (b = NBUCKETS - 1; b > 0 && !h->hist[b]; b--)
+            continue;
+        fprintf(out, "%-32s %-18s %-11s %7lu %7.1f %7.1f %7.1f %7.1f\n", h->cable, h->model,
+                kind_name[h->kind], h->count, percentile(h, 0.5), percentile(h, 0.9),
+                percentile(h, 0.99), bucket_value(b) / 1000.0);
+    }
+    fprintf(out, "Latency in msec.\n");
+}
+
+//
+// Merge all open tables at exit.
+//
+static void close_all()
+{
+    while (open_list)
+        latency_close(open_list);
+}
+
+//
+// Collect histograms, and merge them into the file at exit.
+//
+latency_t *latency_open(const char *filename)
+{
+    static int registered;
+    latency_t *l = calloc(1, sizeof(latency_t));
+
+    if (!l) {
+        fprintf(stderr, "Out of memory.\n");
+        exit(-1);
+    }
+    l->output = filename;
+    l->next   = open_list;
+    open_list = l;
+    if (!registered) {
+        atexit(close_all);
+        registered = 1;
+    }
+    return l;
+}
+
+//
+// Merge histograms into the file, print the result and stop collecting.
+//
+void latency_close(latency_t *l)
+{
+    latency_t **p;
+
+    for (p = &open_list; *p; p = &(*p)->next) {
+        if (*p == l) {
+            *p = l->next;
+            break;
+        }
+    }
+    merge(l, l->output);
+    latency_print(l, stderr);
+    free(l->table);
+    free(l);
+}
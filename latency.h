@@ -0,0 +1,81 @@
+/*
+ * Histograms of reply latency, per cable and per radio model.
+ *
+ * Copyright (C) 2013-2023 Serge Vakulenko, KK6ABQ
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   1. Redistributions of source code must retain the above copyright notice,
+ *      this list of conditions and the following disclaimer.
+ *   2. Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in the
+ *      documentation and/or other materials provided with the distribution.
+ *   3. The name of the author may not be used to endorse or promote products
+ *      derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO
+ * EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifndef LATENCY_H
+#define LATENCY_H
+
+#include <stdio.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+//
+// Types of exchange with the radio.
+//
+enum {
+    LAT_PROBE,       // Magic and identifier
+    LAT_READ_HEADER, // Reply to read command
+    LAT_READ_DATA,   // Data of block read
+    LAT_READ_ACK,    // Acknowledge of block read
+    LAT_WRITE_ACK,   // Acknowledge of block write
+    LAT_NKINDS
+};
+
+//
+// Table of histograms, collected by one session.
+//
+typedef struct latency latency_t;
+
+//
+// Collect histograms, and merge them into the file at exit.
+// Many processes can update the same file.
+//
+latency_t *latency_open(const char *filename);
+
+//
+// Merge histograms into the file, print the result and stop collecting.
+//
+void latency_close(latency_t *l);
+
+//
+// Add the latency of an exchange, in microseconds.
+// Cable is the identity of the serial adapter, or the port name.
+// Nothing is done when the table is NULL.
+//
+void latency_add(latency_t *l, const char *cable, const char *model, int kind, long long usec);
+
+//
+// Print percentiles for every histogram.
+//
+void latency_print(latency_t *l, FILE *out);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // LATENCY_H
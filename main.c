@@ -25,14 +25,74 @@
  * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
  * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
  */
+#include <getopt.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 
+#include "latency.h"
 #include "radio.h"
+#include "stats.h"
+#include "timeline.h"
 #include "util.h"
+#ifndef MINGW32
+#include "emulator.h"
+#include "fleet.h"
+#endif
+
+//
+// Long options without short equivalent.
+//
+enum {
+    OPT_MODEL = 256,
+    OPT_RESUME,
+    OPT_CAPTURE,
+    OPT_TIMELINE,
+    OPT_STATS,
+    OPT_HISTOGRAM,
+    OPT_LOW_LATENCY,
+    OPT_WINDOW,
+    OPT_CALIBRATE,
+    OPT_IDENTIFY,
+    OPT_SCAN,
+    OPT_WATCH_PORTS,
+    OPT_BAUD,
+    OPT_LATENCY,
+    OPT_DELAYED_ACK,
+};
+
+static const struct option long_options[] = {
+    { "model", required_argument, NULL, OPT_MODEL },
+    { "resume", no_argument, NULL, OPT_RESUME },
+    { "capture", required_argument, NULL, OPT_CAPTURE },
+    { "timeline", required_argument, NULL, OPT_TIMELINE },
+    { "stats", optional_argument, NULL, OPT_STATS },
+    { "histogram", required_argument, NULL, OPT_HISTOGRAM },
+    { "window", required_argument, NULL, OPT_WINDOW },
+    { "calibrate", no_argument, NULL, OPT_CALIBRATE },
+    { "identify", no_argument, NULL, OPT_IDENTIFY },
+#ifndef MINGW32
+    { "low-latency", no_argument, NULL, OPT_LOW_LATENCY },
+    { "scan", no_argument, NULL, OPT_SCAN },
+    { "watch-ports", optional_argument, NULL, OPT_WATCH_PORTS },
+    { "emulate", no_argument, NULL, 'e' },
+    { "baud", required_argument, NULL, OPT_BAUD },
+    { "latency", required_argument, NULL, OPT_LATENCY },
+    { "delayed-ack", no_argument, NULL, OPT_DELAYED_ACK },
+#endif
+    { NULL, 0, NULL, 0 },
+};
 
-extern char *optarg;
-extern int optind;
+static const char *job_filename;   // Image or config file for the fleet job
+static bool delta_flag;            // Write only changed blocks
+static const char *model_name;     // Type of radio, to skip probing
+static bool resume_flag;           // Continue interrupted transfer
+static const char *capture_file;   // Capture of the serial protocol
+static const char *timeline_file;  // Timeline of the session, Chrome trace format
+static bool stats_flag;            // Print statistics at exit
+static bool stats_json;            // Print statistics in JSON format
+static const char *histogram_file; // Latency histograms, merged across runs
+static int window = 1;             // Upload: frames sent before waiting for acknowledge
 
 void usage()
 {
@@ -42,7 +102,7 @@ void usage()
     fprintf(stderr, _("    baoclone [-v] port\n"));
     fprintf(stderr, _("                          Save device image to file 'device.img',\n"));
     fprintf(stderr, _("                          and text configuration to 'device.conf'.\n"));
-    fprintf(stderr, _("    baoclone -w [-v] port file.img\n"));
+    fprintf(stderr, _("    baoclone -w [-v] [-d] port file.img\n"));
     fprintf(stderr, _("                          Write image to device.\n"));
     fprintf(stderr, _("    baoclone -c [-v] port file.conf\n"));
     fprintf(stderr, _("                          Configure device from text file.\n"));
@@ -53,21 +113,268 @@ void usage()
     fprintf(stderr, _("    baoclone -a [-v] port mhz\n"));
     fprintf(stderr, _("    baoclone -b [-v] port mhz\n"));
     fprintf(stderr, _("                          Set VFO A or B mode with given frequency.\n"));
+    fprintf(stderr, _("    baoclone --identify [-v] port\n"));
+    fprintf(stderr, _("                          Print port, model, identifier, firmware\n"));
+    fprintf(stderr, _("                          and serial number, without full download.\n"));
+    fprintf(stderr, _("    baoclone --calibrate [-v] port\n"));
+    fprintf(stderr, _("                          Find the largest blocks accepted by device,\n"));
+    fprintf(stderr, _("                          and use them for this firmware from now on.\n"));
+#ifndef MINGW32
+    fprintf(stderr, _("    baoclone -m [-v] port...\n"));
+    fprintf(stderr, _("    baoclone -m -w [-v] [-d] port... file.img\n"));
+    fprintf(stderr, _("    baoclone -m -c [-v] port... file.conf\n"));
+    fprintf(stderr, _("    baoclone -m --identify [-v] port...\n"));
+    fprintf(stderr, _("    baoclone --scan [-v] [port...]\n"));
+    fprintf(stderr, _("                          Find which ports have a radio attached.\n"));
+    fprintf(stderr, _("                          By default, try all USB serial ports.\n"));
+    fprintf(stderr, _("    baoclone --watch-ports[=sec] [-v] [port...]\n"));
+    fprintf(stderr, _("    baoclone --watch-ports[=sec] -w [-v] [-d] [port...] file.img\n"));
+    fprintf(stderr, _("    baoclone --watch-ports[=sec] -c [-v] [port...] file.conf\n"));
+    fprintf(stderr, _("                          Wait for radios to be attached, and process\n"));
+    fprintf(stderr, _("                          every new one, until killed.  Idle ports are\n"));
+    fprintf(stderr, _("                          probed every 5 seconds by default.\n"));
+    fprintf(stderr, _("                          Same for many devices in parallel.\n"));
+    fprintf(stderr, _("                          Patterns like '/dev/ttyUSB*' are allowed.\n"));
+    fprintf(stderr, _("                          Output files are named by port, like\n"));
+    fprintf(stderr, _("                          'device-ttyUSB0.img' or 'ttyUSB0.log'.\n"));
+    fprintf(stderr, _("    baoclone -e [-v] [--baud=N] [--latency=usec] [--delayed-ack]\n"));
+    fprintf(stderr, _("                file.img\n"));
+    fprintf(stderr, _("                          Emulate device on a pseudo-terminal,\n"));
+    fprintf(stderr, _("                          with memory contents from image file.\n"));
+    fprintf(stderr, _("Port:\n"));
+    fprintf(stderr, _("    /dev/ttyUSB0          Serial device.\n"));
+    fprintf(stderr, _("    tcp:host:port         Cable server, like ser2net.\n"));
+    fprintf(stderr, _("    emu:file.img          Emulated radio at 9600 baud.\n"));
+    fprintf(stderr, _("    replay:file           Replay of a captured session.\n"));
+#endif
     fprintf(stderr, _("Options:\n"));
     fprintf(stderr, _("    -w                    Write image to device.\n"));
     fprintf(stderr, _("    -c                    Configure device from text file.\n"));
+    fprintf(stderr, _("    -d                    Read device first, write only changed blocks.\n"));
     fprintf(stderr, _("    -v                    Trace serial protocol.\n"));
+    fprintf(stderr, _("    --model=NAME          Type of radio, like UV-5R or BF-888S:\n"));
+    fprintf(stderr, _("                          skip detection of other types.\n"));
+    fprintf(stderr, _("    --resume              Continue interrupted download or upload.\n"));
+    fprintf(stderr, _("    --capture=FILE        Write serial data to file, with timestamps.\n"));
+    fprintf(stderr, _("                          Use port 'replay:FILE' to play it back.\n"));
+    fprintf(stderr, _("    --timeline=FILE       Write timeline of the session, for Perfetto\n"));
+    fprintf(stderr, _("                          or chrome://tracing.\n"));
+    fprintf(stderr, _("    --stats[=json]        Print statistics of serial i/o and time\n"));
+    fprintf(stderr, _("                          of every phase at exit.\n"));
+    fprintf(stderr, _("    --histogram=FILE      Add latency of replies to histograms in file,\n"));
+    fprintf(stderr, _("                          per cable and model.\n"));
+    fprintf(stderr, _("    --window=N            Upload to UV-5R: send N blocks before waiting\n"));
+    fprintf(stderr, _("                          for acknowledge.  Experimental.\n"));
     fprintf(stderr, _("    -a                    Set VFO A mode.\n"));
     fprintf(stderr, _("    -b                    Set VFO B mode.\n"));
+#ifndef MINGW32
+    fprintf(stderr, _("    --low-latency         Set low latency mode of USB serial adapter.\n"));
+    fprintf(stderr, _("    -m                    Process many devices in parallel.\n"));
+    fprintf(stderr, _("    -e, --emulate         Emulate device on a pseudo-terminal.\n"));
+    fprintf(stderr, _("    --baud=N              Emulator: speed of serial line, default 9600.\n"));
+    fprintf(stderr, _("                          Use 0 for no delay.\n"));
+    fprintf(stderr, _("    --latency=usec        Emulator: delay before every reply.\n"));
+    fprintf(stderr, _("    --delayed-ack         Emulator: delay acknowledge of block read,\n"));
+    fprintf(stderr, _("                          like BF-F8HP does.\n"));
+#endif
     exit(-1);
 }
 
+static const stats_t *session_stats; // Statistics to print, or NULL when printed
+
+//
+// Print statistics once, at the end or at exit on failure:
+// text to stderr, or JSON to stdout.
+//
+static void print_stats()
+{
+    if (!session_stats)
+        return;
+    stats_print(stats_json ? stdout : stderr, session_stats, stats_json);
+    session_stats = NULL;
+}
+
+#ifndef MINGW32
+//
+// Print histograms merged by all jobs of -m or --scan.
+//
+static void print_histograms()
+{
+    if (histogram_file)
+        latency_close(latency_open(histogram_file));
+}
+#endif
+
+//
+// Dump device to image file, and print configuration to text file.
+//
+static void download_device(radio_session_t *s, const char *port_name,
+                            const char *img_filename, const char *conf_filename)
+{
+    radio_set_model(s, model_name);
+    radio_set_resume(s, resume_flag);
+    radio_set_capture(s, capture_file);
+    radio_set_histogram(s, histogram_file);
+    radio_set_window(s, window);
+    radio_connect(s, port_name);
+    if (!radio_download(s))
+        exit(-1);
+    radio_print_version(s, stdout, 1);
+    radio_disconnect(s);
+    radio_save_image(s, img_filename);
+
+    // Print configuration to file.
+    printf("Print configuration to file '%s'.\n", conf_filename);
+    FILE *conf = fopen(conf_filename, "w");
+    if (!conf) {
+        perror(conf_filename);
+        exit(-1);
+    }
+    radio_print_version(s, conf, 0);
+    radio_print_config(s, conf, 1);
+    fclose(conf);
+}
+
+//
+// Restore image file to device.
+//
+static void write_device(radio_session_t *s, const char *port_name, const char *img_filename)
+{
+    radio_set_model(s, model_name);
+    radio_set_resume(s, resume_flag);
+    radio_set_capture(s, capture_file);
+    radio_set_histogram(s, histogram_file);
+    radio_set_window(s, window);
+    radio_connect(s, port_name);
+    if (delta_flag) {
+        // Get current contents, to skip unchanged blocks.
+        if (!radio_download(s))
+            exit(-1);
+    }
+    radio_read_image(s, img_filename);
+    radio_print_version(s, stdout, 1);
+    if (!radio_upload(s, 0))
+        exit(-1);
+    radio_disconnect(s);
+}
+
+//
+// Update device from text config file.
+// Previous device image is saved to backup file.
+//
+static void configure_device(radio_session_t *s, const char *port_name,
+                             const char *conf_filename, const char *backup_filename)
+{
+    radio_set_model(s, model_name);
+    radio_set_resume(s, resume_flag);
+    radio_set_capture(s, capture_file);
+    radio_set_histogram(s, histogram_file);
+    radio_set_window(s, window);
+    radio_connect(s, port_name);
+    if (!radio_download(s))
+        exit(-1);
+    radio_print_version(s, stdout, 1);
+    radio_save_image(s, backup_filename);
+    radio_parse_config(s, conf_filename);
+    if (!radio_upload(s, 1))
+        exit(-1);
+    radio_disconnect(s);
+}
+
+//
+// Get model, firmware and serial number of device, as one line.
+//
+static void identify_device(radio_session_t *s, const char *port_name, char *line, int size)
+{
+    radio_set_model(s, model_name);
+    radio_set_capture(s, capture_file);
+    radio_set_histogram(s, histogram_file);
+    radio_connect(s, port_name);
+    if (!radio_identify(s, line, size))
+        exit(-1);
+    radio_disconnect(s);
+}
+
+#ifndef MINGW32
+//
+// Jobs for processing many devices in parallel.
+// Names of output files are derived from the port name.
+//
+static void fleet_download(radio_session_t *s, const char *port_name, const char *tag)
+{
+    char img_filename[256], conf_filename[256];
+
+    snprintf(img_filename, sizeof(img_filename), "device-%s.img", tag);
+    snprintf(conf_filename, sizeof(conf_filename), "device-%s.conf", tag);
+    download_device(s, port_name, img_filename, conf_filename);
+}
+
+static void fleet_write(radio_session_t *s, const char *port_name, const char *tag)
+{
+    write_device(s, port_name, job_filename);
+}
+
+static void fleet_configure(radio_session_t *s, const char *port_name, const char *tag)
+{
+    char backup_filename[256];
+
+    snprintf(backup_filename, sizeof(backup_filename), "backup-%s.img", tag);
+    configure_device(s, port_name, job_filename, backup_filename);
+}
+
+static void fleet_identify(radio_session_t *s, const char *port_name, const char *tag)
+{
+    char line[256];
+
+    identify_device(s, port_name, line, sizeof(line));
+    printf("%s\n", line);
+    fleet_report(line);
+}
+
+static void fleet_probe(radio_session_t *s, const char *port_name, const char *tag)
+{
+    char line[256];
+
+    radio_set_model(s, model_name);
+    radio_set_histogram(s, histogram_file);
+    if (radio_probe(s, port_name)) {
+        snprintf(line, sizeof(line), "%s\t%s", port_name, radio_name(s));
+        radio_disconnect(s);
+    } else {
+        snprintf(line, sizeof(line), "%s\t-", port_name);
+    }
+    printf("%s\n", line);
+    fleet_report(line);
+}
+
+//
+// Emulate the device on a pseudo-terminal, until killed.
+//
+static void emulate(const char *img_filename, int baud, int latency_usec, bool delayed_ack)
+{
+    emulator_t *e = emu_start(img_filename, baud ? 10000000 / baud : 0, latency_usec, delayed_ack);
+
+    printf("Emulate %s on %s.\n", radio_name(emu_radio(e)), emu_port_name(e));
+    for (;;)
+        pause();
+}
+#endif
+
 int main(int argc, char **argv)
 {
     bool write_flag = false;
     bool config_flag = false;
     bool vfo_a_flag = false;
     bool vfo_b_flag = false;
+    bool fleet_flag = false;
+    bool calibrate_flag = false;
+    bool identify_flag = false;
+    bool scan_flag = false;
+    int watch_sec = 0;
+    bool emulate_flag = false;
+    bool delayed_ack = false;
+    int baud = 9600;
+    int latency_usec = 0;
 
     // Set locale and message catalogs.
     setlocale(LC_ALL, "");
@@ -82,7 +389,7 @@ int main(int argc, char **argv)
 
     trace_flag = 0;
     for (;;) {
-        switch (getopt(argc, argv, "vcwab")) {
+        switch (getopt_long(argc, argv, "vcwabdme", long_options, NULL)) {
         case 'v':
             trace_flag = true;
             continue;
@@ -98,6 +405,67 @@ int main(int argc, char **argv)
         case 'b':
             vfo_b_flag = true;
             continue;
+        case 'd':
+            delta_flag = true;
+            continue;
+        case OPT_MODEL:
+            model_name = optarg;
+            continue;
+        case OPT_RESUME:
+            resume_flag = true;
+            continue;
+        case OPT_CAPTURE:
+            capture_file = optarg;
+            continue;
+        case OPT_TIMELINE:
+            timeline_file = optarg;
+            continue;
+        case OPT_STATS:
+            if (optarg && strcmp(optarg, "json") != 0)
+                usage();
+            stats_flag = true;
+            stats_json = (optarg != NULL);
+            continue;
+        case OPT_HISTOGRAM:
+            histogram_file = optarg;
+            continue;
+        case OPT_WINDOW:
+            window = atoi(optarg);
+            continue;
+        case OPT_CALIBRATE:
+            calibrate_flag = true;
+            continue;
+        case OPT_IDENTIFY:
+            identify_flag = true;
+            continue;
+#ifndef MINGW32
+        case OPT_LOW_LATENCY:
+            low_latency_flag = true;
+            continue;
+        case 'm':
+            fleet_flag = true;
+            continue;
+        case OPT_SCAN:
+            scan_flag = true;
+            continue;
+        case OPT_WATCH_PORTS:
+            watch_sec = optarg ? atoi(optarg) : 5;
+            if (watch_sec <= 0)
+                usage();
+            continue;
+        case 'e':
+            emulate_flag = true;
+            continue;
+        case OPT_BAUD:
+            baud = atoi(optarg);
+            continue;
+        case OPT_LATENCY:
+            latency_usec = atoi(optarg);
+            continue;
+        case OPT_DELAYED_ACK:
+            delayed_ack = true;
+            continue;
+#endif
         default:
             usage();
         case EOF:
@@ -107,32 +475,130 @@ int main(int argc, char **argv)
     }
     argc -= optind;
     argv += optind;
-    if (write_flag + config_flag > 1) {
-        fprintf(stderr, "Only one of -w or -c options is allowed.\n");
+    if (write_flag + config_flag + calibrate_flag + identify_flag + scan_flag > 1) {
+        fprintf(stderr, "Only one of -w, -c, --calibrate, --identify or --scan options "
+                        "is allowed.\n");
         usage();
     }
     setvbuf(stdout, 0, _IOLBF, 0);
     setvbuf(stderr, 0, _IOLBF, 0);
+#ifndef MINGW32
+    if (emulate_flag) {
+        // Emulate the device.
+        if (argc != 1)
+            usage();
+
+        emulate(argv[0], baud, latency_usec, delayed_ack);
+    }
+
+    if (scan_flag) {
+        // Probe all ports in parallel.
+        char **ports;
+        int nports, nfailed;
 
+        if (vfo_a_flag || vfo_b_flag || capture_file || timeline_file || stats_flag)
+            usage();
+        if (argc > 0)
+            nports = fleet_expand(argc, argv, &ports);
+        else
+            nports = fleet_scan_ports(&ports);
+        if (nports == 0) {
+            fprintf(stderr, "No serial ports found.\n");
+            exit(-1);
+        }
+        nfailed = fleet_run(nports, ports, fleet_probe, 1);
+        print_histograms();
+        return nfailed ? -1 : 0;
+    }
+
+    if (watch_sec > 0) {
+        // Process every new device attached, until killed.
+        fleet_job_t job = fleet_download;
+
+        if (write_flag || config_flag) {
+            if (argc < 1)
+                usage();
+            job_filename = argv[--argc];
+            job          = write_flag ? fleet_write : fleet_configure;
+        }
+        if (fleet_flag || identify_flag || calibrate_flag || vfo_a_flag || vfo_b_flag ||
+            capture_file || timeline_file || stats_flag)
+            usage();
+
+        fleet_watch(argc, argv, job, watch_sec);
+    }
+
+    if (fleet_flag) {
+        // Process many devices in parallel.
+        char **ports;
+        int nports, nfailed;
+        fleet_job_t job = identify_flag ? fleet_identify : fleet_download;
+
+        if (write_flag || config_flag) {
+            if (argc < 2)
+                usage();
+            job_filename = argv[--argc];
+            job          = write_flag ? fleet_write : fleet_configure;
+        }
+        if (argc < 1 || vfo_a_flag || vfo_b_flag || calibrate_flag || capture_file ||
+            timeline_file || stats_flag)
+            usage();
+
+        nports = fleet_expand(argc, argv, &ports);
+        nfailed = fleet_run(nports, ports, job, identify_flag);
+        print_histograms();
+        return nfailed ? -1 : 0;
+    }
+#endif
+
+    radio_session_t *s = radio_session_new();
+    if (timeline_file)
+        radio_set_timeline(s, timeline_open(timeline_file));
+    if (stats_flag) {
+        session_stats = &s->stats;
+        atexit(print_stats);
+    }
     if (vfo_a_flag || vfo_b_flag) {
         // Set VFO mode.
         if (argc != 2)
             usage();
 
-        radio_connect(argv[0]);
-        radio_set_vfo(vfo_b_flag, strtod(argv[1], NULL));
-        radio_disconnect();
+        radio_set_model(s, model_name);
+        radio_set_capture(s, capture_file);
+        radio_set_histogram(s, histogram_file);
+        radio_connect(s, argv[0]);
+        if (!radio_set_vfo(s, vfo_b_flag, strtod(argv[1], NULL)))
+            exit(-1);
+        radio_disconnect(s);
+
+    } else if (identify_flag) {
+        // Print identity of the device.
+        char line[256];
+
+        if (argc != 1)
+            usage();
+
+        identify_device(s, argv[0], line, sizeof(line));
+        printf("%s\n", line);
+
+    } else if (calibrate_flag) {
+        // Find the largest blocks for this firmware.
+        if (argc != 1)
+            usage();
+
+        radio_set_model(s, model_name);
+        radio_set_capture(s, capture_file);
+        radio_set_histogram(s, histogram_file);
+        radio_connect(s, argv[0]);
+        radio_calibrate(s);
+        radio_disconnect(s);
 
     } else if (write_flag) {
         // Restore image file to device.
         if (argc != 2)
             usage();
 
-        radio_connect(argv[0]);
-        radio_read_image(argv[1]);
-        radio_print_version(stdout, 1);
-        radio_upload(0);
-        radio_disconnect();
+        write_device(s, argv[0], argv[1]);
 
     } else if (config_flag) {
         if (argc != 2)
@@ -140,20 +606,14 @@ int main(int argc, char **argv)
 
         if (is_file(argv[0])) {
             // Apply text config to image file.
-            radio_read_image(argv[0]);
-            radio_print_version(stdout, 1);
-            radio_parse_config(argv[1]);
-            radio_save_image("device.img");
+            radio_read_image(s, argv[0]);
+            radio_print_version(s, stdout, 1);
+            radio_parse_config(s, argv[1]);
+            radio_save_image(s, "device.img");
 
         } else {
             // Update device from text config file.
-            radio_connect(argv[0]);
-            radio_download();
-            radio_print_version(stdout, 1);
-            radio_save_image("backup.img");
-            radio_parse_config(argv[1]);
-            radio_upload(1);
-            radio_disconnect();
+            configure_device(s, argv[0], argv[1], "backup.img");
         }
 
     } else {
@@ -163,30 +623,16 @@ int main(int argc, char **argv)
         if (is_file(argv[0])) {
             // Print configuration from image file.
             // Load image from file.
-            radio_read_image(argv[0]);
-            radio_print_version(stdout, 1);
-            radio_print_config(stdout, !isatty(1));
+            radio_read_image(s, argv[0]);
+            radio_print_version(s, stdout, 1);
+            radio_print_config(s, stdout, !isatty(1));
 
         } else {
             // Dump device to image file.
-            radio_connect(argv[0]);
-            radio_download();
-            radio_print_version(stdout, 1);
-            radio_disconnect();
-            radio_save_image("device.img");
-
-            // Print configuration to file.
-            const char *filename = "device.conf";
-            printf("Print configuration to file '%s'.\n", filename);
-            FILE *conf = fopen(filename, "w");
-            if (!conf) {
-                perror(filename);
-                exit(-1);
-            }
-            radio_print_version(conf, 0);
-            radio_print_config(conf, 1);
-            fclose(conf);
+            download_device(s, argv[0], "device.img", "device.conf");
         }
     }
+    print_stats();
+    radio_session_free(s);
     return (0);
 }
@@ -0,0 +1,57 @@
+/*
+ * Static probes for bpftrace and other USDT tracers.
+ *
+ * Copyright (C) 2013-2023 Serge Vakulenko, KK6ABQ
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   1. Redistributions of source code must retain the above copyright notice,
+ *      this list of conditions and the following disclaimer.
+ *   2. Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in the
+ *      documentation and/or other materials provided with the distribution.
+ *   3. The name of the author may not be used to endorse or promote products
+ *      derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO
+ * EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifndef PROBES_H
+#define PROBES_H
+
+//
+// Probes of provider 'baoclone', like:
+//
+//      bpftrace -e 'usdt:./baoclone:block__done { @[str(arg0)] = hist(arg3); }'
+//
+// block__start     (const char *op, int addr, int nbytes)
+// block__done      (const char *op, int addr, int nbytes, long long latency_usec)
+// read__timeout    (int nbytes, int timeout_usec)
+// retry            (int addr, int retry, int delay_msec)
+// detect__attempt  (const char *magic, int detected, long long latency_usec)
+// disconnect       (const char *port_name, int retries)
+//
+// Without <sys/sdt.h>, probes are compiled out and arguments are not evaluated.
+//
+#ifdef HAVE_SYS_SDT_H
+#include <sys/sdt.h>
+
+#define PROBE2(name, a, b)          DTRACE_PROBE2(baoclone, name, a, b)
+#define PROBE3(name, a, b, c)       DTRACE_PROBE3(baoclone, name, a, b, c)
+#define PROBE4(name, a, b, c, d)    DTRACE_PROBE4(baoclone, name, a, b, c, d)
+#else
+#define PROBE2(name, a, b)          /* empty */
+#define PROBE3(name, a, b, c)       /* empty */
+#define PROBE4(name, a, b, c, d)    /* empty */
+#endif
+
+#endif // PROBES_H
@@ -31,50 +31,251 @@
 #include <stdlib.h>
 #include <string.h>
 #include <sys/stat.h>
+#include <sys/time.h>
 #include <time.h>
 #include <unistd.h>
 
+#include "cache.h"
+#include "latency.h"
+#include "probes.h"
+#include "stats.h"
+#include "timeline.h"
 #include "util.h"
 
 const char program_version[]   = VERSION;
 const char program_copyright[] = "Copyright (C) 2013-2023 Serge Vakulenko KK6ABQ";
 
-int radio_port;                  // File descriptor of programming serial port
-unsigned char radio_ident[8];    // Radio: identifier
-unsigned char radio_mem[0x7000]; // Radio: memory contents
-int radio_progress;              // Read/write progress counter
+//
+// Create a session: context for working with one radio.
+//
+radio_session_t *radio_session_new()
+{
+    radio_session_t *s = calloc(1, sizeof(radio_session_t));
+
+    if (!s) {
+        fprintf(stderr, "Out of memory.\n");
+        exit(-1);
+    }
+    s->model_magic = -1;
+    s->window      = 1;
+    return s;
+}
+
+//
+// Release the session.
+//
+void radio_session_free(radio_session_t *s)
+{
+    if (s->latency)
+        latency_close(s->latency);
+    free(s);
+}
+
+//
+// Radio needs a timeout after disconnect to reset to a normal state.
+//
+#define RESET_MSEC 2000
+
+//
+// Get wall clock time in microseconds: deadlines are shared between processes.
+//
+static long long time_usec()
+{
+    struct timeval t;
+
+    gettimeofday(&t, NULL);
+    return t.tv_sec * 1000000LL + t.tv_usec;
+}
+
+static long long time_msec()
+{
+    return time_usec() / 1000;
+}
+
+//
+// Delay in milliseconds, counted in statistics and shown on the timeline.
+//
+static void delay(radio_session_t *s, unsigned msec)
+{
+    long long t0 = timeline_now(s->timeline);
+
+    mdelay(msec);
+    s->stats.delay_usec += msec * 1000LL;
+    timeline_span(s->timeline, s->timeline_tid, "wait", t0, "sleep %u msec", msec);
+}
+
+//
+// Get start time of a block or probe, for static probes and the timeline.
+// When both are off, the clock is not read for every block.
+//
+static long long span_start(radio_session_t *s)
+{
+#ifdef HAVE_SYS_SDT_H
+    return time_usec();
+#else
+    return timeline_now(s->timeline);
+#endif
+}
+
+//
+// Get the key of the reset deadline: identity of the cable,
+// as names of ports are reused for other adapters.  A device without
+// identity is keyed by name, tagged with the time of its creation:
+// numbers of pseudo-terminals are reused too.  Emulator, replay and
+// network ports are not devices: no deadline is kept.
+// On Windows, COM port names are fixed.
+//
+static void cooldown_key(radio_session_t *s, const char *port_name, int has_identity,
+                         const char *identity)
+{
+    s->cooldown[0]     = 0;
+    s->cooldown_tag[0] = 0;
+#ifdef MINGW32
+    snprintf(s->cooldown, sizeof(s->cooldown), "%s", port_name);
+#else
+    struct stat st;
 
-static radio_device_t *device;       // Device-dependent interface
-static unsigned char image_ident[8]; // Image file: identifier
+    if (has_identity) {
+        snprintf(s->cooldown, sizeof(s->cooldown), "%s", identity);
+    } else if (stat(port_name, &st) == 0 && S_ISCHR(st.st_mode)) {
+        snprintf(s->cooldown, sizeof(s->cooldown), "%s", port_name);
+        snprintf(s->cooldown_tag, sizeof(s->cooldown_tag), "%lld.%09ld",
+                 (long long)st.st_ctim.tv_sec, st.st_ctim.tv_nsec);
+    }
+#endif
+}
+
+//
+// Wait until the radio on this cable has finished the reset
+// after the previous session, maybe run by another process.
+//
+static void cooldown_wait(radio_session_t *s)
+{
+    char value[64];
+    const char *tag;
+    long long msec;
+
+    if (!s->cooldown[0] || !cache_get("cooldown", s->cooldown, value, sizeof(value)))
+        return;
+
+    // Value is 'deadline' or 'deadline tag'.
+    tag = strchr(value, ' ');
+    if (strcmp(tag ? tag + 1 : "", s->cooldown_tag) != 0)
+        return;
+    msec = atoll(value) - time_msec();
+    if (msec <= 0)
+        return;
+    if (msec > RESET_MSEC)
+        msec = RESET_MSEC;
+    if (trace_flag)
+        printf("# Wait %lld msec for radio reset.\n", msec);
+    delay(s, msec);
+}
 
 //
 // Close the serial port.
 //
-void radio_disconnect()
+void radio_disconnect(radio_session_t *s)
 {
+    long long t0 = time_usec();
+    char value[64];
+
     fprintf(stderr, "Close device.\n");
+    PROBE2(disconnect, s->port_name, s->retries);
 
     // Restore the port mode.
-    serial_close(radio_port);
+    serial_close(s->port);
+    s->port = NULL;
 
     // Radio needs a timeout to reset to a normal state.
-    mdelay(2000);
+    // Don't wait here: remember the deadline, and let only
+    // the next connect to this cable wait for it.
+    if (s->cooldown[0] && !cache_dir()) {
+        delay(s, RESET_MSEC);
+    } else if (s->cooldown[0]) {
+        snprintf(value, sizeof(value), "%lld%s%s", time_msec() + RESET_MSEC,
+                 s->cooldown_tag[0] ? " " : "", s->cooldown_tag);
+        cache_put("cooldown", s->cooldown, value);
+    }
+    s->stats.phase_usec[STATS_DISCONNECT] += time_usec() - t0;
+}
+
+//
+// Keep the port open after the session.
+//
+void radio_hold(radio_session_t *s)
+{
+    PROBE2(disconnect, s->port_name, s->retries);
+    s->reset_time = time_msec() + RESET_MSEC;
+}
+
+//
+// Enable resuming of an interrupted transfer.
+//
+void radio_set_resume(radio_session_t *s, int resume)
+{
+    s->resume = resume;
+}
+
+//
+// Set the number of frames to send before waiting for acknowledge.
+//
+void radio_set_window(radio_session_t *s, int window)
+{
+    if (window < 1 || window > MAX_WINDOW) {
+        fprintf(stderr, "Window must be from 1 to %d.\n", MAX_WINDOW);
+        exit(-1);
+    }
+    s->window = window;
+}
+
+//
+// Write capture of the serial protocol to file.
+//
+void radio_set_capture(radio_session_t *s, const char *filename)
+{
+    s->capture_file = filename;
+}
+
+//
+// Write the session to the timeline.
+//
+void radio_set_timeline(radio_session_t *s, timeline_t *t)
+{
+    s->timeline = t;
+}
+
+//
+// Collect histograms of reply latency.
+//
+void radio_set_histogram(radio_session_t *s, const char *filename)
+{
+    if (filename && !s->latency)
+        s->latency = latency_open(filename);
+}
+
+//
+// Get name of the detected device, or NULL when unknown.
+//
+const char *radio_name(radio_session_t *s)
+{
+    return s->device ? s->device->name : NULL;
 }
 
 //
 // Print a generic information about the device.
 //
-void radio_print_version(FILE *out, int show_version)
+void radio_print_version(radio_session_t *s, FILE *out, int show_version)
 {
-    fprintf(out, "Radio: %s\n", device->name);
-    device->print_version(out, show_version);
+    fprintf(out, "Radio: %s\n", s->device->name);
+    s->device->print_version(s, out, show_version);
 }
 
 //
 // Try to identify the device with a given magic command.
 // Return 0 when failed.
 //
-static int try_magic(const unsigned char *magic)
+static int try_magic(radio_session_t *s, const unsigned char *magic)
 {
     unsigned char reply[8];
     int magic_len = strlen((char *)magic);
@@ -85,11 +286,11 @@ static int try_magic(const unsigned char *magic)
         print_hex(magic, magic_len);
         printf("\n");
     }
-    serial_flush(radio_port);
-    serial_write(radio_port, magic, magic_len);
+    serial_flush(s->port);
+    serial_write(s->port, magic, magic_len);
 
     // Check response.
-    if (serial_read(radio_port, reply, 1) != 1) {
+    if (radio_read(s, LAT_PROBE, reply, 1) != 1) {
         if (trace_flag)
             fprintf(stderr, "Radio did not respond.\n");
         return 0;
@@ -100,20 +301,20 @@ static int try_magic(const unsigned char *magic)
     }
 
     // Query for identifier..
-    serial_write(radio_port, "\x02", 1);
-    if (serial_read(radio_port, radio_ident, 8) != 8) {
+    serial_write(s->port, "\x02", 1);
+    if (radio_read(s, LAT_PROBE, s->ident, 8) != 8) {
         fprintf(stderr, "Empty identifier.\n");
         return 0;
     }
     if (trace_flag) {
         printf("# Identifier: ");
-        print_hex(radio_ident, 8);
+        print_hex(s->ident, 8);
         printf("\n");
     }
 
     // Enter clone mode.
-    serial_write(radio_port, "\x06", 1);
-    if (serial_read(radio_port, reply, 1) != 1) {
+    serial_write(s->port, "\x06", 1);
+    if (radio_read(s, LAT_PROBE, reply, 1) != 1) {
         fprintf(stderr, "Radio refused to clone.\n");
         return 0;
     }
@@ -125,109 +326,666 @@ static int try_magic(const unsigned char *magic)
 }
 
 //
-// Connect to the radio and identify the type of device.
+// Magic commands, in the default order of probing.
+//
+enum {
+    MAGIC_UVB5,  // "PROGRAM": UV-B5, UV-B6, BF-888S, BF-T1
+    MAGIC_UV5R,  // UV-5R, UV-5RA, BF-F8HP
+    MAGIC_BF888, // "\2PROGRAM": BF-888S
+    MAGIC_AGED,  // UV-5R with old firmware
+    NMAGICS
+};
+
+//
+// Names of magics in the cache of ports.
+//
+static const char *magic_name[NMAGICS] = { "uvb5", "uv5r", "bf888", "aged" };
+
+//
+// Models for the --model option, and their magics.
+//
+static const struct {
+    const char *model;
+    int magic;
+} model_magic[] = {
+    { "UV-5R", MAGIC_UV5R },
+    { "UV-5RA", MAGIC_UV5R },
+    { "BF-F8HP", MAGIC_UV5R },
+    { "UV-5R-aged", MAGIC_AGED },
+    { "UV-B5", MAGIC_UVB5 },
+    { "UV-B6", MAGIC_UVB5 },
+    { "BF-888S", MAGIC_BF888 },
+    { "BF-T1", MAGIC_UVB5 },
+};
+
+#define NMODELS (int)(sizeof(model_magic) / sizeof(model_magic[0]))
+
+//
+// Set the type of radio, to skip probing on connect.
+// NULL means probe all types.
+//
+void radio_set_model(radio_session_t *s, const char *model)
+{
+    int i;
+
+    s->model_magic = -1;
+    if (!model)
+        return;
+    for (i = 0; i < NMODELS; i++) {
+        if (strcasecmp(model, model_magic[i].model) == 0) {
+            s->model_magic = model_magic[i].magic;
+            return;
+        }
+    }
+    fprintf(stderr, "Unknown model: %s\n", model);
+    fprintf(stderr, "Supported models:");
+    for (i = 0; i < NMODELS; i++)
+        fprintf(stderr, " %s", model_magic[i].model);
+    fprintf(stderr, "\n");
+    exit(-1);
+}
+
 //
-void radio_connect(const char *port_name)
+// Send the magic and check the identifier of the radio.
+// Return the device, or NULL when not detected.
+//
+static radio_device_t *probe(radio_session_t *s, int magic)
 {
     static const unsigned char UV5R_MODEL_AGED[] = "\x50\xBB\xFF\x01\x25\x98\x4D";
     static const unsigned char UV5R_MODEL_291[]  = "\x50\xBB\xFF\x20\x12\x07\x25";
     static const unsigned char UVB5_MODEL[]      = "PROGRAM";
     static const unsigned char BF888_MODEL[]     = "\2PROGRAM";
-    int retry;
 
+    switch (magic) {
+    case MAGIC_UVB5:
+        if (!try_magic(s, UVB5_MODEL))
+            return NULL;
+        if (strncmp((char *)s->ident, "HKT511", 6) == 0)
+            return &radio_uvb5; // Baofeng UV-B5, UV-B6
+        if (strncmp((char *)s->ident, "P3107", 5) == 0)
+            return &radio_bf888s; // Baofeng BF-888S
+        if (strncmp((char *)s->ident, " BF9100S", 8) == 0)
+            return &radio_bft1; // Baofeng BF-T1
+        break;
+    case MAGIC_UV5R:
+        if (!try_magic(s, UV5R_MODEL_291))
+            return NULL;
+        return &radio_uv5r; // Baofeng UV-5R, UV-5RA
+    case MAGIC_BF888:
+        if (!try_magic(s, BF888_MODEL))
+            return NULL;
+        if (strncmp((char *)s->ident, "P3107", 5) == 0)
+            return &radio_bf888s; // Baofeng BF-888S
+        break;
+    case MAGIC_AGED:
+        if (!try_magic(s, UV5R_MODEL_AGED))
+            return NULL;
+        return &radio_uv5r_aged; // Baofeng UV-5R with old firmware
+    }
+    printf("Unrecognized identifier: ");
+    print_hex(s->ident, 8);
+    printf("\n");
+    return NULL;
+}
+
+//
+// Key of the firmware in the cache of block sizes: identifier in hex.
+//
+static void ident_key(radio_session_t *s, char *key)
+{
+    int i;
+
+    for (i = 0; i < (int)sizeof(s->ident); i++)
+        sprintf(key + 2 * i, "%02x", s->ident[i]);
+}
+
+//
+// Check whether the block size is valid for the device:
+// default size multiplied by a power of two.
+//
+static int valid_block_size(int size, int dflt)
+{
+    while (dflt < size)
+        dflt *= 2;
+    return dflt == size && size <= MAX_BLOCK;
+}
+
+//
+// Get block sizes for this firmware from the cache, when calibrated.
+//
+static void load_block_sizes(radio_session_t *s)
+{
+    char key[2 * sizeof(s->ident) + 1], value[32];
+    int read_size, write_size;
+
+    s->read_size  = s->device->read_size;
+    s->write_size = s->device->write_size;
+    ident_key(s, key);
+    if (!cache_get("blocks", key, value, sizeof(value)) ||
+        sscanf(value, "%d %d", &read_size, &write_size) != 2 ||
+        !valid_block_size(read_size, s->device->read_size) ||
+        !valid_block_size(write_size, s->device->write_size))
+        return;
+    if (trace_flag)
+        printf("# Calibrated blocks: read %d, write %d bytes.\n", read_size, write_size);
+    s->read_size  = read_size;
+    s->write_size = write_size;
+}
+
+//
+// Get order of probing: the magic which worked last time
+// on this adapter is tried first.  Return the number of magics.
+//
+static int probe_order(radio_session_t *s, int has_identity, const char *identity, int *order)
+{
+    char cached[32];
+    int first = -1, nprobes = 0, i;
+
+    if (s->model_magic >= 0) {
+        // Model is known: send only the proper magic.
+        order[0] = s->model_magic;
+        return 1;
+    }
+    if (has_identity && cache_get("ports", identity, cached, sizeof(cached))) {
+        for (i = 0; i < NMAGICS; i++)
+            if (strcmp(cached, magic_name[i]) == 0)
+                first = i;
+    }
+    if (first >= 0)
+        order[nprobes++] = first;
+    for (i = 0; i < NMAGICS; i++)
+        if (i != first)
+            order[nprobes++] = i;
+    return nprobes;
+}
+
+//
+// Open the serial port, after the radio has finished the reset.
+//
+static void open_port(radio_session_t *s, const char *port_name, int has_identity,
+                      const char *identity)
+{
     fprintf(stderr, "Connect to %s.\n", port_name);
-    radio_port = serial_open(port_name);
-    for (retry = 0;; retry++) {
-        if (retry >= 10) {
+    cooldown_key(s, port_name, has_identity, identity);
+    cooldown_wait(s);
+    snprintf(s->port_name, sizeof(s->port_name), "%s", port_name);
+    snprintf(s->cable, sizeof(s->cable), "%s%s", has_identity ? identity : port_name,
+             low_latency_flag ? " low-latency" : "");
+    if (s->timeline)
+        s->timeline_tid = timeline_track(s->timeline, port_name);
+    s->port = serial_open(port_name);
+    serial_observe(s->port, &s->stats, s->timeline, s->timeline_tid);
+    if (s->capture_file)
+        serial_capture(s->port, s->capture_file);
+    s->backup_valid = 0;
+    s->ack_pending  = 0;
+    s->device       = NULL;
+}
+
+//
+// Try every magic once.  Return the index of magic which worked, or -1.
+//
+static int probe_all(radio_session_t *s, const int *order, int nprobes)
+{
+    int i;
+
+    for (i = 0; i < nprobes; i++) {
+        long long t1 = span_start(s);
+
+        s->device = probe(s, order[i]);
+        timeline_span(s->timeline, s->timeline_tid, "connect", t1, "probe %s",
+                      magic_name[order[i]]);
+        PROBE3(detect__attempt, magic_name[order[i]], s->device != NULL, time_usec() - t1);
+        if (s->device)
+            return i;
+
+        // Let the radio recover from a wrong magic.
+        delay(s, 500);
+    }
+    return -1;
+}
+
+//
+// Radio detected: load the settings for this firmware,
+// and remember the magic for this adapter.
+//
+static void detected(radio_session_t *s, int has_identity, const char *identity, int magic)
+{
+    char cached[32];
+
+    printf("Detected %s.\n", s->device->name);
+    s->magic = magic;
+    load_block_sizes(s);
+    if (has_identity && (!cache_get("ports", identity, cached, sizeof(cached)) ||
+                         strcmp(cached, magic_name[magic]) != 0))
+        cache_put("ports", identity, magic_name[magic]);
+}
+
+//
+// Connect to the radio and identify the type of device.
+// The magic which worked last time on this adapter is tried first.
+//
+void radio_connect(radio_session_t *s, const char *port_name)
+{
+    int order[NMAGICS], nprobes, retry, i;
+    long long t0;
+    char identity[256];
+    int has_identity = serial_identity(port_name, identity, sizeof(identity));
+
+    nprobes = probe_order(s, has_identity, identity, order);
+    t0      = time_usec();
+    open_port(s, port_name, has_identity, identity);
+    for (retry = 0; (i = probe_all(s, order, nprobes)) < 0; retry++) {
+        if (retry >= 9) {
             fprintf(stderr, "Device not detected.\n");
             exit(-1);
         }
-        if (try_magic(UVB5_MODEL)) {
-            if (strncmp((char *)radio_ident, "HKT511", 6) == 0) {
-                device = &radio_uvb5; // Baofeng UV-B5, UV-B6
-                break;
-            }
-            if (strncmp((char *)radio_ident, "P3107", 5) == 0) {
-                device = &radio_bf888s; // Baofeng BF-888S
-                break;
-            }
-            if (strncmp((char *)radio_ident, " BF9100S", 8) == 0) {
-                device = &radio_bft1; // Baofeng BF-T1
-                break;
-            }
-            printf("Unrecognized identifier: ");
-            print_hex(radio_ident, 8);
-            printf("\n");
-        }
-        mdelay(500);
-        if (try_magic(UV5R_MODEL_291)) {
-            device = &radio_uv5r; // Baofeng UV-5R, UV-5RA
-            break;
-        }
-        mdelay(500);
-        if (try_magic(BF888_MODEL)) {
-            if (strncmp((char *)radio_ident, "P3107", 5) == 0) {
-                device = &radio_bf888s; // Baofeng BF-888S
-                break;
-            }
-            printf("Unrecognized identifier: ");
-            print_hex(radio_ident, 8);
-            printf("\n");
-        }
-        mdelay(500);
-        if (try_magic(UV5R_MODEL_AGED)) {
-            device = &radio_uv5r_aged; // Baofeng UV-5R with old firmware
-            break;
-        }
-        mdelay(500);
     }
-    printf("Detected %s.\n", device->name);
+    timeline_span(s->timeline, s->timeline_tid, "session", t0, "connect");
+    s->stats.phase_usec[STATS_CONNECT] += time_usec() - t0;
+    detected(s, has_identity, identity, order[i]);
+}
+
+//
+// Connect and try every magic only once.
+//
+int radio_probe(radio_session_t *s, const char *port_name)
+{
+    int order[NMAGICS], nprobes, i;
+    long long t0;
+    char identity[256];
+    int has_identity = serial_identity(port_name, identity, sizeof(identity));
+
+    nprobes = probe_order(s, has_identity, identity, order);
+    t0      = time_usec();
+    open_port(s, port_name, has_identity, identity);
+    i = probe_all(s, order, nprobes);
+    timeline_span(s->timeline, s->timeline_tid, "session", t0, "probe");
+    s->stats.phase_usec[STATS_CONNECT] += time_usec() - t0;
+    if (i < 0) {
+        serial_close(s->port);
+        s->port = NULL;
+        return 0;
+    }
+    detected(s, has_identity, identity, order[i]);
+    return 1;
+}
+
+//
+// Connect again on the port kept open.  Probing is skipped:
+// the same radio, or another one of this type, must answer the magic.
+//
+int radio_reconnect(radio_session_t *s)
+{
+    long long t0   = time_usec();
+    long long msec = s->reset_time - time_msec();
+    int magic      = s->magic, retry;
+
+    fprintf(stderr, "Connect to %s.\n", s->port_name);
+    if (msec > 0) {
+        if (trace_flag)
+            printf("# Wait %lld msec for radio reset.\n", msec);
+        delay(s, msec);
+    }
+    serial_flush(s->port);
+    s->backup_valid = 0;
+    s->ack_pending  = 0;
+    s->device       = NULL;
+    for (retry = 0; retry < 3; retry++)
+        if (probe_all(s, &magic, 1) == 0)
+            break;
+    timeline_span(s->timeline, s->timeline_tid, "session", t0, "connect");
+    s->stats.phase_usec[STATS_CONNECT] += time_usec() - t0;
+    if (!s->device)
+        return 0;
+    detected(s, 0, NULL, magic);
+    return 1;
 }
 
 //
 // Read firmware image from the device.
 //
-void radio_download()
+int radio_download(radio_session_t *s)
 {
-    radio_progress = 0;
+    long long t0 = time_usec();
+    int ok;
+
+    s->progress = 0;
+    s->retries  = 0;
+    radio_journal_start(s, 0);
     if (!trace_flag)
         fprintf(stderr, "Read device: ");
 
-    device->download();
+    ok = s->device->download(s);
+    radio_journal_finish(s, ok);
+    timeline_span(s->timeline, s->timeline_tid, "session", t0, "download");
+    s->stats.phase_usec[STATS_DOWNLOAD] += time_usec() - t0;
 
     if (!trace_flag)
-        fprintf(stderr, " done.\n");
+        fprintf(stderr, ok ? " done.\n" : " failed.\n");
+    if (s->retries > 0)
+        fprintf(stderr, "Retried %d times.\n", s->retries);
+    if (!ok)
+        return 0;
 
     // Copy device identifier to image identifier,
     // to allow writing it back to device.
-    memcpy(image_ident, radio_ident, sizeof(radio_ident));
+    memcpy(s->image_ident, s->ident, sizeof(s->ident));
+
+    // Remember the radio contents, to write back only modified blocks.
+    memcpy(s->backup, s->mem, sizeof(s->backup));
+    s->backup_valid = 1;
+    return 1;
+}
+
+//
+// Read only the data needed to identify the radio.
+//
+int radio_identify(radio_session_t *s, char *line, int size)
+{
+    char key[2 * sizeof(s->ident) + 1];
+    char firmware[32] = "", serial[32] = "";
+    long long t0      = time_usec();
+    int ok            = 1;
+
+    s->progress = 0;
+    s->retries  = 0;
+    if (s->device->identify)
+        ok = s->device->identify(s, firmware, serial);
+    timeline_span(s->timeline, s->timeline_tid, "session", t0, "identify");
+    s->stats.phase_usec[STATS_DOWNLOAD] += time_usec() - t0;
+
+    ident_key(s, key);
+    snprintf(line, size, "%s\t%s\t%s\t%s\t%s", s->port_name, s->device->name, key,
+             firmware[0] ? firmware : "-", serial[0] ? serial : "-");
+    return ok;
 }
 
 //
 // Write firmware image to the device.
 //
-void radio_upload(int cont_flag)
+int radio_upload(radio_session_t *s, int cont_flag)
 {
+    long long t0 = time_usec();
+    int ok;
+
     // Check for compatibility.
-    if (memcmp(image_ident, radio_ident, sizeof(radio_ident)) != 0) {
+    if (memcmp(s->image_ident, s->ident, sizeof(s->ident)) != 0) {
         fprintf(stderr, "Incompatible image - cannot upload.\n");
-        exit(-1);
+        return 0;
     }
-    radio_progress = 0;
+    s->progress       = 0;
+    s->skipped_blocks = 0;
+    s->retries        = 0;
+    radio_journal_start(s, 1);
     if (!trace_flag)
         fprintf(stderr, "Write device: ");
 
-    serial_flush(radio_port);
-    device->upload(cont_flag);
+    serial_flush(s->port);
+    ok = s->device->upload(s, cont_flag);
+    radio_journal_finish(s, ok);
+    timeline_span(s->timeline, s->timeline_tid, "session", t0, "upload");
+    s->stats.phase_usec[STATS_UPLOAD] += time_usec() - t0;
+
+    if (!trace_flag)
+        fprintf(stderr, ok ? " done.\n" : " failed.\n");
+    if (s->skipped_blocks > 0)
+        fprintf(stderr, "Skipped %d unchanged blocks.\n", s->skipped_blocks);
+    if (s->retries > 0)
+        fprintf(stderr, "Retried %d times.\n", s->retries);
+    return ok;
+}
+
+//
+// Get size of the next block to transfer from addr to end.
+//
+int radio_block_size(radio_session_t *s, int write_flag, int addr, int end)
+{
+    int size = write_flag ? s->write_size : s->read_size;
+
+    if (size <= 0)
+        size = write_flag ? s->device->write_size : s->device->read_size;
+    size -= addr % size;
+    if (size > end - addr)
+        size = end - addr;
+    return size;
+}
+
+//
+// Let the radio finish sending after a refused block, and drop the rest.
+//
+static void calibrate_recover(radio_session_t *s)
+{
+    delay(s, 100);
+    serial_flush(s->port);
+}
+
+//
+// Read len bytes of memory by blocks of given size.
+// Return 0 on any error.
+//
+static int calibrate_read(radio_session_t *s, int addr, unsigned char *data, int len, int nbytes)
+{
+    int i;
+
+    for (i = 0; i < len; i += nbytes)
+        if (!s->device->try_read(s, addr + i, &data[i], nbytes))
+            return 0;
+    return 1;
+}
+
+//
+// Find the largest blocks for read and write, accepted by the radio.
+// Read size is confirmed by the length in the reply header.
+// Write is tested by writing back the current contents, and reading
+// them again.  When the radio refuses a block, the contents are
+// restored by blocks of default size, in case a part was stored.
+//
+void radio_calibrate(radio_session_t *s)
+{
+    radio_device_t *device = s->device;
+    int addr               = device->calib_addr;
+    unsigned char data[MAX_BLOCK], check[MAX_BLOCK];
+    char key[2 * sizeof(s->ident) + 1], value[32];
+    int nbytes, i;
+
+    if (!device->try_read || !device->try_write) {
+        fprintf(stderr, "Calibration is not supported for %s.\n", device->name);
+        exit(-1);
+    }
+    if (!trace_flag)
+        fprintf(stderr, "Calibrate device: ");
+    s->progress = 0;
+    serial_flush(s->port);
+
+    s->read_size = device->read_size;
+    for (nbytes = 2 * device->read_size; nbytes <= MAX_BLOCK; nbytes *= 2) {
+        if (!device->try_read(s, addr, data, nbytes)) {
+            calibrate_recover(s);
+            break;
+        }
+        s->read_size = nbytes;
+    }
 
+    // Current contents, to write them back unchanged.
+    if (!calibrate_read(s, addr, data, MAX_BLOCK, s->read_size)) {
+        fprintf(stderr, "\nCannot read block 0x%04x.\n", addr);
+        exit(-1);
+    }
+    s->write_size = device->write_size;
+    for (nbytes = 2 * device->write_size; nbytes <= MAX_BLOCK; nbytes *= 2) {
+        if (device->try_write(s, addr, data, nbytes) &&
+            calibrate_read(s, addr, check, nbytes, s->read_size) &&
+            memcmp(data, check, nbytes) == 0) {
+            s->write_size = nbytes;
+            continue;
+        }
+        calibrate_recover(s);
+        for (i = 0; i < nbytes; i += device->write_size) {
+            if (!device->try_write(s, addr + i, &data[i], device->write_size)) {
+                fprintf(stderr, "\nCannot restore block 0x%04x.\n", addr + i);
+                exit(-1);
+            }
+        }
+        break;
+    }
     if (!trace_flag)
         fprintf(stderr, " done.\n");
+    printf("Block size: read %d, write %d bytes.\n", s->read_size, s->write_size);
+
+    // Remember for next connects to radios with this firmware.
+    ident_key(s, key);
+    snprintf(value, sizeof(value), "%d %d", s->read_size, s->write_size);
+    cache_put("blocks", key, value);
+}
+
+//
+// Limits of retries for one block.
+//
+#define MAX_RETRIES        5
+#define MAX_RETRY_DELAY_MS 400
+
+//
+// Recover after a failed block: let the radio finish sending,
+// and drop everything from the line, so the block command can be sent again.
+// Delay grows with every retry, but stays short enough
+// for the radio to remain in clone mode.
+// Return 0 when the retries are exhausted.
+//
+int radio_retry(radio_session_t *s, int addr, int retry)
+{
+    int msec = 100 << retry;
+
+    if (retry >= MAX_RETRIES) {
+        fprintf(stderr, "Block 0x%04x failed after %d retries.\n", addr, retry);
+        return 0;
+    }
+    if (msec > MAX_RETRY_DELAY_MS)
+        msec = MAX_RETRY_DELAY_MS;
+    if (trace_flag)
+        printf("# Retry block 0x%04x after %d msec.\n", addr, msec);
+    PROBE3(retry, addr, retry, msec);
+    s->retries++;
+    s->stats.retries++;
+    delay(s, msec);
+    serial_flush(s->port);
+    return 1;
+}
+
+//
+// Read block of data, retry on errors.
+// Skip it when already read by the interrupted run.
+//
+int radio_read_block(radio_session_t *s, int start, unsigned char *data, int nbytes)
+{
+    long long t0;
+    int retry;
+
+    if (radio_journal_done(s, start, data, nbytes))
+        return 1;
+    t0 = radio_block_start(s, "read", start, nbytes);
+    for (retry = 0; !s->device->try_read(s, start, data, nbytes); retry++)
+        if (!radio_retry(s, start, retry))
+            return 0;
+    radio_journal_add(s, start, data, nbytes);
+    radio_block_done(s, "read", t0, start, nbytes);
+    return 1;
+}
+
+//
+// Write block of data, retry on errors.
+// Skip it when already written by the interrupted run.
+//
+int radio_write_block(radio_session_t *s, int start, const unsigned char *data, int nbytes)
+{
+    long long t0;
+    int retry;
+
+    if (radio_journal_done(s, start, NULL, nbytes))
+        return 1;
+    t0 = radio_block_start(s, "write", start, nbytes);
+    for (retry = 0; !s->device->try_write(s, start, data, nbytes); retry++)
+        if (!radio_retry(s, start, retry))
+            return 0;
+    radio_journal_add(s, start, data, nbytes);
+    radio_block_done(s, "write", t0, start, nbytes);
+    return 1;
+}
+
+//
+// Send command frame, with data of block write when given.
+//
+void radio_send_frame(radio_session_t *s, int cmd, int start, const unsigned char *data,
+                      int nbytes)
+{
+    unsigned char frame[4 + MAX_BLOCK];
+
+    frame[0] = cmd;
+    frame[1] = start >> 8;
+    frame[2] = start;
+    frame[3] = nbytes;
+    if (!data) {
+        serial_write(s->port, frame, 4);
+        return;
+    }
+    memcpy(&frame[4], data, nbytes);
+    serial_write(s->port, frame, 4 + nbytes);
+}
+
+//
+// Read reply of given type from the radio, and count its latency.
+//
+int radio_read(radio_session_t *s, int kind, void *data, int len)
+{
+    long long t0 = s->latency ? time_usec() : 0;
+    int nbytes   = serial_read_kind(s->port, kind == LAT_WRITE_ACK ? SERIAL_WRITE_ACK : SERIAL_REPLY,
+                                    data, len);
+
+    if (t0 && nbytes == len)
+        latency_add(s->latency, s->cable, s->device ? s->device->name : "-", kind,
+                    time_usec() - t0);
+    return nbytes;
+}
+
+//
+// Start transfer of a block.
+//
+long long radio_block_start(radio_session_t *s, const char *op, int addr, int nbytes)
+{
+    PROBE3(block__start, op, addr, nbytes);
+    return span_start(s);
+}
+
+//
+// Finish transfer of a block.
+//
+void radio_block_done(radio_session_t *s, const char *op, long long start, int addr, int nbytes)
+{
+    PROBE4(block__done, op, addr, nbytes, time_usec() - start);
+    if (op[0] == 'w')
+        s->stats.blocks_written++;
+    else
+        s->stats.blocks_read++;
+    timeline_span(s->timeline, s->timeline_tid, "block", start, "%s 0x%04x", op, addr);
+}
+
+//
+// Check whether the block of memory image differs from the radio contents,
+// obtained by the last download.  Return 0 when the block can be skipped.
+//
+int radio_block_dirty(radio_session_t *s, int addr, int nbytes)
+{
+    if (s->backup_valid && memcmp(&s->mem[addr], &s->backup[addr], nbytes) == 0) {
+        s->skipped_blocks++;
+        return 0;
+    }
+    return 1;
 }
 
 //
 // Read firmware image from the binary file.
 //
-void radio_read_image(const char *filename)
+void radio_read_image(radio_session_t *s, const char *filename)
 {
     FILE *img;
     struct stat st;
@@ -241,19 +999,19 @@ void radio_read_image(const char *filename)
     }
     switch (st.st_size) {
     case 6472:
-        device = &radio_uv5r;
+        s->device = &radio_uv5r;
         break;
     case 6152:
-        device = &radio_uv5r_aged;
+        s->device = &radio_uv5r_aged;
         break;
     case 4144:
-        device = &radio_uvb5;
+        s->device = &radio_uvb5;
         break;
     case 992:
-        device = &radio_bf888s;
+        s->device = &radio_bf888s;
         break;
     case 2048:
-        device = &radio_bft1;
+        s->device = &radio_bft1;
         break;
     default:
         fprintf(stderr, "%s: Unrecognized file size %u bytes.\n", filename, (int)st.st_size);
@@ -265,14 +1023,14 @@ void radio_read_image(const char *filename)
         perror(filename);
         exit(-1);
     }
-    device->read_image(img, image_ident);
+    s->device->read_image(s, img, s->image_ident);
     fclose(img);
 }
 
 //
 // Save firmware image to the binary file.
 //
-void radio_save_image(const char *filename)
+void radio_save_image(radio_session_t *s, const char *filename)
 {
     FILE *img;
 
@@ -282,18 +1040,19 @@ void radio_save_image(const char *filename)
         perror(filename);
         exit(-1);
     }
-    device->save_image(img);
+    s->device->save_image(s, img);
     fclose(img);
 }
 
 //
 // Read the configuration from text file, and modify the firmware.
 //
-void radio_parse_config(const char *filename)
+void radio_parse_config(radio_session_t *s, const char *filename)
 {
     FILE *conf;
     char line[256], *p, *v;
     int table_id = 0, table_dirty = 0;
+    long long t0 = time_usec();
 
     fprintf(stderr, "Read configuration from file '%s'.\n", filename);
     conf = fopen(filename, "r");
@@ -328,7 +1087,7 @@ void radio_parse_config(const char *filename)
             v = strchr(p, ':');
             if (!v) {
                 // Table header: get table type.
-                table_id = device->parse_header(p);
+                table_id = s->device->parse_header(s, p);
                 if (!table_id) {
                 badline:
                     fprintf(stderr, "Invalid line: '%s'\n", line);
@@ -345,7 +1104,7 @@ void radio_parse_config(const char *filename)
             while (*v == ' ' || *v == '\t')
                 v++;
 
-            device->parse_parameter(p, v);
+            s->device->parse_parameter(s, p, v);
 
         } else {
             // Table row or comment.
@@ -358,18 +1117,19 @@ void radio_parse_config(const char *filename)
             if (!table_id)
                 goto badline;
 
-            if (!device->parse_row(table_id, !table_dirty, p))
+            if (!s->device->parse_row(s, table_id, !table_dirty, p))
                 goto badline;
             table_dirty = 1;
         }
     }
     fclose(conf);
+    s->stats.phase_usec[STATS_PARSE] += time_usec() - t0;
 }
 
 //
 // Print full information about the device configuration.
 //
-void radio_print_config(FILE *out, int verbose)
+void radio_print_config(radio_session_t *s, FILE *out, int verbose)
 {
     if (verbose) {
         char buf[40];
@@ -385,18 +1145,18 @@ void radio_print_config(FILE *out, int verbose)
         fprintf(out, "# Version %s, %s\n", program_version, program_copyright);
         fprintf(out, "#\n");
     }
-    device->print_config(out, verbose);
+    s->device->print_config(s, out, verbose);
 }
 
 //
 // Set VFO mode with given frequency.
 //
-void radio_set_vfo(int vfo_index, double freq_mhz)
+int radio_set_vfo(radio_session_t *s, int vfo_index, double freq_mhz)
 {
-    if (!device->set_vfo) {
-        fprintf(stderr, "VFO mode is not supported for %s\n", device->name);
-        return;
+    if (!s->device->set_vfo) {
+        fprintf(stderr, "VFO mode is not supported for %s\n", s->device->name);
+        return 0;
     }
 
-    device->set_vfo(vfo_index, freq_mhz);
+    return s->device->set_vfo(s, vfo_index, freq_mhz);
 }
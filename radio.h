@@ -25,8 +25,15 @@
  * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
  * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
  */
+#ifndef RADIO_H
+#define RADIO_H
+
 #include <stdio.h>
 
+#include "latency.h"
+#include "stats.h"
+#include "timeline.h"
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -37,72 +44,256 @@ extern "C" {
 extern const char program_version[];
 extern const char program_copyright[];
 
+typedef struct radio_session radio_session_t;
+
+//
+// Create a session: context for working with one radio.
+//
+radio_session_t *radio_session_new(void);
+
+//
+// Release the session.
+//
+void radio_session_free(radio_session_t *s);
+
 //
 // Connect to the radio via the serial port.
 // Identify the type of device.
 //
-void radio_connect(const char *port_name);
+void radio_connect(radio_session_t *s, const char *port_name);
+
+//
+// Connect to the serial port, and try every type of radio only once,
+// without retries.  Return 0 when no radio answered: the port is closed.
+//
+int radio_probe(radio_session_t *s, const char *port_name);
+
+//
+// Set the type of radio, like "UV-5R" or "BF-888S", to skip probing
+// of other types on connect.  NULL means probe all types.
+//
+void radio_set_model(radio_session_t *s, const char *model);
 
 //
 // Close the serial port.
 //
-void radio_disconnect(void);
+void radio_disconnect(radio_session_t *s);
+
+//
+// Finish the session with the radio, but keep the serial port open
+// for the next one: see radio_reconnect().
+//
+void radio_hold(radio_session_t *s);
+
+//
+// Start next session on the port kept open by radio_hold(),
+// with the radio detected before: wait until it has reset,
+// and send only the magic which worked.  Return 0 when the radio
+// does not answer: the port is still open.
+//
+int radio_reconnect(radio_session_t *s);
 
 //
 // Read firmware image from the device.
+// Return 0 when a block failed after all retries.
+//
+int radio_download(radio_session_t *s);
+
+//
+// Read only the blocks with firmware version and serial number,
+// when the model has them.  Put into the buffer one line for inventory:
+// port, model, identifier in hex, firmware and serial, separated by tabs.
+// Return 0 when a block failed after all retries.
 //
-void radio_download(void);
+int radio_identify(radio_session_t *s, char *line, int size);
 
 //
 // Write firmware image to the device.
+// Return 0 when the image does not fit the radio,
+// or a block failed after all retries.
+//
+int radio_upload(radio_session_t *s, int cont_flag);
+
+//
+// Enable resuming of an interrupted transfer, using the journal
+// of completed blocks.
+//
+void radio_set_resume(radio_session_t *s, int resume);
+
+//
+// Largest window of pipelined writes.
+//
+#define MAX_WINDOW 16
+
+//
+// Set the number of frames to send before waiting for acknowledge,
+// on upload.  Experimental, only for UV-5R: 1 is the safe stop-and-wait.
+//
+void radio_set_window(radio_session_t *s, int window);
+
+//
+// Largest block for calibration: the length field of a command is one byte.
+//
+#define MAX_BLOCK 0x80
+
+//
+// Find the largest blocks for read and write, accepted by the radio,
+// and save them in the cache for this firmware, to be used by next
+// connects.  Write is tested by writing back the current contents.
+//
+void radio_calibrate(radio_session_t *s);
+
+//
+// Get size of the next block to transfer from addr to end: calibrated
+// for this firmware, or the default of the driver.  Blocks don't cross
+// the boundary of their size.
+//
+int radio_block_size(radio_session_t *s, int write_flag, int addr, int end);
+
+//
+// Write capture of the serial protocol to file, with timestamps.
+// Filename NULL disables capture.
+//
+void radio_set_capture(radio_session_t *s, const char *filename);
+
+//
+// Write the session to the timeline, on a track of its own.
+// NULL disables the timeline.
 //
-void radio_upload(int cont_flag);
+void radio_set_timeline(radio_session_t *s, timeline_t *t);
+
+//
+// Collect histograms of reply latency, and merge them into file
+// when the session is freed, or at exit.  Filename NULL does nothing.
+//
+void radio_set_histogram(radio_session_t *s, const char *filename);
+
+//
+// Journal of transferred blocks: start and finish the transfer.
+// The journal is removed when the transfer is done, and kept
+// for --resume when it failed.
+//
+void radio_journal_start(radio_session_t *s, int write_flag);
+void radio_journal_finish(radio_session_t *s, int done);
+
+//
+// Check whether the block was transferred by the previous run,
+// and get its contents for download.  Data is NULL for upload.
+//
+int radio_journal_done(radio_session_t *s, int addr, unsigned char *data, int nbytes);
+
+//
+// Record the block as transferred.
+//
+void radio_journal_add(radio_session_t *s, int addr, const unsigned char *data, int nbytes);
+
+//
+// Send command frame: letter, 16-bit address and length of block,
+// followed by the data when given, in one write: one USB transfer.
+// Length is at most MAX_BLOCK bytes.
+//
+void radio_send_frame(radio_session_t *s, int cmd, int start, const unsigned char *data,
+                      int nbytes);
+
+//
+// Read reply of given type from the radio: LAT_PROBE, LAT_READ_HEADER etc.
+// Latency is added to the histogram for this cable and model.
+// Return the number of bytes, 0 when no data available.
+//
+int radio_read(radio_session_t *s, int kind, void *data, int len);
+
+//
+// Start transfer of a block: op is "read" or "write".
+// Return the start time for radio_block_done(), or 0 when neither
+// probes nor timeline are enabled.
+//
+long long radio_block_start(radio_session_t *s, const char *op, int addr, int nbytes);
+
+//
+// Finish transfer of a block: report the latency to the timeline and probes.
+//
+void radio_block_done(radio_session_t *s, const char *op, long long start, int addr, int nbytes);
+
+//
+// Recover after a failed block, before sending it again.
+// Retry is the number of previous attempts for this block.
+// Return 0 when the retries are exhausted.
+//
+int radio_retry(radio_session_t *s, int addr, int retry);
+
+//
+// Read or write block of data with try_read or try_write of the device,
+// retry on errors.  Skip it when already done by the interrupted run.
+// Return 0 when the block failed after all retries.
+//
+int radio_read_block(radio_session_t *s, int start, unsigned char *data, int nbytes);
+int radio_write_block(radio_session_t *s, int start, const unsigned char *data, int nbytes);
+
+//
+// Check whether the block of memory image differs from the radio contents,
+// obtained by the last download.  Return 0 when the block can be skipped.
+//
+int radio_block_dirty(radio_session_t *s, int addr, int nbytes);
+
+//
+// Get name of the detected device, or NULL when unknown.
+//
+const char *radio_name(radio_session_t *s);
 
 //
 // Print generic information about the device.
 //
-void radio_print_version(FILE *out, int show_version);
+void radio_print_version(radio_session_t *s, FILE *out, int show_version);
 
 //
 // Print full information about the device configuration.
 //
-void radio_print_config(FILE *out, int verbose);
+void radio_print_config(radio_session_t *s, FILE *out, int verbose);
 
 //
 // Read firmware image from the binary file.
 //
-void radio_read_image(const char *filename);
+void radio_read_image(radio_session_t *s, const char *filename);
 
 //
 // Save firmware image to the binary file.
 //
-void radio_save_image(const char *filename);
+void radio_save_image(radio_session_t *s, const char *filename);
 
 //
 // Read the configuration from text file, and modify the firmware.
 //
-void radio_parse_config(const char *filename);
+void radio_parse_config(radio_session_t *s, const char *filename);
 
 //
 // Set VFO mode with given frequency.
+// Return 0 when not supported, or a block failed after all retries.
 //
-void radio_set_vfo(int vfo_index, double freq_mhz);
+int radio_set_vfo(radio_session_t *s, int vfo_index, double freq_mhz);
 
 //
 // Device-dependent interface to the radio.
+// Routines which talk to the radio return 0 on failure.
 //
 typedef struct {
     const char *name;
-    void (*download)(void);
-    void (*upload)(int cont_flag);
-    void (*read_image)(FILE *img, unsigned char *ident);
-    void (*save_image)(FILE *img);
-    void (*print_version)(FILE *out, int show_version);
-    void (*print_config)(FILE *out, int verbose);
-    void (*parse_parameter)(char *param, char *value);
-    int (*parse_header)(char *line);
-    int (*parse_row)(int table_id, int first_row, char *line);
-    void (*set_vfo)(int vfo_index, double freq_mhz);
+    int (*download)(radio_session_t *s);
+    int (*upload)(radio_session_t *s, int cont_flag);
+    void (*read_image)(radio_session_t *s, FILE *img, unsigned char *ident);
+    void (*save_image)(radio_session_t *s, FILE *img);
+    void (*print_version)(radio_session_t *s, FILE *out, int show_version);
+    void (*print_config)(radio_session_t *s, FILE *out, int verbose);
+    void (*parse_parameter)(radio_session_t *s, char *param, char *value);
+    int (*parse_header)(radio_session_t *s, char *line);
+    int (*parse_row)(radio_session_t *s, int table_id, int first_row, char *line);
+    int (*set_vfo)(radio_session_t *s, int vfo_index, double freq_mhz);
+    int (*try_read)(radio_session_t *s, int start, unsigned char *data, int nbytes);
+    int (*try_write)(radio_session_t *s, int start, const unsigned char *data, int nbytes);
+    int read_size;  // Default size of block read
+    int write_size; // Default size of block write
+    int calib_addr; // Start of memory used for calibration
+    int (*identify)(radio_session_t *s, char *firmware, char *serial);
+    int serial_addr; // Serial number of the radio in memory, 16 bytes, or 0 when none
 } radio_device_t;
 
 extern radio_device_t radio_uv5r;      // Baofeng UV-5R, UV-5RA
@@ -112,33 +303,53 @@ extern radio_device_t radio_bf888s;    // Baofeng BF-888S
 extern radio_device_t radio_bft1;      // Baofeng BF-T1
 
 //
-// Radio: memory contents.
-//
-extern unsigned char radio_mem[];
-
-//
-// Radio: identifier
-//
-extern unsigned char radio_ident[8];
-
-//
-// File descriptor of serial port with programming cable attached.
-//
-extern int radio_port;
-
-//
-// Read/write progress counter.
-//
-extern int radio_progress;
+// Session: all the state of one radio.
+//
+struct radio_session {
+    struct serial_port *port;           // Serial port with programming cable attached
+    char port_name[256];                // Name of the serial port
+    char cable[256];                    // Identity of the serial adapter, or port name
+    char cooldown[256];                 // Key of the reset deadline in cache, or empty
+    char cooldown_tag[32];              // Creation time of pseudo-terminal, or empty
+    radio_device_t *device;             // Device-dependent interface
+    unsigned char ident[8];             // Radio: identifier
+    unsigned char image_ident[8];       // Image file: identifier
+    unsigned char mem[0x7000];          // Radio: memory contents
+    unsigned char backup[0x7000];       // Radio: contents from last download
+    int backup_valid;                   // Radio contents are known
+    int skipped_blocks;                 // Upload: number of unchanged blocks
+    int retries;                        // Number of block retries in this transfer
+    int progress;                       // Read/write progress counter
+    int ack_pending;                    // Acknowledge of last block read not received yet
+    int model_magic;                    // Magic for the known model, or -1 to probe all
+    int magic;                          // Magic of the detected radio
+    long long reset_time;               // Port held: the radio has reset by this time, msec
+    int resume;                         // Continue the transfer from the journal
+    int window;                         // Upload: frames sent before waiting for acknowledge
+    int read_size;                      // Size of block read for this firmware
+    int write_size;                     // Size of block write for this firmware
+    const char *capture_file;           // Capture of the serial protocol, or NULL
+    stats_t stats;                      // Counters of serial i/o and time
+    timeline_t *timeline;               // Timeline of the session, or NULL
+    int timeline_tid;                   // Track of the session on the timeline
+    latency_t *latency;                 // Histograms of reply latency, or NULL
+    FILE *journal;                      // Journal of the current transfer, or NULL
+    int journal_write;                  // Journal is for upload
+    unsigned char journal_done[0x7000]; // Journal: bytes transferred by previous run
+    unsigned char journal_data[0x7000]; // Journal: contents downloaded by previous run
+};
 
 //
 // For testing.
 //
-void uv5r_decode_vfo(int index, int *band, int *hz, int *offset, int *rx_ctcs, int *tx_ctcs,
-                     int *rx_dcs, int *tx_dcs, int *lowpower, int *wide, int *step, int *scode);
-void uv5r_setup_vfo(int index, int band, double rx_mhz, double tx_offset_mhz, int rxtone, int txtone, int step,
-                    int lowpower, int wide, int scode);
+void uv5r_decode_vfo(radio_session_t *s, int index, int *band, int *hz, int *offset, int *rx_ctcs,
+                     int *tx_ctcs, int *rx_dcs, int *tx_dcs, int *lowpower, int *wide, int *step,
+                     int *scode);
+void uv5r_setup_vfo(radio_session_t *s, int index, int band, double rx_mhz, double tx_offset_mhz,
+                    int rxtone, int txtone, int step, int lowpower, int wide, int scode);
 
 #ifdef __cplusplus
 }
 #endif
+
+#endif // RADIO_H
@@ -0,0 +1,70 @@
+/*
+ * Statistics of the clone session.
+ *
+ * Copyright (C) 2013-2023 Serge Vakulenko, KK6ABQ
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   1. Redistributions of source code must retain the above copyright notice,
+ *      this list of conditions and the following disclaimer.
+ *   2. Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in the
+ *      documentation and/or other materials provided with the distribution.
+ *   3. The name of the author may not be used to endorse or promote products
+ *      derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO
+ * EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#include "stats.h"
+
+static const char *phase_name[STATS_NPHASES] = {
+    "connect", "download", "parse", "upload", "disconnect",
+};
+
+static const char *phase_label[STATS_NPHASES] = {
+    "Connect:", "Download:", "Parse config:", "Upload:", "Disconnect:",
+};
+
+//
+// Print the statistics, as text or in JSON format.
+//
+void stats_print(FILE *out, const stats_t *stats, int json)
+{
+    int i;
+
+    if (json) {
+        fprintf(out, "{\"serial_writes\":%lu,\"serial_reads\":%lu,\"timeouts\":%lu,",
+                stats->serial_writes, stats->serial_reads, stats->timeouts);
+        fprintf(out, "\"bytes_written\":%lu,\"bytes_read\":%lu,", stats->bytes_written,
+                stats->bytes_read);
+        fprintf(out, "\"blocks_written\":%lu,\"blocks_read\":%lu,\"retries\":%lu,",
+                stats->blocks_written, stats->blocks_read, stats->retries);
+        fprintf(out, "\"delay_sec\":%.3f,\"phase_sec\":{", stats->delay_usec / 1e6);
+        for (i = 0; i < STATS_NPHASES; i++)
+            fprintf(out, "%s\"%s\":%.3f", i ? "," : "", phase_name[i], stats->phase_usec[i] / 1e6);
+        fprintf(out, "}}\n");
+        return;
+    }
+    fprintf(out, "Statistics:\n");
+    fprintf(out, "    Serial writes: %lu calls, %lu bytes\n", stats->serial_writes,
+            stats->bytes_written);
+    fprintf(out, "    Serial reads:  %lu calls, %lu bytes, %lu timeouts\n", stats->serial_reads,
+            stats->bytes_read, stats->timeouts);
+    fprintf(out, "    Blocks:        %lu read, %lu written, %lu retries\n", stats->blocks_read,
+            stats->blocks_written, stats->retries);
+    fprintf(out, "    Delays:        %.3f sec\n", stats->delay_usec / 1e6);
+    for (i = 0; i < STATS_NPHASES; i++) {
+        if (stats->phase_usec[i] > 0)
+            fprintf(out, "    %-14s %.3f sec\n", phase_label[i], stats->phase_usec[i] / 1e6);
+    }
+}
@@ -0,0 +1,74 @@
+/*
+ * Statistics of the clone session.
+ *
+ * Copyright (C) 2013-2023 Serge Vakulenko, KK6ABQ
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   1. Redistributions of source code must retain the above copyright notice,
+ *      this list of conditions and the following disclaimer.
+ *   2. Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in the
+ *      documentation and/or other materials provided with the distribution.
+ *   3. The name of the author may not be used to endorse or promote products
+ *      derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO
+ * EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifndef STATS_H
+#define STATS_H
+
+#include <stdio.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+//
+// Phases of the session, with wall time.
+//
+enum {
+    STATS_CONNECT,
+    STATS_DOWNLOAD,
+    STATS_PARSE,
+    STATS_UPLOAD,
+    STATS_DISCONNECT,
+    STATS_NPHASES
+};
+
+//
+// Counters of one session.
+//
+typedef struct {
+    unsigned long serial_writes;         // Calls of serial_write()
+    unsigned long serial_reads;          // Calls of serial_read()
+    unsigned long timeouts;              // Reads which got no data in time
+    unsigned long bytes_written;         // Bytes sent to the radio
+    unsigned long bytes_read;            // Bytes received from the radio
+    unsigned long blocks_written;        // Memory blocks written
+    unsigned long blocks_read;           // Memory blocks read
+    unsigned long retries;               // Blocks sent again after a failure
+    long long delay_usec;                // Time spent in mdelay()
+    long long phase_usec[STATS_NPHASES]; // Wall time of every phase
+} stats_t;
+
+//
+// Print the statistics, as text or in JSON format.
+//
+void stats_print(FILE *out, const stats_t *stats, int json);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // STATS_H
@@ -0,0 +1,192 @@
+//
+// Benchmark of clone speed against the emulated radio at 9600 baud.
+//
+// Copyright (c) 2023 Serge Vakulenko
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+//
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "emulator.h"
+#include "radio.h"
+
+//
+// Line speed: 9600 baud, 8N1 framing is 10 bits per byte.
+//
+#define BAUD      9600
+#define BYTE_USEC (10000000 / BAUD)
+
+#define MAXIMAGES 32
+#define NELEM(x)  (int)(sizeof(x) / sizeof(x[0]))
+
+//
+// Phases of the clone session.
+//
+enum { CONNECT, DOWNLOAD, UPLOAD, DISCONNECT, NPHASES };
+
+static const char *phase_name[NPHASES] = { "connect", "download", "upload", "disconnect" };
+
+//
+// Measurements for one phase.
+//
+typedef struct {
+    double seconds;     // Elapsed time
+    unsigned long wire; // Bytes passed through the line in both directions
+    unsigned long data; // Memory bytes transferred
+} result_t;
+
+//
+// Upload: frames sent before waiting for acknowledge.
+//
+static int window = 1;
+
+//
+// Images to run by default.
+//
+static const struct {
+    const char *filename;
+    int delayed_ack;
+} default_images[] = {
+    { TEST_DIR "/../examples/uv-5r-factory.img", 0 },
+    { TEST_DIR "/../examples/bf-f8hp-factory.img", 1 },
+    { TEST_DIR "/../examples/uv-b5-factory.img", 0 },
+    { TEST_DIR "/../examples/bf-888s-factory.img", 0 },
+    { TEST_DIR "/../examples/bf-t1-factory.img", 0 },
+};
+
+//
+// Get time in seconds.
+//
+static double now()
+{
+    struct timespec t;
+
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+//
+// Finish the phase: compute time and traffic since the previous one.
+//
+static void measure(emulator_t *e, result_t *r, double *t0, emu_counters_t *c0)
+{
+    emu_counters_t c;
+    double t = now();
+
+    emu_get_counters(e, &c);
+    r->seconds = t - *t0;
+    r->wire    = (c.rx_bytes - c0->rx_bytes) + (c.tx_bytes - c0->tx_bytes);
+    r->data    = (c.data_read - c0->data_read) + (c.data_written - c0->data_written);
+    *t0        = t;
+    *c0        = c;
+}
+
+//
+// Run full clone session against the emulated radio:
+// connect, download, upload of all blocks, disconnect.
+//
+static void run(const char *filename, int delayed_ack, char *model, result_t *result)
+{
+    emulator_t *e      = emu_start(filename, BYTE_USEC, 0, delayed_ack);
+    radio_session_t *s = radio_session_new();
+    emu_counters_t c0  = { 0 };
+    double t0          = now();
+
+    snprintf(model, 32, "%s%s", radio_name(emu_radio(e)), delayed_ack ? " (F8HP)" : "");
+
+    radio_set_window(s, window);
+    radio_connect(s, emu_port_name(e));
+    measure(e, &result[CONNECT], &t0, &c0);
+
+    radio_download(s);
+    measure(e, &result[DOWNLOAD], &t0, &c0);
+
+    // Write all blocks, not only the modified ones.
+    s->backup_valid = 0;
+    radio_upload(s, 1);
+    measure(e, &result[UPLOAD], &t0, &c0);
+
+    radio_disconnect(s);
+    measure(e, &result[DISCONNECT], &t0, &c0);
+
+    radio_session_free(s);
+    emu_stop(e);
+}
+
+//
+// Print measurements for one radio.
+// Limit is the best data rate possible with the framing of this driver:
+// data bytes per second if the line were busy all the time.
+// Usage is the time the line is busy, relative to the elapsed time.
+//
+static void print_results(const char *model, const result_t *result)
+{
+    int i;
+
+    for (i = 0; i < NPHASES; i++) {
+        const result_t *r = &result[i];
+        double busy       = r->wire * (double)BYTE_USEC / 1e6;
+
+        printf("%-20s %-10s %7.2f %6lu %6lu", i == 0 ? model : "", phase_name[i], r->seconds,
+               r->wire, r->data);
+        if (r->data > 0)
+            printf(" %8.0f %8.0f", r->data / r->seconds, r->data / busy);
+        else
+            printf(" %8s %8s", "-", "-");
+        printf(" %5.1f%%\n", r->seconds > 0 ? 100 * busy / r->seconds : 0);
+    }
+}
+
+int main(int argc, char **argv)
+{
+    static char model[MAXIMAGES][32];
+    static result_t result[MAXIMAGES][NPHASES];
+    int nimages = NELEM(default_images);
+    int i;
+
+    // Option -w N: pipelined upload.
+    if (argc > 2 && strcmp(argv[1], "-w") == 0) {
+        window = atoi(argv[2]);
+        argc -= 2;
+        argv += 2;
+    }
+    if (argc > 1) {
+        nimages = argc - 1;
+        if (nimages > MAXIMAGES) {
+            fprintf(stderr, "Too many images.\n");
+            exit(-1);
+        }
+    }
+    for (i = 0; i < nimages; i++) {
+        if (argc > 1)
+            run(argv[i + 1], 0, model[i], result[i]);
+        else
+            run(default_images[i].filename, default_images[i].delayed_ack, model[i], result[i]);
+    }
+
+    printf("\nClone speed at %d baud, 8N1, upload window %d:\n", BAUD, window);
+    printf("%-20s %-10s %7s %6s %6s %8s %8s %6s\n", "Radio", "Phase", "Time", "Wire", "Data",
+           "Bytes/s", "Limit/s", "Usage");
+    for (i = 0; i < nimages; i++)
+        print_results(model[i], result[i]);
+    return 0;
+}
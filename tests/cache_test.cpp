@@ -0,0 +1,48 @@
+#include <cstdio>
+#include <cstdlib>
+
+#include "util.h"
+#include "cache.h"
+
+//
+// Name of a private cache directory in the current directory.
+//
+static std::string private_cache()
+{
+    std::string dir = get_test_name() + "-cache";
+
+    std::remove((dir + "/baoclone/ports").c_str());
+    return dir;
+}
+
+TEST(cache, directory)
+{
+    auto dir = private_cache();
+    scoped_cache_home home(dir);
+
+    ASSERT_NE(cache_dir(), nullptr);
+    EXPECT_EQ(std::string(cache_dir()), dir + "/baoclone");
+}
+
+TEST(cache, put_get)
+{
+    scoped_cache_home home(private_cache());
+    char value[32];
+
+    EXPECT_EQ(cache_get("ports", "usb-067b:2303-1-1.2", value, sizeof(value)), 0);
+
+    cache_put("ports", "usb-067b:2303-1-1.2", "uv5r");
+    cache_put("ports", "ttyS0", "bf888");
+    ASSERT_NE(cache_get("ports", "usb-067b:2303-1-1.2", value, sizeof(value)), 0);
+    EXPECT_STREQ(value, "uv5r");
+
+    // Replace the value, keep the other entry.
+    cache_put("ports", "usb-067b:2303-1-1.2", "aged");
+    ASSERT_NE(cache_get("ports", "usb-067b:2303-1-1.2", value, sizeof(value)), 0);
+    EXPECT_STREQ(value, "aged");
+    ASSERT_NE(cache_get("ports", "ttyS0", value, sizeof(value)), 0);
+    EXPECT_STREQ(value, "bf888");
+
+    // Key must match completely.
+    EXPECT_EQ(cache_get("ports", "ttyS", value, sizeof(value)), 0);
+}
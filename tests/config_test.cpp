@@ -17,8 +17,10 @@ static std::string show_config(const std::string &img_basename)
     FILE *output = fopen(output_filename.c_str(), "w");
     EXPECT_NE(output, nullptr);
 
-    radio_read_image(img_filename.c_str());
-    radio_print_config(output, false);
+    radio_session_t *s = radio_session_new();
+    radio_read_image(s, img_filename.c_str());
+    radio_print_config(s, output, false);
+    radio_session_free(s);
     fclose(output);
     return file_contents(output_filename);
 }
@@ -0,0 +1,230 @@
+#include <cstdio>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <thread>
+#include <unistd.h>
+
+#include "util.h"
+#include "daemon.h"
+#include "emulator.h"
+
+//
+// Connect to the daemon, waiting until it listens.
+//
+static int connect_daemon(const std::string &socket_path)
+{
+    struct sockaddr_un addr = {};
+
+    addr.sun_family = AF_UNIX;
+    snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", socket_path.c_str());
+    for (int i = 0; i < 100; i++) {
+        int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0)
+            return fd;
+        close(fd);
+        usleep(20000);
+    }
+    return -1;
+}
+
+//
+// Send request line to the daemon.
+//
+static void send_request(int fd, const std::string &line)
+{
+    std::string data = line + "\n";
+
+    ASSERT_EQ(write(fd, data.data(), data.size()), (ssize_t)data.size());
+}
+
+//
+// Receive one line from the daemon, or empty string on timeout.
+//
+static std::string receive_line(int fd, int timeout_msec = 30000)
+{
+    std::string line;
+    char c;
+
+    for (;;) {
+        struct pollfd p = { fd, POLLIN, 0 };
+        if (poll(&p, 1, timeout_msec) <= 0 || read(fd, &c, 1) != 1)
+            return "";
+        if (c == '\n')
+            return line;
+        line += c;
+    }
+}
+
+TEST(daemon, queue_per_port)
+{
+    std::string img_filename = TEST_DIR "/../examples/uv-5r-factory.img";
+    std::string socket_path  = get_test_name() + ".sock";
+    std::string out_filename = get_test_name() + ".img";
+    emulator_t *e            = emu_start(img_filename.c_str(), 0, 0, false);
+    std::string port         = emu_port_name(e);
+
+    std::thread server([&] { daemon_serve(socket_path.c_str()); });
+    int fd = connect_daemon(socket_path);
+    ASSERT_GE(fd, 0);
+
+    // Bad requests are rejected.
+    send_request(fd, R"({"op":"reboot"})");
+    EXPECT_EQ(receive_line(fd), R"({"error":"unknown op"})");
+    send_request(fd, R"({"op":"download", "port":")" + port + R"("})");
+    EXPECT_EQ(receive_line(fd), R"({"error":"image required"})");
+
+    // Two jobs for the same radio, in one write: the second waits for the first.
+    send_request(fd, R"({"op":"identify", "port":")" + port + R"("})" "\n" +
+                         R"({"op":"download", "port":")" + port + R"(", "image":")" +
+                         out_filename + R"(", "model":"UV-5R"})");
+    EXPECT_EQ(receive_line(fd), R"({"id":1,"state":"queued"})");
+    EXPECT_EQ(receive_line(fd), R"({"id":2,"state":"queued"})");
+
+    std::vector<std::string> states;
+    std::string identity;
+    bool got_output = false;
+    while (states.size() < 4) {
+        std::string line = receive_line(fd);
+        ASSERT_NE(line, "");
+        if (starts_with(line, R"({"event":"output","id":)")) {
+            got_output = true;
+            continue;
+        }
+        ASSERT_TRUE(starts_with(line, R"({"event":"state","id":)")) << line;
+        auto pos = line.find(R"("state":")");
+        auto end = line.find('"', pos + 9);
+        states.push_back(line.substr(22, 1) + " " + line.substr(pos + 9, end - pos - 9));
+        if (line[22] == '1' && line.find(R"("result":)") != std::string::npos)
+            identity = line;
+    }
+    EXPECT_EQ(states, (std::vector<std::string>{ "1 running", "1 done", "2 running", "2 done" }));
+    EXPECT_NE(identity.find(R"("model":"Baofeng UV-5R")"), std::string::npos);
+    EXPECT_NE(identity.find("\\tBaofeng UV-5R\\t"), std::string::npos);
+    EXPECT_TRUE(got_output);
+    EXPECT_EQ(file_contents(out_filename), file_contents(img_filename));
+
+    // Status of one job.
+    send_request(fd, R"({"op":"status", "id":2})");
+    std::string status = receive_line(fd);
+    EXPECT_TRUE(starts_with(status, R"({"jobs":[{"id":2,"op":"download","port":")")) << status;
+    EXPECT_NE(status.find(R"("state":"done")"), std::string::npos);
+
+    close(fd);
+    daemon_stop();
+    server.join();
+    EXPECT_NE(access(socket_path.c_str(), F_OK), 0);
+    emu_stop(e);
+}
+
+TEST(daemon, check_access)
+{
+    std::string img_filename = TEST_DIR "/../examples/uv-5r-factory.img";
+    std::string socket_path  = get_test_name() + ".sock";
+    std::string out_filename = get_test_name() + "-\xc3\xbc.img";
+    emulator_t *e            = emu_start(img_filename.c_str(), 0, 0, false);
+    std::string port         = emu_port_name(e);
+    struct stat st;
+
+    std::remove(out_filename.c_str());
+    std::thread server([&] { daemon_serve(socket_path.c_str()); });
+    int fd = connect_daemon(socket_path);
+    ASSERT_GE(fd, 0);
+
+    // Only the user may connect.
+    ASSERT_EQ(stat(socket_path.c_str(), &st), 0);
+    EXPECT_EQ(st.st_mode & 0777, 0600u);
+
+    // Jobs with port or files the client could not open are refused.
+    send_request(fd, R"({"op":"upload", "port":")" + port + R"(", "image":"missing.img"})");
+    EXPECT_EQ(receive_line(fd), R"({"error":"image not readable"})");
+    send_request(fd, R"({"op":"download", "port":")" + port + R"(", "image":"missing/a.img"})");
+    EXPECT_EQ(receive_line(fd), R"({"error":"image not writable"})");
+    send_request(fd, R"({"op":"identify", "port":"/dev/missing"})");
+    EXPECT_EQ(receive_line(fd), R"({"error":"port not accessible"})");
+
+    // Names are UTF-8, escaped or not, and sent back unchanged.
+    send_request(fd, R"({"op":"download", "port":")" + port + R"(", "image":")" +
+                         get_test_name() + R"(-\u00fc.img"})");
+    std::string line = receive_line(fd);
+    EXPECT_TRUE(starts_with(line, R"({"id":)")) << line;
+    do {
+        line = receive_line(fd);
+        ASSERT_NE(line, "");
+    } while (!starts_with(line, R"({"event":"state")") ||
+             line.find(R"("state":"running")") != std::string::npos);
+    EXPECT_NE(line.find(R"("state":"done")"), std::string::npos) << line;
+    EXPECT_NE(line.find(R"("result":")" + out_filename + R"(")"), std::string::npos) << line;
+    EXPECT_EQ(file_contents(out_filename), file_contents(img_filename));
+
+    close(fd);
+    daemon_stop();
+    server.join();
+    emu_stop(e);
+}
+
+//
+// Receive events until the job has finished.
+// Return the final state line, and the output of the job.
+//
+static std::string wait_job(int fd, int id, std::string &output)
+{
+    std::string state  = R"({"event":"state","id":)" + std::to_string(id) + ",";
+    std::string text   = R"({"event":"output","id":)" + std::to_string(id) + ",";
+    std::string line;
+
+    for (;;) {
+        line = receive_line(fd);
+        if (line == "")
+            return line;
+        auto pos = line.find(R"("text":")");
+        if (starts_with(line, text.c_str()) && pos != std::string::npos)
+            output += line.substr(pos + 8);
+        if (starts_with(line, state.c_str()) &&
+            line.find(R"("state":"running")") == std::string::npos)
+            return line;
+    }
+}
+
+TEST(daemon, worker_per_port)
+{
+    std::string img_filename  = TEST_DIR "/../examples/uv-5r-factory.img";
+    std::string socket_path   = get_test_name() + ".sock";
+    std::string conf_filename = get_test_name() + ".conf";
+    emulator_t *e             = emu_start(img_filename.c_str(), 0, 0, false);
+    std::string port          = emu_port_name(e);
+    std::string output;
+
+    create_file(conf_filename, "Garbage\n");
+    std::thread server([&] { daemon_serve(socket_path.c_str()); });
+    int fd = connect_daemon(socket_path);
+    ASSERT_GE(fd, 0);
+
+    // Job fails by exit(): the worker is gone with it.
+    send_request(fd, R"({"op":"configure", "port":")" + port + R"(", "conf":")" + conf_filename +
+                         R"("})");
+    EXPECT_EQ(receive_line(fd), R"({"id":1,"state":"queued"})");
+    EXPECT_NE(wait_job(fd, 1, output).find(R"("state":"failed")"), std::string::npos);
+    EXPECT_NE(output.find("Invalid line"), std::string::npos) << output;
+
+    // Next job on this port starts a new worker.
+    send_request(fd, R"({"op":"identify", "port":")" + port + R"("})");
+    EXPECT_EQ(receive_line(fd), R"({"id":2,"state":"queued"})");
+    output.clear();
+    EXPECT_NE(wait_job(fd, 2, output).find(R"("state":"done")"), std::string::npos);
+    EXPECT_NE(output.find("Connect to"), std::string::npos) << output;
+
+    // The worker keeps the port open between jobs.
+    send_request(fd, R"({"op":"identify", "port":")" + port + R"("})");
+    EXPECT_EQ(receive_line(fd), R"({"id":3,"state":"queued"})");
+    output.clear();
+    EXPECT_NE(wait_job(fd, 3, output).find(R"("state":"done")"), std::string::npos);
+    EXPECT_NE(output.find("Detected Baofeng UV-5R"), std::string::npos) << output;
+    EXPECT_EQ(output.find("Close device"), std::string::npos) << output;
+
+    close(fd);
+    daemon_stop();
+    server.join();
+    emu_stop(e);
+}
@@ -0,0 +1,448 @@
+#include <cstdio>
+#include <fcntl.h>
+#include <fstream>
+#include <stdio.h>
+#include <unistd.h>
+
+#include "util.h"
+#include "radio.h"
+#include "emulator.h"
+
+//
+// Read the radio emulated with image file, located in the examples directory.
+// Check that we've got the same configuration.
+//
+static void check_download(const std::string &img_basename, bool delayed_ack = false,
+                           int fault_every = 0)
+{
+    std::string img_filename = std::string(TEST_DIR "/../examples/") + img_basename;
+    emulator_t *e            = emu_start(img_filename.c_str(), 0, 0, delayed_ack);
+    radio_session_t *s       = radio_session_new();
+
+    emu_inject_faults(e, fault_every);
+    radio_connect(s, emu_port_name(e));
+    radio_download(s);
+    radio_disconnect(s);
+    if (fault_every > 0) {
+        EXPECT_GT(s->retries, 0);
+    }
+
+    EXPECT_STREQ(radio_name(s), radio_name(emu_radio(e)));
+    EXPECT_EQ(config_of(s, ""), config_of(emu_radio(e), "-expect"));
+
+    radio_session_free(s);
+    emu_stop(e);
+}
+
+TEST(emulator, uv_5r_download)
+{
+    check_download("uv-5r-factory.img");
+}
+
+TEST(emulator, bf_f8hp_download)
+{
+    check_download("bf-f8hp-factory.img", true);
+}
+
+TEST(emulator, uv_b5_download)
+{
+    check_download("uv-b5-factory.img");
+}
+
+TEST(emulator, bf_888s_download)
+{
+    check_download("bf-888s-factory.img");
+}
+
+TEST(emulator, bf_t1_download)
+{
+    check_download("bf-t1-factory.img");
+}
+
+TEST(emulator, uv_5r_download_retry)
+{
+    check_download("uv-5r-factory.img", false, 17);
+}
+
+TEST(emulator, bf_888s_download_retry)
+{
+    check_download("bf-888s-factory.img", false, 5);
+}
+
+TEST(emulator, model_hint)
+{
+    std::string img_filename = TEST_DIR "/../examples/bf-888s-factory.img";
+    emulator_t *e            = emu_start(img_filename.c_str(), 0, 0, false);
+    radio_session_t *s       = radio_session_new();
+
+    // Same as 'baoclone --model=bf-888s port'.
+    radio_set_model(s, "bf-888s");
+    radio_connect(s, emu_port_name(e));
+    radio_disconnect(s);
+    EXPECT_STREQ(radio_name(s), "Baofeng BF-888S");
+
+    radio_session_free(s);
+    emu_stop(e);
+}
+
+TEST(emulator, uv_5r_configure)
+{
+    std::string img_filename  = TEST_DIR "/../examples/uv-5r-factory.img";
+    std::string conf_filename = TEST_DIR "/../examples/uv-5r-sunnyvale.conf";
+    emulator_t *e             = emu_start(img_filename.c_str(), 0, 0, false);
+    radio_session_t *s        = radio_session_new();
+
+    // Same sequence as 'baoclone -c port file.conf'.
+    radio_connect(s, emu_port_name(e));
+    radio_download(s);
+    radio_parse_config(s, conf_filename.c_str());
+    radio_upload(s, 1);
+    radio_disconnect(s);
+
+    // Radio must have the new configuration.
+    auto result = config_of(emu_radio(e), "");
+    EXPECT_EQ(result, config_of(s, "-expect"));
+    EXPECT_NE(result.find("Message: WelcomeBuddy!"), std::string::npos);
+
+    radio_session_free(s);
+    emu_stop(e);
+}
+
+TEST(emulator, uv_5r_configure_resume)
+{
+    std::string img_filename  = TEST_DIR "/../examples/uv-5r-factory.img";
+    std::string conf_filename = TEST_DIR "/../examples/uv-5r-sunnyvale.conf";
+    std::string log_filename  = get_test_name() + ".log";
+    emulator_t *e             = emu_start(img_filename.c_str(), 0, 0, false);
+    radio_session_t *s        = radio_session_new();
+    std::string command       = std::string(BAOCLONE) + " -c --resume " + emu_port_name(e) +
+                          " " + conf_filename + " >" + log_filename + " 2>&1";
+
+    // Radio is switched off in the middle of upload.
+    emu_fail_writes(e, 20);
+    EXPECT_NE(system(command.c_str()), 0);
+
+    // Same command again, after the radio has reset:
+    // download of the radio keeps the journal of upload.
+    emu_fail_writes(e, -1);
+    usleep(1200000);
+    EXPECT_EQ(system(command.c_str()), 0);
+    EXPECT_NE(file_contents(log_filename).find("Resume: 20 blocks done before."),
+              std::string::npos)
+        << file_contents(log_filename);
+
+    radio_read_image(s, img_filename.c_str());
+    radio_parse_config(s, conf_filename.c_str());
+    EXPECT_EQ(config_of(emu_radio(e), ""), config_of(s, "-expect"));
+
+    radio_session_free(s);
+    emu_stop(e);
+}
+
+TEST(emulator, uv_b5_upload_retry)
+{
+    std::string img_filename = TEST_DIR "/../examples/uv-b5-factory.img";
+    emulator_t *e            = emu_start(img_filename.c_str(), 0, 0, false);
+    radio_session_t *s       = radio_session_new();
+
+    // Write all blocks through a bad cable.
+    radio_connect(s, emu_port_name(e));
+    radio_download(s);
+    emu_inject_faults(e, 23);
+    s->backup_valid = 0;
+    radio_upload(s, 1);
+    radio_disconnect(s);
+
+    EXPECT_GT(s->retries, 0);
+    EXPECT_EQ(config_of(emu_radio(e), ""), config_of(s, "-expect"));
+
+    radio_session_free(s);
+    emu_stop(e);
+}
+
+TEST(emulator, bf_888s_slow_write_ack)
+{
+    std::string img_filename  = TEST_DIR "/../examples/bf-888s-factory.img";
+    std::string conf_filename = TEST_DIR "/../examples/bf-888s-gmrs.conf";
+    emulator_t *e             = emu_start(img_filename.c_str(), 0, 0, false);
+    radio_session_t *s        = radio_session_new();
+
+    // Radio programs its memory before acknowledge of a write:
+    // the timeout of reads would be too short for it.
+    emu_set_latency(e, 10000, 60000);
+    radio_connect(s, emu_port_name(e));
+    radio_download(s);
+    radio_parse_config(s, conf_filename.c_str());
+    radio_upload(s, 1);
+    radio_disconnect(s);
+
+    EXPECT_EQ(s->retries, 0);
+    EXPECT_EQ(config_of(emu_radio(e), ""), config_of(s, "-expect"));
+
+    radio_session_free(s);
+    emu_stop(e);
+}
+
+TEST(emulator, uv_5r_slower_radio)
+{
+    std::string img_filename = TEST_DIR "/../examples/uv-5r-factory.img";
+    emulator_t *e            = emu_start(img_filename.c_str(), 0, 5000, false);
+    radio_session_t *s       = radio_session_new();
+    char line[256];
+
+    // Latency learned at connect is too short after the radio slows down:
+    // the timeout is doubled on every retry, until the reply fits in it.
+    radio_connect(s, emu_port_name(e));
+    emu_set_latency(e, 70000, 0);
+    radio_identify(s, line, sizeof(line));
+    radio_disconnect(s);
+
+    EXPECT_GT(s->retries, 0);
+    EXPECT_NE(std::string(line).find("\tVer  BFB291\t"), std::string::npos) << line;
+
+    radio_session_free(s);
+    emu_stop(e);
+}
+
+TEST(emulator, uv_b5_upload_resume)
+{
+    std::string img_filename = TEST_DIR "/../examples/uv-b5-factory.img";
+    std::string cache_dir    = get_test_name() + "-cache";
+    emulator_t *e            = emu_start(img_filename.c_str(), 0, 0, false);
+    radio_session_t *s       = radio_session_new();
+    scoped_cache_home home(cache_dir);
+    emu_counters_t c0, c1, c2;
+    int addr;
+
+    radio_connect(s, emu_port_name(e));
+    radio_download(s);
+    s->backup_valid = 0;
+
+    // Full upload.
+    emu_get_counters(e, &c0);
+    radio_upload(s, 1);
+    emu_get_counters(e, &c1);
+
+    // Upload interrupted after the first 0x800 bytes.
+    radio_journal_start(s, 1);
+    for (addr = 0; addr < 0x800; addr += 0x10)
+        radio_journal_add(s, addr, &s->mem[addr], 0x10);
+    fclose(s->journal);
+    s->journal = NULL;
+
+    // Same as 'baoclone --resume -w port file.img'.
+    radio_set_resume(s, 1);
+    radio_upload(s, 1);
+    emu_get_counters(e, &c2);
+    radio_disconnect(s);
+
+    EXPECT_EQ(c2.data_written - c1.data_written, c1.data_written - c0.data_written - 0x800);
+    EXPECT_EQ(config_of(emu_radio(e), ""), config_of(s, "-expect"));
+
+    radio_session_free(s);
+    emu_stop(e);
+}
+
+//
+// Upload all blocks to UV-5R with pipelined writes.
+//
+static void check_upload_window(int window, int fault_every)
+{
+    std::string img_filename = TEST_DIR "/../examples/uv-5r-factory.img";
+    std::string conf_filename = TEST_DIR "/../examples/uv-5r-sunnyvale.conf";
+    emulator_t *e             = emu_start(img_filename.c_str(), 0, 0, false);
+    radio_session_t *s        = radio_session_new();
+
+    // Same as 'baoclone --window=N -c port file.conf'.
+    radio_set_window(s, window);
+    radio_connect(s, emu_port_name(e));
+    radio_download(s);
+    radio_parse_config(s, conf_filename.c_str());
+    emu_inject_faults(e, fault_every);
+    s->backup_valid = 0;
+    radio_upload(s, 1);
+    radio_disconnect(s);
+
+    if (fault_every > 0) {
+        EXPECT_GT(s->retries, 0);
+        EXPECT_EQ(s->window, 1);
+    } else {
+        EXPECT_EQ(s->retries, 0);
+        EXPECT_EQ(s->window, window);
+    }
+    EXPECT_EQ(config_of(emu_radio(e), ""), config_of(s, "-expect"));
+
+    radio_session_free(s);
+    emu_stop(e);
+}
+
+//
+// Radio stops answering in the middle of upload: the upload fails
+// without exiting, and the next session resumes it from the journal.
+//
+TEST(emulator, uv_b5_upload_failed)
+{
+    std::string img_filename = TEST_DIR "/../examples/uv-b5-factory.img";
+    std::string cache_dir    = get_test_name() + "-cache";
+    emulator_t *e            = emu_start(img_filename.c_str(), 0, 0, false);
+    radio_session_t *s       = radio_session_new();
+    scoped_cache_home home(cache_dir);
+    emu_counters_t c0, c1;
+
+    radio_connect(s, emu_port_name(e));
+    EXPECT_EQ(radio_download(s), 1);
+    s->backup_valid = 0;
+
+    emu_fail_writes(e, 20);
+    EXPECT_EQ(radio_upload(s, 1), 0);
+    radio_disconnect(s);
+
+    // Same as 'baoclone --resume', after the radio has reset.
+    emu_fail_writes(e, -1);
+    usleep(1200000);
+    radio_connect(s, emu_port_name(e));
+    radio_set_resume(s, 1);
+    emu_get_counters(e, &c0);
+    EXPECT_EQ(radio_upload(s, 1), 1);
+    emu_get_counters(e, &c1);
+    radio_disconnect(s);
+
+    EXPECT_EQ(c1.data_written - c0.data_written, 0x1000 - 20 * 0x10);
+    EXPECT_EQ(config_of(emu_radio(e), ""), config_of(s, "-expect"));
+
+    radio_session_free(s);
+    emu_stop(e);
+}
+
+TEST(emulator, uv_5r_upload_window)
+{
+    check_upload_window(4, 0);
+}
+
+TEST(emulator, uv_5r_upload_window_fallback)
+{
+    check_upload_window(8, 37);
+}
+
+TEST(emulator, bf_888s_calibrate)
+{
+    std::string img_filename = TEST_DIR "/../examples/bf-888s-factory.img";
+    std::string cache_dir    = get_test_name() + "-cache";
+    emulator_t *e            = emu_start(img_filename.c_str(), 0, 0, false);
+    radio_session_t *s       = radio_session_new();
+    radio_session_t *img     = radio_session_new();
+    scoped_cache_home home(cache_dir);
+    emu_counters_t c0, c1;
+
+    std::remove((cache_dir + "/baoclone/blocks").c_str());
+    emu_limit_blocks(e, 0x20, 0x10);
+
+    // Same as 'baoclone --calibrate port'.
+    radio_connect(s, emu_port_name(e));
+    EXPECT_EQ(s->read_size, 8);
+    EXPECT_EQ(s->write_size, 8);
+    radio_calibrate(s);
+    radio_disconnect(s);
+    EXPECT_EQ(s->read_size, 0x20);
+    EXPECT_EQ(s->write_size, 0x10);
+
+    // Refused writes must leave the contents intact.
+    radio_read_image(img, img_filename.c_str());
+    EXPECT_EQ(config_of(emu_radio(e), ""), config_of(img, "-expect"));
+
+    // Next connect uses the calibrated sizes.
+    radio_session_free(s);
+    s = radio_session_new();
+    radio_connect(s, emu_port_name(e));
+    EXPECT_EQ(s->read_size, 0x20);
+    EXPECT_EQ(s->write_size, 0x10);
+    radio_download(s);
+    s->backup_valid = 0;
+    emu_get_counters(e, &c0);
+    radio_upload(s, 1);
+    emu_get_counters(e, &c1);
+    radio_disconnect(s);
+
+    EXPECT_EQ(s->retries, 0);
+    EXPECT_EQ(c1.data_written - c0.data_written, 0x100u + 0x10u + 0x20u);
+    EXPECT_EQ(config_of(s, ""), config_of(img, "-expect"));
+
+    radio_session_free(img);
+    radio_session_free(s);
+    emu_stop(e);
+}
+
+TEST(emulator, uv_5r_identify)
+{
+    std::string img_filename = TEST_DIR "/../examples/uv-5r-factory.img";
+    emulator_t *e            = emu_start(img_filename.c_str(), 0, 0, false);
+    radio_session_t *s       = radio_session_new();
+    emu_counters_t count;
+    char line[256];
+
+    // Same as 'baoclone --identify port'.
+    radio_connect(s, emu_port_name(e));
+    radio_identify(s, line, sizeof(line));
+    radio_disconnect(s);
+    emu_get_counters(e, &count);
+
+    std::string expect = std::string(emu_port_name(e)) + "\tBaofeng UV-5R\t";
+    for (int i = 0; i < 8; i++) {
+        char hex[3];
+        snprintf(hex, sizeof(hex), "%02x", s->ident[i]);
+        expect += hex;
+    }
+    expect += "\tVer  BFB291\tCCCCCCCDDDDDDD";
+    EXPECT_EQ(std::string(line), expect);
+    EXPECT_EQ(count.data_read, 0x40u);
+
+    radio_session_free(s);
+    emu_stop(e);
+}
+
+TEST(emulator, bf_888s_identify)
+{
+    std::string img_filename = TEST_DIR "/../examples/bf-888s-factory.img";
+    emulator_t *e            = emu_start(img_filename.c_str(), 0, 0, false);
+    radio_session_t *s       = radio_session_new();
+    emu_counters_t count;
+    char line[256];
+
+    // No firmware version: nothing to read.
+    radio_connect(s, emu_port_name(e));
+    radio_identify(s, line, sizeof(line));
+    radio_disconnect(s);
+    emu_get_counters(e, &count);
+
+    std::string text = line;
+    EXPECT_EQ(text.substr(0, text.find('\t')), emu_port_name(e));
+    EXPECT_EQ(text.substr(text.size() - 4), "\t-\t-");
+    EXPECT_EQ(count.data_read, 0u);
+
+    radio_session_free(s);
+    emu_stop(e);
+}
+
+TEST(emulator, probe)
+{
+    std::string img_filename = TEST_DIR "/../examples/uv-b5-factory.img";
+    emulator_t *e            = emu_start(img_filename.c_str(), 0, 0, false);
+    radio_session_t *s       = radio_session_new();
+
+    // Same as 'baoclone --scan port'.
+    ASSERT_EQ(radio_probe(s, emu_port_name(e)), 1);
+    EXPECT_STREQ(radio_name(s), "Baofeng UV-B5");
+    radio_disconnect(s);
+
+    // Silent line: one pass of magics, then give up.
+    int master = posix_openpt(O_RDWR | O_NOCTTY);
+    ASSERT_GE(master, 0);
+    grantpt(master);
+    unlockpt(master);
+    EXPECT_EQ(radio_probe(s, ptsname(master)), 0);
+    EXPECT_EQ(radio_name(s), nullptr);
+    close(master);
+
+    radio_session_free(s);
+    emu_stop(e);
+}
@@ -0,0 +1,311 @@
+#include <algorithm>
+#include <csignal>
+#include <cstdio>
+#include <sstream>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "util.h"
+#include "fleet.h"
+#include "emulator.h"
+
+//
+// Ports for the fleet: two emulated radios, and one which cannot be opened.
+//
+static std::vector<std::string> fleet_ports(const std::string &first_img)
+{
+    std::string examples = TEST_DIR "/../examples/";
+
+    return {
+        "emu:" + examples + first_img,
+        "emu:" + examples + "missing.img",
+        "emu:" + examples + "bf-888s-factory.img",
+    };
+}
+
+//
+// Same as the job of 'baoclone -m --identify'.
+//
+static void identify_job(radio_session_t *s, const char *port_name, const char *tag)
+{
+    char line[256];
+
+    radio_connect(s, port_name);
+    radio_identify(s, line, sizeof(line));
+    radio_disconnect(s);
+    fleet_report(line);
+}
+
+//
+// Same as the job of 'baoclone -m', without output files.
+//
+static void download_job(radio_session_t *s, const char *port_name, const char *tag)
+{
+    radio_connect(s, port_name);
+    radio_download(s);
+    radio_disconnect(s);
+}
+
+//
+// Split text into lines.
+//
+static std::vector<std::string> split_lines(const std::string &text)
+{
+    std::vector<std::string> lines;
+    std::stringstream input(text);
+    std::string line;
+
+    while (std::getline(input, line))
+        lines.push_back(line);
+    return lines;
+}
+
+TEST(fleet, identify_inventory)
+{
+    auto names = fleet_ports("uv-5r-factory.img");
+    char *ports[] = { &names[0][0], &names[1][0], &names[2][0] };
+
+    std::remove("missing.img.log");
+    testing::internal::CaptureStdout();
+    testing::internal::CaptureStderr();
+    int nfailed = fleet_run(3, ports, identify_job, 1);
+    auto out    = split_lines(testing::internal::GetCapturedStdout());
+    auto err    = testing::internal::GetCapturedStderr();
+
+    // One line per radio, in order of ports; the failed port goes to stderr.
+    EXPECT_EQ(nfailed, 1);
+    ASSERT_EQ(out.size(), 2u);
+    EXPECT_TRUE(starts_with(out[0], (names[0] + "\tBaofeng UV-5R\t").c_str())) << out[0];
+    EXPECT_TRUE(starts_with(out[1], (names[2] + "\tBaofeng BF-888S\t").c_str())) << out[1];
+    EXPECT_EQ(err, names[1] + ": failed, see 'missing.img.log'\n");
+    EXPECT_NE(file_contents("missing.img.log").find("missing.img"), std::string::npos);
+}
+
+TEST(fleet, download_summary)
+{
+    auto names = fleet_ports("bf-888s-factory2.img");
+    char *ports[] = { &names[0][0], &names[1][0], &names[2][0] };
+
+    testing::internal::CaptureStdout();
+    int nfailed = fleet_run(3, ports, download_job, 0);
+    auto out    = split_lines(testing::internal::GetCapturedStdout());
+
+    // Started, finished in any order, then the summary table in order of ports.
+    EXPECT_EQ(nfailed, 1);
+    ASSERT_EQ(out.size(), 3u + 3u + 2u + 3u);
+    EXPECT_EQ(out[0], names[0] + ": started, output to 'bf-888s-factory2.img.log'");
+    EXPECT_EQ(out[1], names[1] + ": started, output to 'missing.img.log'");
+    EXPECT_EQ(out[2], names[2] + ": started, output to 'bf-888s-factory.img.log'");
+
+    std::vector<std::string> finished(out.begin() + 3, out.begin() + 6);
+    std::sort(finished.begin(), finished.end());
+    std::vector<std::string> expect = {
+        names[0] + ": done",
+        names[2] + ": done",
+        names[1] + ": failed",
+    };
+    std::sort(expect.begin(), expect.end());
+    EXPECT_EQ(finished, expect);
+
+    EXPECT_EQ(out[6], "");
+    EXPECT_TRUE(starts_with(out[7], "Port ")) << out[7];
+    for (int i = 0; i < 3; i++) {
+        const auto &row = out[8 + i];
+        EXPECT_TRUE(starts_with(row, names[i].c_str())) << row;
+        EXPECT_NE(row.find(i == 1 ? "  Failed" : "  OK"), std::string::npos) << row;
+    }
+    EXPECT_NE(out[8].find("Baofeng BF-888S"), std::string::npos) << out[8];
+    EXPECT_NE(out[9].find(" - "), std::string::npos) << out[9];
+    EXPECT_NE(out[10].find("Baofeng BF-888S"), std::string::npos) << out[10];
+}
+
+//
+// File where the watch job appends a line per radio.
+//
+static std::string watch_jobs_filename;
+
+//
+// Same as a job of 'baoclone --watch-ports', which only identifies the radio.
+//
+static void watch_job(radio_session_t *s, const char *port_name, const char *tag)
+{
+    char line[256];
+    FILE *jobs;
+
+    radio_connect(s, port_name);
+    radio_identify(s, line, sizeof(line));
+    radio_disconnect(s);
+    jobs = fopen(watch_jobs_filename.c_str(), "a");
+    fprintf(jobs, "%s\n", line);
+    fclose(jobs);
+}
+
+//
+// Attach the port to the emulated radio: replace the link at once.
+//
+static void attach_port(const std::string &link, emulator_t *e)
+{
+    std::string tmp = link.substr(0, link.rfind('/')) + "/.new";
+
+    unlink(tmp.c_str());
+    ASSERT_EQ(symlink(emu_port_name(e), tmp.c_str()), 0);
+    ASSERT_EQ(rename(tmp.c_str(), link.c_str()), 0);
+}
+
+//
+// Wait until the file has the given number of lines.
+//
+static std::vector<std::string> wait_lines(const std::string &filename, unsigned count)
+{
+    auto lines = file_contents_split(filename);
+
+    for (int i = 0; i < 300 && lines.size() < count; i++) {
+        usleep(100000);
+        lines = file_contents_split(filename);
+    }
+    return lines;
+}
+
+//
+// Wait until the file contains the text.
+//
+static bool wait_text(const std::string &filename, const std::string &text)
+{
+    for (int i = 0; i < 300; i++) {
+        if (file_contents(filename).find(text) != std::string::npos)
+            return true;
+        usleep(100000);
+    }
+    return false;
+}
+
+//
+// Watch process with its jobs, killed when the test returns.
+//
+struct watch_process {
+    pid_t pid;
+
+    ~watch_process()
+    {
+        kill(-pid, SIGKILL);
+        waitpid(pid, NULL, 0);
+    }
+};
+
+//
+// Same as 'baoclone --watch-ports=1 pattern', until killed.
+//
+static pid_t start_watch(std::string &pattern, const std::string &out_filename)
+{
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid == 0) {
+        char *patterns[] = { &pattern[0] };
+
+        setpgid(0, 0);
+        if (!freopen(out_filename.c_str(), "w", stdout))
+            _exit(-1);
+        setvbuf(stdout, NULL, _IOLBF, 0);
+        fleet_watch(1, patterns, watch_job, 1);
+        _exit(0);
+    }
+    if (pid > 0)
+        setpgid(pid, pid);
+    return pid;
+}
+
+TEST(fleet, watch_ports)
+{
+    std::string img_filename   = TEST_DIR "/../examples/uv-5r-factory.img";
+    std::string other_filename = get_test_name() + "-other.img";
+    std::string out_filename   = get_test_name() + ".out";
+    std::string dir            = get_test_name() + "-dev";
+    std::string link           = dir + "/ttyW0";
+    std::string pattern        = dir + "/tty*";
+
+    // Second radio of the same model and firmware, another serial number.
+    auto contents = file_contents(img_filename);
+    contents.replace(8 + 0x1800 + 0x10, 14, "120801NB5R0002");
+    create_file(other_filename, contents);
+
+    mkdir(dir.c_str(), 0755);
+    unlink(link.c_str());
+    watch_jobs_filename = get_test_name() + ".jobs";
+    std::remove(watch_jobs_filename.c_str());
+    emulator_t *first  = emu_start(img_filename.c_str(), 0, 0, false);
+    emulator_t *second = emu_start(other_filename.c_str(), 0, 0, false);
+
+    pid_t pid = start_watch(pattern, out_filename);
+    ASSERT_GE(pid, 0);
+    watch_process watch = { pid };
+
+    // New radio: the job is run once.
+    attach_port(link, first);
+    auto jobs = wait_lines(watch_jobs_filename, 1);
+    ASSERT_EQ(jobs.size(), 1u);
+    EXPECT_NE(jobs[0].find("\tCCCCCCCDDDDDDD"), std::string::npos) << jobs[0];
+    sleep(3);
+    EXPECT_EQ(file_contents_split(watch_jobs_filename).size(), 1u);
+
+    // Radio swapped between two probes: the job is run for the new one.
+    attach_port(link, second);
+    jobs = wait_lines(watch_jobs_filename, 2);
+    ASSERT_EQ(jobs.size(), 2u);
+    EXPECT_NE(jobs[1].find("\t120801NB5R0002"), std::string::npos) << jobs[1];
+    EXPECT_TRUE(wait_text(out_filename, "ttyW0: radio replaced\n"));
+
+    // Port removed and attached again: the radio is new.
+    unlink(link.c_str());
+    EXPECT_TRUE(wait_text(out_filename, "ttyW0: removed\n"));
+    attach_port(link, second);
+    jobs = wait_lines(watch_jobs_filename, 3);
+    ASSERT_EQ(jobs.size(), 3u);
+    EXPECT_NE(jobs[2].find("\t120801NB5R0002"), std::string::npos) << jobs[2];
+
+    unlink(link.c_str());
+    rmdir(dir.c_str());
+    emu_stop(first);
+    emu_stop(second);
+}
+
+TEST(fleet, watch_ports_no_serial)
+{
+    std::string img_filename = TEST_DIR "/../examples/bf-888s-factory.img";
+    std::string out_filename = get_test_name() + ".out";
+    std::string dir          = get_test_name() + "-dev";
+    std::string link         = dir + "/ttyW0";
+    std::string pattern      = dir + "/tty*";
+
+    mkdir(dir.c_str(), 0755);
+    unlink(link.c_str());
+    watch_jobs_filename = get_test_name() + ".jobs";
+    std::remove(watch_jobs_filename.c_str());
+    emulator_t *first  = emu_start(img_filename.c_str(), 0, 0, false);
+    emulator_t *second = emu_start(img_filename.c_str(), 0, 0, false);
+    emu_counters_t c0, c1;
+
+    pid_t pid = start_watch(pattern, out_filename);
+    ASSERT_GE(pid, 0);
+    watch_process watch = { pid };
+
+    // Radio without serial number: the port is not probed after the job.
+    attach_port(link, first);
+    ASSERT_EQ(wait_lines(watch_jobs_filename, 1).size(), 1u);
+    EXPECT_TRUE(wait_text(out_filename, "ttyW0: no serial number, remove the port"));
+    emu_get_counters(first, &c0);
+    sleep(3);
+    emu_get_counters(first, &c1);
+    EXPECT_EQ(c1.rx_bytes, c0.rx_bytes);
+
+    // Port removed and attached again: the radio is new.
+    unlink(link.c_str());
+    EXPECT_TRUE(wait_text(out_filename, "ttyW0: removed\n"));
+    attach_port(link, second);
+    EXPECT_EQ(wait_lines(watch_jobs_filename, 2).size(), 2u);
+
+    unlink(link.c_str());
+    rmdir(dir.c_str());
+    emu_stop(first);
+    emu_stop(second);
+}
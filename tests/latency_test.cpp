@@ -0,0 +1,93 @@
+#include <cstdio>
+#include <sstream>
+
+#include "util.h"
+#include "latency.h"
+#include "emulator.h"
+
+TEST(latency, merge)
+{
+    std::string filename = get_test_name() + ".hist";
+
+    std::remove(filename.c_str());
+
+    // First run.
+    latency_t *l = latency_open(filename.c_str());
+    latency_add(l, "usb-1a86:7523-1.2", "Baofeng UV-5R", LAT_READ_DATA, 100);
+    latency_add(l, "usb-1a86:7523-1.2", "Baofeng UV-5R", LAT_READ_DATA, 100);
+    latency_add(l, "usb-1a86:7523-1.2", "Baofeng UV-5R", LAT_WRITE_ACK, 20);
+    latency_close(l);
+    EXPECT_EQ(file_contents(filename), "usb-1a86:7523-1.2\tBaofeng UV-5R\tread-data\t100:2\n"
+                                       "usb-1a86:7523-1.2\tBaofeng UV-5R\twrite-ack\t20:1\n");
+
+    // Second run, maybe on another machine: counts are added.
+    l = latency_open(filename.c_str());
+    latency_add(l, "usb-1a86:7523-1.2", "Baofeng UV-5R", LAT_READ_DATA, 101);
+    latency_add(l, "ttyS0", "Baofeng UV-B5", LAT_PROBE, 40000);
+    latency_close(l);
+    EXPECT_EQ(file_contents(filename), "usb-1a86:7523-1.2\tBaofeng UV-5R\tread-data\t100:3\n"
+                                       "ttyS0\tBaofeng UV-B5\tprobe\t38912:1\n"
+                                       "usb-1a86:7523-1.2\tBaofeng UV-5R\twrite-ack\t20:1\n");
+
+    // No table: nothing collected.
+    latency_add(nullptr, "ttyS0", "Baofeng UV-B5", LAT_PROBE, 40000);
+}
+
+TEST(latency, two_sessions)
+{
+    std::string filename = get_test_name() + ".hist";
+
+    std::remove(filename.c_str());
+
+    // Sessions in one process have tables of their own.
+    latency_t *a = latency_open(filename.c_str());
+    latency_t *b = latency_open(filename.c_str());
+    latency_add(a, "ttyS0", "Baofeng UV-B5", LAT_PROBE, 40000);
+    latency_add(b, "ttyS1", "Baofeng UV-B5", LAT_PROBE, 40000);
+    latency_close(a);
+    EXPECT_EQ(file_contents(filename), "ttyS0\tBaofeng UV-B5\tprobe\t38912:1\n");
+    latency_close(b);
+    EXPECT_EQ(file_contents(filename), "ttyS1\tBaofeng UV-B5\tprobe\t38912:1\n"
+                                       "ttyS0\tBaofeng UV-B5\tprobe\t38912:1\n");
+}
+
+//
+// Count samples of the given kind in the histogram file.
+//
+static int samples_of(const std::string &filename, const std::string &kind)
+{
+    int total = 0;
+
+    for (auto &line : file_contents_split(filename)) {
+        auto pos = line.find("\t" + kind + "\t");
+        if (pos == std::string::npos)
+            continue;
+        std::istringstream buckets(line.substr(pos + kind.size() + 2));
+        std::string bucket;
+        while (buckets >> bucket)
+            total += std::stoi(bucket.substr(bucket.find(':') + 1));
+    }
+    return total;
+}
+
+TEST(latency, uv_5r_read_ack)
+{
+    std::string img_filename = TEST_DIR "/../examples/uv-5r-factory.img";
+    std::string filename     = get_test_name() + ".hist";
+    emulator_t *e            = emu_start(img_filename.c_str(), 0, 0, false);
+    radio_session_t *s       = radio_session_new();
+
+    std::remove(filename.c_str());
+
+    // Same as 'baoclone --histogram=file.hist port'.
+    radio_set_histogram(s, filename.c_str());
+    radio_connect(s, emu_port_name(e));
+    EXPECT_EQ(radio_download(s), 1);
+    radio_disconnect(s);
+    radio_session_free(s);
+    emu_stop(e);
+
+    // Acknowledge of every block, though picked up before the next reply.
+    EXPECT_EQ(samples_of(filename, "read-ack"), 0x1940 / 0x40);
+    EXPECT_EQ(samples_of(filename, "read-header"), 0x1940 / 0x40);
+}
@@ -0,0 +1,89 @@
+#include <cstdio>
+#include <cstring>
+
+#include "util.h"
+#include "radio.h"
+#include "emulator.h"
+#include "stats.h"
+
+TEST(stats, download)
+{
+    std::string img_filename  = TEST_DIR "/../examples/bf-888s-factory.img";
+    std::string json_filename = get_test_name() + ".json";
+    emulator_t *e             = emu_start(img_filename.c_str(), 0, 0, false);
+    radio_session_t *s        = radio_session_new();
+    emu_counters_t c;
+
+    radio_connect(s, emu_port_name(e));
+    radio_download(s);
+    radio_disconnect(s);
+    emu_get_counters(e, &c);
+
+    // BF-888S has 38 blocks of 8 bytes.
+    EXPECT_EQ(s->stats.blocks_read, 38u);
+    EXPECT_EQ(s->stats.blocks_written, 0u);
+    EXPECT_EQ(s->stats.bytes_written, c.rx_bytes);
+    EXPECT_EQ(s->stats.bytes_read, c.tx_bytes);
+    EXPECT_GT(s->stats.serial_reads, s->stats.blocks_read);
+    EXPECT_GT(s->stats.phase_usec[STATS_CONNECT], 0);
+    EXPECT_GT(s->stats.phase_usec[STATS_DOWNLOAD], 0);
+    EXPECT_EQ(s->stats.phase_usec[STATS_UPLOAD], 0);
+
+    // Same as 'baoclone --stats=json'.
+    FILE *out = fopen(json_filename.c_str(), "w");
+    ASSERT_NE(out, nullptr);
+    stats_print(out, &s->stats, 1);
+    fclose(out);
+    auto json = file_contents(json_filename);
+    EXPECT_NE(json.find("\"blocks_read\":38,"), std::string::npos);
+    EXPECT_NE(json.find("\"phase_sec\":{\"connect\":"), std::string::npos);
+
+    radio_session_free(s);
+    emu_stop(e);
+}
+
+TEST(stats, upload_one_write_per_block)
+{
+    std::string img_filename = TEST_DIR "/../examples/uv-5r-factory.img";
+    emulator_t *e            = emu_start(img_filename.c_str(), 0, 0, false);
+    radio_session_t *s       = radio_session_new();
+
+    radio_connect(s, emu_port_name(e));
+    radio_download(s);
+
+    // Header and data of every block go in one frame.
+    memset(&s->stats, 0, sizeof(s->stats));
+    s->backup_valid = 0;
+    radio_upload(s, 1);
+    radio_disconnect(s);
+
+    EXPECT_GT(s->stats.blocks_written, 0u);
+    EXPECT_EQ(s->stats.serial_writes, s->stats.blocks_written);
+
+    radio_session_free(s);
+    emu_stop(e);
+}
+
+TEST(stats, two_sessions)
+{
+    std::string img_filename = TEST_DIR "/../examples/bf-888s-factory.img";
+    emulator_t *e            = emu_start(img_filename.c_str(), 0, 0, false);
+    radio_session_t *a       = radio_session_new();
+    radio_session_t *b       = radio_session_new();
+
+    // Counters of one session are not shared with another.
+    radio_connect(a, emu_port_name(e));
+    radio_download(a);
+    radio_disconnect(a);
+    radio_connect(b, emu_port_name(e));
+    radio_disconnect(b);
+
+    EXPECT_EQ(a->stats.blocks_read, 38u);
+    EXPECT_EQ(b->stats.blocks_read, 0u);
+    EXPECT_GT(b->stats.serial_writes, 0u);
+    EXPECT_LT(b->stats.serial_writes, a->stats.serial_writes);
+
+    radio_session_free(a);
+    radio_session_free(b);
+    emu_stop(e);
+}
@@ -0,0 +1,71 @@
+#include <cstdio>
+
+#include "util.h"
+#include "radio.h"
+#include "timeline.h"
+
+TEST(timeline, emu_download)
+{
+    std::string img_filename  = TEST_DIR "/../examples/bf-888s-factory.img";
+    std::string port_name     = "emu:" + img_filename;
+    std::string json_filename = get_test_name() + ".json";
+    radio_session_t *s        = radio_session_new();
+
+    // Same as 'baoclone --timeline=file.json emu:file.img'.
+    timeline_t *t = timeline_open(json_filename.c_str());
+    radio_set_timeline(s, t);
+    radio_connect(s, port_name.c_str());
+    radio_download(s);
+    radio_disconnect(s);
+    timeline_close(t);
+    radio_session_free(s);
+
+    auto json = file_contents(json_filename);
+    EXPECT_EQ(json.front(), '[');
+    EXPECT_EQ(json.substr(json.size() - 4), "}\n]\n");
+    EXPECT_NE(json.find("\"name\":\"probe uvb5\""), std::string::npos);
+    EXPECT_NE(json.find("\"name\":\"read 0x0010\""), std::string::npos);
+    EXPECT_NE(json.find("\"name\":\"download\""), std::string::npos);
+    EXPECT_NE(json.find("\"cat\":\"serial\""), std::string::npos);
+}
+
+TEST(timeline, track_per_session)
+{
+    std::string img_filename  = TEST_DIR "/../examples/bf-888s-factory.img";
+    std::string port_name     = "emu:" + img_filename;
+    std::string json_filename = get_test_name() + ".json";
+    radio_session_t *a        = radio_session_new();
+    radio_session_t *b        = radio_session_new();
+
+    // Two sessions on one timeline.
+    timeline_t *t = timeline_open(json_filename.c_str());
+    radio_set_timeline(a, t);
+    radio_set_timeline(b, t);
+    radio_connect(a, port_name.c_str());
+    radio_connect(b, port_name.c_str());
+    radio_disconnect(a);
+    radio_disconnect(b);
+    timeline_close(t);
+    radio_session_free(a);
+    radio_session_free(b);
+
+    auto json = file_contents(json_filename);
+    EXPECT_NE(json.find("\"tid\":1,\"name\":\"thread_name\",\"args\":{\"name\":\"" + port_name),
+              std::string::npos);
+    EXPECT_NE(json.find("\"tid\":2,\"name\":\"thread_name\""), std::string::npos);
+    EXPECT_NE(json.find("\"tid\":1,\"cat\":\"session\""), std::string::npos);
+    EXPECT_NE(json.find("\"tid\":2,\"cat\":\"session\""), std::string::npos);
+}
+
+TEST(timeline, track_name_escaped)
+{
+    std::string json_filename = get_test_name() + ".json";
+
+    timeline_t *t = timeline_open(json_filename.c_str());
+    timeline_track(t, "C:\\port \"1\"\n");
+    timeline_close(t);
+
+    EXPECT_NE(file_contents(json_filename).find("{\"name\":\"C:\\\\port \\\"1\\\"\\n\"}}"),
+              std::string::npos)
+        << file_contents(json_filename);
+}
@@ -0,0 +1,178 @@
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <sys/select.h>
+#include <sys/socket.h>
+#include <termios.h>
+#include <unistd.h>
+
+#include "util.h"
+#include "radio.h"
+#include "emulator.h"
+
+TEST(transport, emu_download)
+{
+    std::string img_filename = TEST_DIR "/../examples/bf-888s-factory.img";
+    std::string port_name    = "emu:" + img_filename;
+    radio_session_t *s       = radio_session_new();
+    radio_session_t *img     = radio_session_new();
+
+    // Same as 'baoclone emu:file.img'.
+    radio_connect(s, port_name.c_str());
+    radio_download(s);
+    radio_disconnect(s);
+
+    radio_read_image(img, img_filename.c_str());
+    EXPECT_STREQ(radio_name(s), "Baofeng BF-888S");
+    EXPECT_EQ(config_of(s, ""), config_of(img, "-expect"));
+
+    radio_session_free(img);
+    radio_session_free(s);
+}
+
+//
+// Cable server like ser2net: relay one TCP connection to the emulated radio.
+//
+struct relay {
+    int listen_fd; // Listening socket
+    int tty_fd;    // Pseudo-terminal of the emulator
+};
+
+static void *relay_thread(void *arg)
+{
+    auto r = (relay *)arg;
+    int conn = accept(r->listen_fd, nullptr, nullptr);
+    unsigned char buf[256];
+
+    if (conn < 0)
+        return nullptr;
+    for (;;) {
+        fd_set rset;
+        FD_ZERO(&rset);
+        FD_SET(conn, &rset);
+        FD_SET(r->tty_fd, &rset);
+        if (select(std::max(conn, r->tty_fd) + 1, &rset, nullptr, nullptr, nullptr) < 0)
+            break;
+        if (FD_ISSET(conn, &rset)) {
+            int n = read(conn, buf, sizeof(buf));
+            if (n <= 0 || write(r->tty_fd, buf, n) != n)
+                break;
+        }
+        if (FD_ISSET(r->tty_fd, &rset)) {
+            int n = read(r->tty_fd, buf, sizeof(buf));
+            if (n <= 0 || write(conn, buf, n) != n)
+                break;
+        }
+    }
+    close(conn);
+    return nullptr;
+}
+
+TEST(transport, tcp_download)
+{
+    std::string img_filename = TEST_DIR "/../examples/uv-b5-factory.img";
+    emulator_t *e            = emu_start(img_filename.c_str(), 0, 0, false);
+    radio_session_t *s       = radio_session_new();
+    relay r;
+
+    // Raw mode on the pseudo-terminal of the emulator.
+    r.tty_fd = open(emu_port_name(e), O_RDWR | O_NOCTTY);
+    ASSERT_GE(r.tty_fd, 0);
+    struct termios tio;
+    tcgetattr(r.tty_fd, &tio);
+    cfmakeraw(&tio);
+    tcsetattr(r.tty_fd, TCSANOW, &tio);
+
+    // Listen on any free port of localhost.
+    struct sockaddr_in addr = {};
+    socklen_t addrlen       = sizeof(addr);
+    addr.sin_family         = AF_INET;
+    addr.sin_addr.s_addr    = htonl(INADDR_LOOPBACK);
+    r.listen_fd             = socket(AF_INET, SOCK_STREAM, 0);
+    ASSERT_GE(r.listen_fd, 0);
+    ASSERT_EQ(bind(r.listen_fd, (struct sockaddr *)&addr, sizeof(addr)), 0);
+    ASSERT_EQ(listen(r.listen_fd, 1), 0);
+    getsockname(r.listen_fd, (struct sockaddr *)&addr, &addrlen);
+
+    pthread_t tid;
+    pthread_create(&tid, nullptr, relay_thread, &r);
+
+    // Same as 'baoclone tcp:127.0.0.1:port'.
+    std::string port_name = "tcp:127.0.0.1:" + std::to_string(ntohs(addr.sin_port));
+    radio_connect(s, port_name.c_str());
+    radio_download(s);
+    radio_disconnect(s);
+
+    EXPECT_STREQ(radio_name(s), radio_name(emu_radio(e)));
+    EXPECT_EQ(config_of(s, ""), config_of(emu_radio(e), "-expect"));
+
+    radio_session_free(s);
+    pthread_join(tid, nullptr);
+    close(r.listen_fd);
+    close(r.tty_fd);
+    emu_stop(e);
+}
+
+TEST(transport, capture_replay)
+{
+    std::string img_filename = TEST_DIR "/../examples/uv-5r-factory.img";
+    std::string cap_filename = get_test_name() + ".cap";
+    std::string port_name    = "replay:" + cap_filename;
+    emulator_t *e            = emu_start(img_filename.c_str(), 0, 0, false);
+    radio_session_t *s       = radio_session_new();
+
+    // Same as 'baoclone --capture=file.cap port'.
+    radio_set_capture(s, cap_filename.c_str());
+    radio_connect(s, emu_port_name(e));
+    radio_download(s);
+    radio_disconnect(s);
+    radio_session_free(s);
+    EXPECT_EQ(file_contents(cap_filename).substr(0, 8), "BAOCAP1\n");
+
+    // Same as 'baoclone replay:file.cap'.
+    s = radio_session_new();
+    radio_connect(s, port_name.c_str());
+    radio_download(s);
+    radio_disconnect(s);
+
+    EXPECT_STREQ(radio_name(s), radio_name(emu_radio(e)));
+    EXPECT_EQ(config_of(s, ""), config_of(emu_radio(e), "-expect"));
+
+    radio_session_free(s);
+    emu_stop(e);
+}
+
+//
+// Upload of other contents than captured: replay must fail,
+// though the radio would acknowledge any data.
+//
+TEST(transport, capture_replay_mismatch)
+{
+    std::string img_filename = TEST_DIR "/../examples/uv-5r-factory.img";
+    std::string cap_filename = get_test_name() + ".cap";
+    std::string port_name    = "replay:" + cap_filename;
+    emulator_t *e            = emu_start(img_filename.c_str(), 0, 0, false);
+    radio_session_t *s       = radio_session_new();
+
+    radio_set_capture(s, cap_filename.c_str());
+    radio_connect(s, emu_port_name(e));
+    EXPECT_EQ(radio_download(s), 1);
+    s->backup_valid = 0;
+    EXPECT_EQ(radio_upload(s, 1), 1);
+    radio_disconnect(s);
+    radio_session_free(s);
+
+    // Same session, one byte changed before upload.
+    s = radio_session_new();
+    radio_connect(s, port_name.c_str());
+    EXPECT_EQ(radio_download(s), 1);
+    s->backup_valid = 0;
+    s->mem[0x1000] ^= 1;
+    EXPECT_EQ(radio_upload(s, 1), 0);
+    radio_disconnect(s);
+
+    radio_session_free(s);
+    emu_stop(e);
+}
@@ -23,6 +23,8 @@
 //
 #include "util.h"
 
+#include <cstdio>
+#include <cstdlib>
 #include <fstream>
 
 //
@@ -82,3 +84,42 @@ bool starts_with(const std::string &str, const char *prefix)
     auto prefix_size = strlen(prefix);
     return str.size() >= prefix_size && memcmp(str.c_str(), prefix, prefix_size) == 0;
 }
+
+//
+// Print configuration of the radio to file, and return it as a string.
+//
+std::string config_of(radio_session_t *s, const std::string &suffix)
+{
+    std::string output_filename = get_test_name() + suffix + ".conf";
+
+    FILE *output = fopen(output_filename.c_str(), "w");
+    EXPECT_NE(output, nullptr);
+
+    radio_print_config(s, output, false);
+    fclose(output);
+    return file_contents(output_filename);
+}
+
+//
+// Set XDG_CACHE_HOME, remember the previous value.
+//
+scoped_cache_home::scoped_cache_home(const std::string &dir)
+{
+    const char *value = getenv("XDG_CACHE_HOME");
+
+    was_set = (value != nullptr);
+    if (was_set)
+        old_value = value;
+    setenv("XDG_CACHE_HOME", dir.c_str(), 1);
+}
+
+//
+// Restore XDG_CACHE_HOME.
+//
+scoped_cache_home::~scoped_cache_home()
+{
+    if (was_set)
+        setenv("XDG_CACHE_HOME", old_value.c_str(), 1);
+    else
+        unsetenv("XDG_CACHE_HOME");
+}
@@ -27,6 +27,8 @@
 #include <gtest/gtest.h>
 #include <string>
 
+#include "radio.h"
+
 //
 // Get current test name, as specified in TEST() macro.
 //
@@ -52,4 +54,24 @@ void create_file(const std::string &filename, const std::string &contents);
 //
 bool starts_with(const std::string &str, const char *prefix);
 
+//
+// Print configuration of the radio to file named after the test
+// and suffix, and return it as a string.
+//
+std::string config_of(radio_session_t *s, const std::string &suffix);
+
+//
+// Set XDG_CACHE_HOME to the given directory while in scope,
+// and restore the previous value on exit.
+//
+class scoped_cache_home {
+public:
+    explicit scoped_cache_home(const std::string &dir);
+    ~scoped_cache_home();
+
+private:
+    bool was_set;
+    std::string old_value;
+};
+
 #endif // DUBNA_TESTS_UTIL_H
@@ -0,0 +1,189 @@
+/*
+ * Timeline of the clone session, in Chrome trace format.
+ *
+ * Copyright (C) 2013-2023 Serge Vakulenko, KK6ABQ
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   1. Redistributions of source code must retain the above copyright notice,
+ *      this list of conditions and the following disclaimer.
+ *   2. Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in the
+ *      documentation and/or other materials provided with the distribution.
+ *   3. The name of the author may not be used to endorse or promote products
+ *      derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO
+ * EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#include "timeline.h"
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/time.h>
+
+//
+// Timeline file.
+//
+struct timeline {
+    FILE *out;            // Output file
+    long long start_time; // Time of the start, usec
+    int nevents;          // Number of events written
+    int ntracks;          // Number of tracks added
+    timeline_t *next;     // Next open timeline
+};
+
+static timeline_t *open_list; // Timelines to close at exit
+
+//
+// Get time in microseconds.
+//
+static long long time_usec()
+{
+    struct timeval t;
+
+    gettimeofday(&t, NULL);
+    return t.tv_sec * 1000000LL + t.tv_usec;
+}
+
+//
+// Close all timelines at exit.
+//
+static void close_all()
+{
+    while (open_list)
+        timeline_close(open_list);
+}
+
+//
+// Finish the array of events and close the file.
+//
+void timeline_close(timeline_t *t)
+{
+    timeline_t **p;
+
+    for (p = &open_list; *p; p = &(*p)->next) {
+        if (*p == t) {
+            *p = t->next;
+            break;
+        }
+    }
+    fprintf(t->out, "\n]\n");
+    fclose(t->out);
+    free(t);
+}
+
+//
+// Start writing the timeline to file.
+//
+timeline_t *timeline_open(const char *filename)
+{
+    static int registered;
+    timeline_t *t = calloc(1, sizeof(timeline_t));
+
+    if (!t) {
+        fprintf(stderr, "Out of memory.\n");
+        exit(-1);
+    }
+    t->out = fopen(filename, "w");
+    if (!t->out) {
+        perror(filename);
+        exit(-1);
+    }
+    fprintf(t->out, "[");
+    t->start_time = time_usec();
+    t->next       = open_list;
+    open_list     = t;
+    if (!registered) {
+        atexit(close_all);
+        registered = 1;
+    }
+    return t;
+}
+
+//
+// Start a new event: separator and common fields.
+//
+static void event_start(timeline_t *t, const char *ph, int tid)
+{
+    fprintf(t->out, "%s\n{\"ph\":\"%s\",\"pid\":1,\"tid\":%d,", t->nevents++ ? "," : "", ph,
+            tid);
+}
+
+//
+// Write string in quotes, escaped for JSON.
+//
+static void put_string(FILE *out, const char *str)
+{
+    fputc('"', out);
+    for (; *str; str++) {
+        unsigned char c = *str;
+
+        if (c == '"' || c == '\\') {
+            fputc('\\', out);
+            fputc(c, out);
+        } else if (c == '\n') {
+            fputs("\\n", out);
+        } else if (c == '\t') {
+            fputs("\\t", out);
+        } else if (c < ' ') {
+            fprintf(out, "\\u%04x", c);
+        } else {
+            fputc(c, out);
+        }
+    }
+    fputc('"', out);
+}
+
+//
+// Add a track: a thread in terms of the trace format, with a name.
+//
+int timeline_track(timeline_t *t, const char *name)
+{
+    int tid = ++t->ntracks;
+
+    event_start(t, "M", tid);
+    fprintf(t->out, "\"name\":\"thread_name\",\"args\":{\"name\":");
+    put_string(t->out, name);
+    fprintf(t->out, "}}");
+    return tid;
+}
+
+//
+// Get current time for the start of a span.
+//
+long long timeline_now(timeline_t *t)
+{
+    return t ? time_usec() : 0;
+}
+
+//
+// Add a complete event from start time till now.
+//
+void timeline_span(timeline_t *t, int tid, const char *cat, long long start, const char *fmt, ...)
+{
+    va_list ap;
+    long long end;
+
+    if (!t)
+        return;
+
+    end = time_usec();
+    event_start(t, "X", tid);
+    fprintf(t->out, "\"cat\":\"%s\",\"ts\":%lld,\"dur\":%lld,\"name\":\"", cat,
+            start - t->start_time, end - start);
+    va_start(ap, fmt);
+    vfprintf(t->out, fmt, ap);
+    va_end(ap);
+    fprintf(t->out, "\"}");
+}
@@ -0,0 +1,74 @@
+/*
+ * Timeline of the clone session, in Chrome trace format.
+ *
+ * Copyright (C) 2013-2023 Serge Vakulenko, KK6ABQ
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   1. Redistributions of source code must retain the above copyright notice,
+ *      this list of conditions and the following disclaimer.
+ *   2. Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in the
+ *      documentation and/or other materials provided with the distribution.
+ *   3. The name of the author may not be used to endorse or promote products
+ *      derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO
+ * EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifndef TIMELINE_H
+#define TIMELINE_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+//
+// Timeline file: many sessions can write to it, each on its own track.
+//
+typedef struct timeline timeline_t;
+
+//
+// Start writing the timeline to file, in Chrome trace event format,
+// for Perfetto or chrome://tracing.  The file is closed at exit.
+//
+timeline_t *timeline_open(const char *filename);
+
+//
+// Finish the timeline and close the file.
+//
+void timeline_close(timeline_t *t);
+
+//
+// Add a track for a session, named like the port.
+// Return the track id, for timeline_span().
+//
+int timeline_track(timeline_t *t, const char *name);
+
+//
+// Get current time for the start of a span, in microseconds.
+// Return 0 when the timeline is NULL.
+//
+long long timeline_now(timeline_t *t);
+
+//
+// Add a span of given category from start time till now, on the track.
+// Name is a printf-style format.  Nothing is done when the timeline is NULL.
+//
+void timeline_span(timeline_t *t, int tid, const char *cat, long long start, const char *fmt,
+                   ...);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // TIMELINE_H
@@ -0,0 +1,348 @@
+/*
+ * Transports for the serial protocol: TCP, emulator and replay.
+ *
+ * Copyright (C) 2013-2023 Serge Vakulenko, KK6ABQ
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   1. Redistributions of source code must retain the above copyright notice,
+ *      this list of conditions and the following disclaimer.
+ *   2. Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in the
+ *      documentation and/or other materials provided with the distribution.
+ *   3. The name of the author may not be used to endorse or promote products
+ *      derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO
+ * EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#include "transport.h"
+
+#include <errno.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/select.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "emulator.h"
+
+//
+// Wait for data on the file descriptor, and read what is available.
+// Return 0 on timeout.
+//
+int transport_fd_recv(serial_port_t *port, unsigned char *data, int len, int timeout_usec)
+{
+    fd_set rset;
+    struct timeval timo;
+    int nbytes;
+
+    FD_ZERO(&rset);
+    FD_SET(port->fd, &rset);
+    timo.tv_sec  = timeout_usec / 1000000;
+    timo.tv_usec = timeout_usec % 1000000;
+
+    // Wait for input to become ready or until the time out.
+    if (select(port->fd + 1, &rset, NULL, NULL, &timo) != 1)
+        return 0;
+
+    nbytes = read(port->fd, data, len);
+    return (nbytes > 0) ? nbytes : 0;
+}
+
+//
+// Send data to the file descriptor.
+//
+void transport_fd_send(serial_port_t *port, const void *data, int len)
+{
+    if (write(port->fd, data, len) != len) {
+        perror("Serial port");
+        exit(-1);
+    }
+}
+
+//
+// TCP stream, like a ser2net server: "tcp:host:port".
+//
+static void tcp_open(serial_port_t *port, const char *name)
+{
+    struct addrinfo hints, *list, *ai;
+    char host[256], *service;
+    int one = 1;
+
+    snprintf(host, sizeof(host), "%s", name + 4);
+    service = strrchr(host, ':');
+    if (!service) {
+        fprintf(stderr, "%s: Port number expected, like tcp:host:4000\n", name);
+        exit(-1);
+    }
+    *service++ = 0;
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family   = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo(host, service, &hints, &list) != 0) {
+        fprintf(stderr, "%s: Unknown host\n", name);
+        exit(-1);
+    }
+    port->fd = -1;
+    for (ai = list; ai; ai = ai->ai_next) {
+        port->fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+        if (port->fd < 0)
+            continue;
+        if (connect(port->fd, ai->ai_addr, ai->ai_addrlen) == 0)
+            break;
+        close(port->fd);
+        port->fd = -1;
+    }
+    freeaddrinfo(list);
+    if (port->fd < 0) {
+        perror(name);
+        exit(-1);
+    }
+
+    // Commands are short: send them at once.
+    setsockopt(port->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+}
+
+static void tcp_close(serial_port_t *port)
+{
+    close(port->fd);
+}
+
+static void tcp_flush(serial_port_t *port)
+{
+    unsigned char buf[256];
+
+    while (recv(port->fd, buf, sizeof(buf), MSG_DONTWAIT) > 0)
+        continue;
+}
+
+static const serial_transport_t tcp_transport = {
+    "tcp:", tcp_open, tcp_close, tcp_flush, transport_fd_recv, transport_fd_send,
+};
+
+//
+// Emulated radio on a pseudo-terminal, with memory from image file: "emu:file.img".
+// Line speed is 9600 baud.
+//
+static void emu_open(serial_port_t *port, const char *name)
+{
+    emulator_t *e = emu_start(name + 4, 10000000 / 9600, 0, 0);
+
+    tty_transport.open(port, emu_port_name(e));
+    port->priv = e;
+}
+
+static void emu_close(serial_port_t *port)
+{
+    tty_transport.close(port);
+    emu_stop(port->priv);
+}
+
+static void emu_flush(serial_port_t *port)
+{
+    tty_transport.flush(port);
+}
+
+static const serial_transport_t emu_transport = {
+    "emu:", emu_open, emu_close, emu_flush, transport_fd_recv, transport_fd_send,
+};
+
+//
+// Replay of a captured session: "replay:file".
+// Data sent by the program are checked against the capture,
+// and received data are taken from the capture.
+// Replies come with the same delays as in the capture.
+//
+typedef struct {
+    unsigned char *buf;  // Contents of capture file
+    long size;           // Size of capture file
+    long rec;            // Offset of the current record
+    int pos;             // Position inside the current record
+    int mismatch;        // Sent data differ from the capture
+    unsigned last_stamp; // Capture time of the last record passed
+    long long last_time; // Our time when it was passed, usec
+} replay_t;
+
+//
+// Get capture time of the current record.
+//
+static unsigned replay_stamp(replay_t *r)
+{
+    const unsigned char *p = r->buf + r->rec;
+
+    return p[0] | p[1] << 8 | p[2] << 16 | (unsigned)p[3] << 24;
+}
+
+//
+// Mark the current record as passed at this moment.
+//
+static void replay_passed(replay_t *r)
+{
+    r->last_stamp = replay_stamp(r);
+    r->last_time  = now_usec();
+}
+
+//
+// Get type and size of the current record.
+// Return 0 at end of capture.
+//
+static int replay_record(replay_t *r, int *dir, int *len)
+{
+    const unsigned char *p = r->buf + r->rec;
+
+    for (;;) {
+        if (r->rec + 7 > r->size)
+            return 0;
+        *dir = p[4];
+        *len = p[5] | p[6] << 8;
+        if (r->rec + 7 + *len > r->size)
+            return 0;
+        if (r->pos < *len)
+            return 1;
+
+        // Go to the next record.
+        r->rec += 7 + *len;
+        r->pos = 0;
+        p      = r->buf + r->rec;
+    }
+}
+
+static void replay_open(serial_port_t *port, const char *name)
+{
+    const char *filename = name + 7;
+    replay_t *r          = calloc(1, sizeof(replay_t));
+    FILE *fd             = fopen(filename, "rb");
+
+    if (!r) {
+        fprintf(stderr, "Out of memory.\n");
+        exit(-1);
+    }
+    if (!fd) {
+        perror(filename);
+        exit(-1);
+    }
+    fseek(fd, 0, SEEK_END);
+    r->size = ftell(fd);
+    rewind(fd);
+    r->buf = malloc(r->size > 0 ? r->size : 1);
+    if (!r->buf || fread(r->buf, 1, r->size, fd) != (size_t)r->size ||
+        r->size < (long)strlen(CAPTURE_MAGIC) ||
+        memcmp(r->buf, CAPTURE_MAGIC, strlen(CAPTURE_MAGIC)) != 0) {
+        fprintf(stderr, "%s: Bad capture file\n", filename);
+        exit(-1);
+    }
+    fclose(fd);
+    r->rec       = strlen(CAPTURE_MAGIC);
+    r->last_time = now_usec();
+    port->fd     = -1;
+    port->priv   = r;
+}
+
+static void replay_close(serial_port_t *port)
+{
+    replay_t *r = port->priv;
+
+    if (r->mismatch)
+        fprintf(stderr, "Replay: sent data differ from the capture.\n");
+    free(r->buf);
+    free(r);
+}
+
+//
+// Received data come only when the capture has them next.
+// Otherwise the radio did not reply: timeout.
+// After the sent data diverged, the capture no longer applies:
+// the radio is silent, so the transfer fails.
+//
+static int replay_recv(serial_port_t *port, unsigned char *data, int len, int timeout_usec)
+{
+    replay_t *r = port->priv;
+    int dir, reclen, n;
+
+    if (r->mismatch || !replay_record(r, &dir, &reclen) || dir != CAPTURE_RX)
+        return 0;
+
+    if (r->pos == 0) {
+        // Keep the delay of the reply, but not beyond the timeout.
+        long long delay = (int)(replay_stamp(r) - r->last_stamp) - (now_usec() - r->last_time);
+
+        if (delay > timeout_usec)
+            delay = timeout_usec;
+        if (delay > 0)
+            usleep(delay);
+        replay_passed(r);
+    }
+    n = reclen - r->pos;
+    if (n > len)
+        n = len;
+    memcpy(data, r->buf + r->rec + 7 + r->pos, n);
+    r->pos += n;
+    return n;
+}
+
+//
+// Sent data must match the capture.
+// Replies which the program did not read are skipped.
+//
+static void replay_send(serial_port_t *port, const void *data, int len)
+{
+    replay_t *r            = port->priv;
+    const unsigned char *p = data;
+    int dir, reclen;
+
+    while (len > 0 && replay_record(r, &dir, &reclen)) {
+        if (dir != CAPTURE_TX) {
+            r->pos = reclen;
+            continue;
+        }
+        if (r->pos == 0)
+            replay_passed(r);
+        if (r->buf[r->rec + 7 + r->pos] != *p) {
+            if (!r->mismatch && trace_flag)
+                printf("# Replay: sent %02x, captured %02x\n", *p, r->buf[r->rec + 7 + r->pos]);
+            r->mismatch = 1;
+        }
+        r->pos++;
+        p++;
+        len--;
+    }
+}
+
+static const serial_transport_t replay_transport = {
+    "replay:", replay_open, replay_close, NULL, replay_recv, replay_send,
+};
+
+//
+// Find the backend for the port name.
+//
+const serial_transport_t *transport_find(const char *name)
+{
+    static const serial_transport_t *const list[] = {
+        &tcp_transport,
+        &emu_transport,
+        &replay_transport,
+    };
+    unsigned i;
+
+    for (i = 0; i < sizeof(list) / sizeof(list[0]); i++) {
+        if (strncmp(name, list[i]->prefix, strlen(list[i]->prefix)) == 0)
+            return list[i];
+    }
+    return &tty_transport;
+}
@@ -0,0 +1,125 @@
+/*
+ * Transports for the serial protocol: tty, TCP, emulator and replay.
+ *
+ * Copyright (C) 2013-2023 Serge Vakulenko, KK6ABQ
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   1. Redistributions of source code must retain the above copyright notice,
+ *      this list of conditions and the following disclaimer.
+ *   2. Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in the
+ *      documentation and/or other materials provided with the distribution.
+ *   3. The name of the author may not be used to endorse or promote products
+ *      derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO
+ * EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifndef TRANSPORT_H
+#define TRANSPORT_H
+
+#include <stdio.h>
+#include <termios.h>
+
+#include "util.h"
+
+//
+// Backend of the serial port.
+// Name of the port selects the backend by prefix, like "tcp:host:port".
+//
+typedef struct {
+    const char *prefix; // Prefix of port name, or NULL for a tty device
+
+    // Open the port, halt the program on error.
+    void (*open)(serial_port_t *port, const char *name);
+
+    // Close the port.
+    void (*close)(serial_port_t *port);
+
+    // Purge all received data.
+    void (*flush)(serial_port_t *port);
+
+    // Wait up to timeout_usec for data, and read what is available,
+    // up to len bytes.  Return 0 on timeout.
+    int (*recv)(serial_port_t *port, unsigned char *data, int len, int timeout_usec);
+
+    // Send data, halt the program on error.
+    void (*send)(serial_port_t *port, const void *data, int len);
+} serial_transport_t;
+
+//
+// Latency of the radio for one kind of reply.
+//
+typedef struct {
+    int rtt_usec;    // Smoothed latency of reply, or 0 when not measured yet
+    int rttvar_usec; // Mean deviation of reply latency
+    int backoff;     // Timeouts in a row: the timeout is doubled for each
+} serial_rtt_t;
+
+//
+// Serial port: backend, file descriptor and timing of the radio.
+//
+struct serial_port {
+    const serial_transport_t *transport; // Backend
+    int fd;                              // Tty, pseudo-terminal or socket
+    void *priv;                          // Data of the backend
+    struct termios oldtio;               // Mode of tty
+    long long write_time;                // Time of the last write, usec
+    int tx_pending;                      // Bytes written since the last read
+    serial_rtt_t rtt[SERIAL_NKINDS];     // Latency of replies and of write acknowledges
+    int byte_usec;                       // Smoothed time of one byte on the wire
+    stats_t *stats;                      // Counters of the session
+    timeline_t *timeline;                // Timeline of the session, or NULL
+    int timeline_tid;                    // Track of the session on the timeline
+    FILE *capture;                       // Capture of the protocol, or NULL
+    long long capture_start;             // Time of the capture start, usec
+    int low_latency;                     // Flag ASYNC_LOW_LATENCY was set by us
+    int saved_serial_flags;              // Flags of serial driver before that
+    int saved_latency_timer;             // Latency timer before, msec, or 0 when unchanged
+    char latency_timer[128];             // Sysfs file of the latency timer
+};
+
+//
+// Find the backend for the port name.
+//
+const serial_transport_t *transport_find(const char *name);
+
+//
+// Backend for tty devices, in util.c.
+//
+extern const serial_transport_t tty_transport;
+
+//
+// Get monotonic time in microseconds, in util.c.
+//
+long long now_usec(void);
+
+//
+// Receive and send for backends with a file descriptor.
+//
+int transport_fd_recv(serial_port_t *port, unsigned char *data, int len, int timeout_usec);
+void transport_fd_send(serial_port_t *port, const void *data, int len);
+
+//
+// Capture of the serial protocol, for replay.
+// File starts with CAPTURE_MAGIC, followed by records:
+//      4 bytes - time in microseconds from the start, little endian, wraps in 71 minutes
+//      1 byte  - direction: CAPTURE_TX to the radio, CAPTURE_RX from the radio
+//      2 bytes - length of data, little endian
+//      data
+//
+#define CAPTURE_MAGIC "BAOCAP1\n"
+#define CAPTURE_TX    'T'
+#define CAPTURE_RX    'R'
+
+#endif // TRANSPORT_H
@@ -26,6 +26,7 @@
  * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
  */
 #include <fcntl.h>
+#include <limits.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
@@ -35,13 +36,143 @@
 #else
 #include <sys/stat.h>
 #include <termios.h>
+#include <time.h>
 #endif
+#ifdef __linux__
+#include <linux/serial.h>
+#include <sys/ioctl.h>
+#endif
+#include "probes.h"
+#include "stats.h"
+#include "timeline.h"
 #include "util.h"
 
 #ifdef MINGW32
-static DCB saved_mode; // Mode of serial port, Windows
+//
+// Serial port: handle and saved mode of the device.
+//
+struct serial_port {
+    HANDLE fd;      // Handle of serial port, Windows
+    DCB saved_mode; // Mode of serial port, Windows
+    stats_t *stats; // Counters of the session
+};
 #else
-static struct termios oldtio, newtio; // Mode of serial port, Unix
+#include "transport.h"
+#endif
+
+#ifndef MINGW32
+//
+// Limits of read timeouts, in microseconds.
+// Until the radio replies for the first time, wait as long as before.
+// Then the timeout follows the observed latency, but not below the floor:
+// USB adapters deliver data in chunks, every 16 msec by default.
+//
+#define TIMEOUT_MAX_USEC   200000
+#define TIMEOUT_FLOOR_USEC 30000
+
+//
+// Time of one byte at 9600 baud, 8N1.
+//
+#define BYTE_USEC_9600 1042
+
+//
+// Get time in microseconds.
+//
+long long now_usec()
+{
+    struct timespec t;
+
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec * 1000000LL + t.tv_nsec / 1000;
+}
+
+//
+// Latency of the radio, with a margin: as for TCP retransmission,
+// mean plus four deviations, but at least half of the mean,
+// as the radio can be very regular until it is not.
+// After every timeout in a row the timeout is doubled,
+// as the radio may be slower than it was.
+//
+static int latency_timeout(serial_rtt_t *r)
+{
+    int margin = 4 * r->rttvar_usec;
+    int timo;
+
+    if (margin < r->rtt_usec / 2)
+        margin = r->rtt_usec / 2;
+    timo = r->rtt_usec + margin;
+
+    if (timo < TIMEOUT_FLOOR_USEC)
+        timo = TIMEOUT_FLOOR_USEC;
+    if (r->backoff > 0)
+        timo <<= (r->backoff < 4) ? r->backoff : 4;
+    if (timo > TIMEOUT_MAX_USEC)
+        timo = TIMEOUT_MAX_USEC;
+    return timo;
+}
+
+//
+// Timeout for the first byte of a reply to the command just sent:
+// time to transmit the command, plus latency of the radio.
+//
+static int reply_timeout(serial_port_t *port, serial_rtt_t *r)
+{
+    if (r->rtt_usec == 0)
+        return TIMEOUT_MAX_USEC + port->tx_pending * port->byte_usec;
+
+    return latency_timeout(r) + port->tx_pending * port->byte_usec;
+}
+
+//
+// Timeout between chunks of data in one reply.
+// Reply may come after acknowledge of the previous command,
+// with its own latency, so allow twice as much.
+//
+static int gap_timeout(serial_rtt_t *r)
+{
+    if (r->rtt_usec == 0)
+        return TIMEOUT_MAX_USEC;
+
+    return 2 * latency_timeout(r);
+}
+
+//
+// Update estimates of latency and byte time after a successful read.
+// First_time is when the first chunk came, first_len is the size of it,
+// end_time is when the last chunk came.
+//
+static void update_timing(serial_port_t *port, serial_rtt_t *r, long long first_time,
+                          int first_len, long long end_time, int len)
+{
+    r->backoff = 0;
+    if (port->tx_pending > 0) {
+        // Latency of the radio: reply time without transmission of the command.
+        int rtt = first_time - port->write_time - port->tx_pending * port->byte_usec;
+
+        if (rtt < 0)
+            rtt = 0;
+        if (r->rtt_usec == 0) {
+            r->rtt_usec    = rtt > 0 ? rtt : 1;
+            r->rttvar_usec = rtt / 2;
+        } else {
+            int delta = rtt - r->rtt_usec;
+
+            r->rttvar_usec += ((delta < 0 ? -delta : delta) - r->rttvar_usec) / 4;
+            r->rtt_usec += delta / 8;
+            if (r->rtt_usec <= 0)
+                r->rtt_usec = 1;
+        }
+        port->tx_pending = 0;
+    }
+    if (len - first_len >= 4 && end_time > first_time) {
+        // Bytes after the first chunk came at the speed of the wire.
+        int byte_usec = (end_time - first_time) / (len - first_len);
+
+        port->byte_usec += (byte_usec - port->byte_usec) / 8;
+        if (port->byte_usec < 1)
+            port->byte_usec = 1;
+    }
+}
 #endif
 
 //
@@ -71,6 +202,11 @@ const int DCS_CODES[NDCS] = {
 //
 bool trace_flag;
 
+//
+// Request low latency mode of USB serial adapter.
+//
+bool low_latency_flag;
+
 //
 // Check for a regular file.
 //
@@ -82,6 +218,10 @@ int is_file(const char *filename)
 #else
     struct stat st;
 
+    // Names like tcp:host:port or emu:file.img are ports.
+    if (transport_find(filename) != &tty_transport)
+        return 0;
+
     if (stat(filename, &st) < 0) {
         // File not exist: treat it as a regular file.
         return 1;
@@ -95,18 +235,212 @@ int is_file(const char *filename)
 //
 void print_hex(const unsigned char *data, int len)
 {
+    static const char digits[] = "0123456789abcdef";
+    char buf[3 * 64 + 1], *p = buf;
     int i;
 
-    printf("%02x", (unsigned char)data[0]);
-    for (i = 1; i < len; i++)
-        printf("-%02x", (unsigned char)data[i]);
+    // Format a line at a time, not a byte per printf.
+    for (i = 0; i < len; i++) {
+        if (p > buf + sizeof(buf) - 4) {
+            fwrite(buf, 1, p - buf, stdout);
+            p = buf;
+        }
+        if (i > 0)
+            *p++ = '-';
+        *p++ = digits[data[i] >> 4];
+        *p++ = digits[data[i] & 15];
+    }
+    fwrite(buf, 1, p - buf, stdout);
 }
 
+#ifndef MINGW32
+//
+// Read a line from a small file in sysfs.
+// Return 0 when no such file.
+//
+static int read_sysfs(const char *dir, const char *name, char *buf, int size)
+{
+    char filename[PATH_MAX];
+    FILE *fd;
+    int ok;
+
+    snprintf(filename, sizeof(filename), "%s/%s", dir, name);
+    fd = fopen(filename, "r");
+    if (!fd)
+        return 0;
+    ok = (fgets(buf, size, fd) != NULL);
+    fclose(fd);
+    if (ok)
+        buf[strcspn(buf, "\r\n")] = 0;
+    return ok && buf[0] != 0;
+}
+
+#ifdef __linux__
+//
+// Request low latency from the USB serial driver: FTDI adapters hold
+// short replies in the buffer for 16 msec by default.  Set flag
+// ASYNC_LOW_LATENCY, and the latency timer in sysfs when present.
+// Previous settings are restored on close.
+//
+static void tty_set_low_latency(serial_port_t *port, const char *name)
+{
+    struct serial_struct ss;
+    char real[PATH_MAX], dir[PATH_MAX], value[16];
+    const char *base;
+    FILE *fd;
+
+    if (ioctl(port->fd, TIOCGSERIAL, &ss) == 0 && !(ss.flags & ASYNC_LOW_LATENCY)) {
+        port->saved_serial_flags = ss.flags;
+        ss.flags |= ASYNC_LOW_LATENCY;
+        if (ioctl(port->fd, TIOCSSERIAL, &ss) == 0)
+            port->low_latency = 1;
+    }
+
+    // FTDI driver has the latency timer in sysfs, writable by root.
+    if (realpath(name, real)) {
+        base = strrchr(real, '/');
+        base = base ? base + 1 : real;
+        if (snprintf(dir, sizeof(dir), "/sys/class/tty/%s/device", base) < (int)sizeof(dir) &&
+            read_sysfs(dir, "latency_timer", value, sizeof(value)) && atoi(value) > 1 &&
+            snprintf(port->latency_timer, sizeof(port->latency_timer), "%s/latency_timer",
+                     dir) < (int)sizeof(port->latency_timer)) {
+            fd = fopen(port->latency_timer, "w");
+            if (fd && fprintf(fd, "1\n") > 0 && fclose(fd) == 0) {
+                port->saved_latency_timer = atoi(value);
+            } else {
+                if (fd)
+                    fclose(fd);
+                port->latency_timer[0] = 0;
+            }
+        }
+    }
+    if (trace_flag)
+        printf("# Low latency mode: flag %s, latency timer %s.\n",
+               port->low_latency ? "set" : "unchanged",
+               port->saved_latency_timer ? "1 msec" : "unchanged");
+}
+
+//
+// Restore the latency settings of the USB serial driver.
+//
+static void tty_restore_latency(serial_port_t *port)
+{
+    struct serial_struct ss;
+    FILE *fd;
+
+    if (port->saved_latency_timer) {
+        fd = fopen(port->latency_timer, "w");
+        if (fd) {
+            fprintf(fd, "%d\n", port->saved_latency_timer);
+            fclose(fd);
+        }
+    }
+    if (port->low_latency && ioctl(port->fd, TIOCGSERIAL, &ss) == 0) {
+        ss.flags = port->saved_serial_flags;
+        ioctl(port->fd, TIOCSSERIAL, &ss);
+    }
+}
+#endif
+
+//
+// Open tty device: set 9600 baud, 8 bits, no parity, raw mode.
+//
+static void tty_open(serial_port_t *port, const char *name)
+{
+    struct termios newtio;
+    int fd;
+
+    // Use non-block flag to ignore carrier (DCD).
+    fd = open(name, O_RDWR | O_NOCTTY | O_NONBLOCK);
+    if (fd < 0) {
+        perror(name);
+        exit(-1);
+    }
+
+    // Get terminal modes.
+    tcgetattr(fd, &port->oldtio);
+    newtio = port->oldtio;
+
+    newtio.c_cflag &= ~CSIZE;
+    newtio.c_cflag |= CS8;                             // 8 data bits
+    newtio.c_cflag |= CLOCAL | CREAD;                  // enable receiver, set local mode
+    newtio.c_cflag &= ~PARENB;                         // no parity
+    newtio.c_cflag &= ~CSTOPB;                         // 1 stop bit
+    newtio.c_cflag &= ~CRTSCTS;                        // no h/w handshake
+    newtio.c_lflag &= ~(ICANON | ECHO | ECHOE | ISIG); // raw input
+    newtio.c_oflag &= ~OPOST;                          // raw output
+    newtio.c_iflag &= ~IXON;                           // software flow control disabled
+    newtio.c_iflag &= ~ICRNL;                          // do not translate CR to NL
+
+    cfsetispeed(&newtio, B9600); // Set baud rate.
+    cfsetospeed(&newtio, B9600);
+
+    // Set terminal modes.
+    tcsetattr(fd, TCSANOW, &newtio);
+
+    // Clear the non-block flag.
+    int flags = fcntl(fd, F_GETFL, 0);
+    if (flags < 0) {
+        perror("F_GETFL");
+        exit(-1);
+    }
+    flags &= ~O_NONBLOCK;
+    if (fcntl(fd, F_SETFL, flags) < 0) {
+        perror("F_SETFL");
+        exit(-1);
+    }
+
+    // Flush received data pending on the port.
+    tcflush(fd, TCIFLUSH);
+    port->fd = fd;
+#ifdef __linux__
+    if (low_latency_flag)
+        tty_set_low_latency(port, name);
+#endif
+}
+
+//
+// Restore the mode and close tty device.
+//
+static void tty_close(serial_port_t *port)
+{
+#ifdef __linux__
+    tty_restore_latency(port);
+#endif
+    tcsetattr(port->fd, TCSANOW, &port->oldtio);
+    close(port->fd);
+}
+
+//
+// Purge received data of tty device.
+//
+static void tty_flush(serial_port_t *port)
+{
+    tcflush(port->fd, TCIFLUSH);
+}
+
+const serial_transport_t tty_transport = {
+    NULL, tty_open, tty_close, tty_flush, transport_fd_recv, transport_fd_send,
+};
+#endif
+
+//
+// Counters of ports not observed by a session.
+//
+static stats_t unobserved;
+
 //
 // Open the serial port.
 //
-int serial_open(const char *portname)
+serial_port_t *serial_open(const char *portname)
 {
+    serial_port_t *port = calloc(1, sizeof(serial_port_t));
+
+    if (!port) {
+        fprintf(stderr, "Out of memory.\n");
+        exit(-1);
+    }
+    port->stats = &unobserved;
 #ifdef MINGW32
     HANDLE fd;
     DCB new_mode;
@@ -120,13 +454,12 @@ int serial_open(const char *portname)
     }
 
     /* Set serial attributes */
-    memset(&saved_mode, 0, sizeof(saved_mode));
-    if (!GetCommState(fd, &saved_mode)) {
+    if (!GetCommState(fd, &port->saved_mode)) {
         fprintf(stderr, "%s: Cannot get state\n", portname);
         exit(-1);
     }
 
-    new_mode = saved_mode;
+    new_mode = port->saved_mode;
 
     new_mode.BaudRate      = CBR_9600;
     new_mode.ByteSize      = 8;
@@ -155,98 +488,184 @@ int serial_open(const char *portname)
 
     // Flush received data pending on the port.
     PurgeComm(fd, PURGE_RXCLEAR);
-    return (int)fd;
+    port->fd = fd;
+    return port;
 #else
-    int fd;
+    port->transport = transport_find(portname);
+    port->byte_usec = BYTE_USEC_9600;
+    port->transport->open(port, portname);
+    return port;
+#endif
+}
 
-    // Use non-block flag to ignore carrier (DCD).
-    fd = open(portname, O_RDWR | O_NOCTTY | O_NONBLOCK);
-    if (fd < 0) {
-        perror(portname);
-        exit(-1);
-    }
+//
+// Purge all received data.
+//
+void serial_flush(serial_port_t *port)
+{
+#ifdef MINGW32
+    PurgeComm(port->fd, PURGE_RXCLEAR);
+#else
+    if (port->transport->flush)
+        port->transport->flush(port);
+#endif
+}
 
-    // Get terminal modes.
-    tcgetattr(fd, &oldtio);
-    newtio = oldtio;
+//
+// Get a name which identifies the serial adapter, independent of
+// the order in which adapters were plugged in.
+//
+int serial_identity(const char *portname, char *buf, int size)
+{
+#ifdef MINGW32
+    return 0;
+#else
+    char real[PATH_MAX], path[PATH_MAX], dev[PATH_MAX], serial[128], vendor[16], product[16];
+    const char *name;
+    int level;
 
-    newtio.c_cflag &= ~CSIZE;
-    newtio.c_cflag |= CS8;                             // 8 data bits
-    newtio.c_cflag |= CLOCAL | CREAD;                  // enable receiver, set local mode
-    newtio.c_cflag &= ~PARENB;                         // no parity
-    newtio.c_cflag &= ~CSTOPB;                         // 1 stop bit
-    newtio.c_cflag &= ~CRTSCTS;                        // no h/w handshake
-    newtio.c_lflag &= ~(ICANON | ECHO | ECHOE | ISIG); // raw input
-    newtio.c_oflag &= ~OPOST;                          // raw output
-    newtio.c_iflag &= ~IXON;                           // software flow control disabled
-    newtio.c_iflag &= ~ICRNL;                          // do not translate CR to NL
+    // Follow symlinks like /dev/serial/by-id/...
+    if (!realpath(portname, real))
+        return 0;
+    name = strrchr(real, '/');
+    name = name ? name + 1 : real;
 
-    cfsetispeed(&newtio, B9600); // Set baud rate.
-    cfsetospeed(&newtio, B9600);
+    // Pseudo-terminals and other devices without hardware are not in sysfs.
+    if (snprintf(path, sizeof(path), "/sys/class/tty/%s/device", name) >= (int)sizeof(path) ||
+        !realpath(path, dev))
+        return 0;
 
-    // Set terminal modes.
-    tcsetattr(fd, TCSANOW, &newtio);
+    // Walk up to the USB device: it has vendor and product ids.
+    for (level = 0; level < 4; level++) {
+        char *slash;
+
+        if (read_sysfs(dev, "idVendor", vendor, sizeof(vendor)) &&
+            read_sysfs(dev, "idProduct", product, sizeof(product))) {
+            // Cheap adapters have no serial number:
+            // use the position on the USB bus instead.
+            if (!read_sysfs(dev, "serial", serial, sizeof(serial))) {
+                slash = strrchr(dev, '/');
+                if (snprintf(serial, sizeof(serial), "%s", slash ? slash + 1 : dev) >=
+                    (int)sizeof(serial))
+                    return 0;
+            }
+            snprintf(buf, size, "usb-%s:%s-%s", vendor, product, serial);
+            for (; *buf; buf++)
+                if (*buf == ' ' || *buf == '/')
+                    *buf = '_';
+            return 1;
+        }
+        slash = strrchr(dev, '/');
+        if (!slash || slash == dev)
+            break;
+        *slash = 0;
+    }
 
-    // Clear the non-block flag.
-    int flags = fcntl(fd, F_GETFL, 0);
-    if (flags < 0) {
-        perror("F_GETFL");
+    // Not USB: native serial port.
+    snprintf(buf, size, "%s", name);
+    return 1;
+#endif
+}
+
+#ifndef MINGW32
+//
+// Append a record to the capture.
+//
+static void capture_record(serial_port_t *port, int dir, const void *data, int len)
+{
+    unsigned usec = now_usec() - port->capture_start;
+    unsigned char hdr[7];
+
+    hdr[0] = usec;
+    hdr[1] = usec >> 8;
+    hdr[2] = usec >> 16;
+    hdr[3] = usec >> 24;
+    hdr[4] = dir;
+    hdr[5] = len;
+    hdr[6] = len >> 8;
+    if (fwrite(hdr, 1, sizeof(hdr), port->capture) != sizeof(hdr) ||
+        fwrite(data, 1, len, port->capture) != (size_t)len) {
+        perror("Capture");
         exit(-1);
     }
-    flags &= ~O_NONBLOCK;
-    if (fcntl(fd, F_SETFL, flags) < 0) {
-        perror("F_SETFL");
+}
+#endif
+
+//
+// Write all data sent and received to the capture file, with timestamps.
+//
+void serial_capture(serial_port_t *port, const char *filename)
+{
+#ifdef MINGW32
+    fprintf(stderr, "%s: Capture is not supported on Windows\n", filename);
+#else
+    port->capture = fopen(filename, "wb");
+    if (!port->capture) {
+        perror(filename);
         exit(-1);
     }
-
-    // Flush received data pending on the port.
-    tcflush(fd, TCIFLUSH);
-    return fd;
+    fputs(CAPTURE_MAGIC, port->capture);
+    port->capture_start = now_usec();
 #endif
 }
 
 //
-// Purge all received data.
+// Count serial i/o in the statistics of the session, and show it on the timeline.
 //
-void serial_flush(int fd)
+void serial_observe(serial_port_t *port, stats_t *stats, timeline_t *timeline, int tid)
 {
-#ifdef MINGW32
-    PurgeComm((HANDLE)fd, PURGE_RXCLEAR);
-#else
-    tcflush(fd, TCIFLUSH);
+    port->stats = stats;
+#ifndef MINGW32
+    port->timeline     = timeline;
+    port->timeline_tid = tid;
 #endif
 }
 
 //
 // Close the serial port.
 //
-void serial_close(int fd)
+void serial_close(serial_port_t *port)
 {
     // Restore the port mode.
 #ifdef MINGW32
-    SetCommState((HANDLE)fd, &saved_mode);
-    CloseHandle((HANDLE)fd);
+    SetCommState(port->fd, &port->saved_mode);
+    CloseHandle(port->fd);
 #else
-    tcsetattr(fd, TCSANOW, &oldtio);
-    close(fd);
+    if (port->capture)
+        fclose(port->capture);
+    port->transport->close(port);
 #endif
+    free(port);
 }
 
 //
 // Read data from serial port.
 // Return 0 when no data available.
-// Use 200-msec timeout.
+// Timeout is adapted to the latency of the radio, 200 msec at most.
+//
+int serial_read(serial_port_t *port, unsigned char *data, int len)
+{
+    return serial_read_kind(port, SERIAL_REPLY, data, len);
+}
+
+//
+// Read reply of given kind: SERIAL_REPLY or SERIAL_WRITE_ACK.
+// Every kind has its own estimate of latency.
 //
-int serial_read(int fd, unsigned char *data, int len)
+int serial_read_kind(serial_port_t *port, int kind, unsigned char *data, int len)
 {
+    port->stats->serial_reads++;
 #ifdef MINGW32
     DWORD nbytes;
     int len0 = len;
 
     for (;;) {
-        if (!ReadFile((HANDLE)fd, data, len, &nbytes, 0) || nbytes <= 0)
-            if (nbytes <= 0)
+        if (!ReadFile(port->fd, data, len, &nbytes, 0) || nbytes <= 0)
+            if (nbytes <= 0) {
+                port->stats->timeouts++;
                 return 0;
+            }
+        port->stats->bytes_read += nbytes;
 
         len -= nbytes;
         if (len <= 0)
@@ -255,33 +674,41 @@ int serial_read(int fd, unsigned char *data, int len)
         data += nbytes;
     }
 #else
-    fd_set rset, wset, xset;
+    serial_rtt_t *r = &port->rtt[kind];
     int nbytes, len0 = len;
+    long long first_time = 0;
+    int first_len        = 0;
+    long long t0         = timeline_now(port->timeline);
 
     for (;;) {
-        // Initialize file descriptor sets.
-        FD_ZERO(&rset);
-        FD_ZERO(&wset);
-        FD_ZERO(&xset);
-        FD_SET(fd, &rset);
-
-        // Set timeout to 100 msec.
-        struct timeval timo;
-        timo.tv_sec  = 0;
-        timo.tv_usec = 200000;
-
-        // Wait for input to become ready or until the time out.
-        if (select(fd + 1, &rset, &wset, &xset, &timo) != 1)
+        // Wait for the reply or for the next chunk of it.
+        // Command sent before is lost, when no reply.
+        int usec = (len == len0) ? reply_timeout(port, r) : gap_timeout(r);
+
+        nbytes = port->transport->recv(port, data, len, usec);
+        if (nbytes <= 0) {
+            port->tx_pending = 0;
+            r->backoff++;
+            port->stats->timeouts++;
+            PROBE2(read__timeout, len0, usec);
+            timeline_span(port->timeline, port->timeline_tid, "serial", t0, "read %d: timeout",
+                          len0);
             return 0;
-
-        nbytes = read(fd, (unsigned char *)data, len);
-        if (nbytes <= 0)
-            return 0;
-
+        }
+        port->stats->bytes_read += nbytes;
+        if (port->capture)
+            capture_record(port, CAPTURE_RX, data, nbytes);
+        long long now = now_usec();
+        if (len == len0) {
+            first_time = now;
+            first_len  = nbytes;
+        }
         len -= nbytes;
-        if (len <= 0)
+        if (len <= 0) {
+            update_timing(port, r, first_time, first_len, now, len0);
+            timeline_span(port->timeline, port->timeline_tid, "serial", t0, "read %d", len0);
             return len0;
-
+        }
         data += nbytes;
     }
 #endif
@@ -290,17 +717,23 @@ int serial_read(int fd, unsigned char *data, int len)
 //
 // Write data to serial port.
 //
-void serial_write(int fd, const void *data, int len)
+void serial_write(serial_port_t *port, const void *data, int len)
 {
+    port->stats->serial_writes++;
+    port->stats->bytes_written += len;
 #ifdef MINGW32
     DWORD count;
 
-    WriteFile((HANDLE)fd, data, len, &count, 0);
+    WriteFile(port->fd, data, len, &count, 0);
 #else
-    if (write(fd, data, len) != len) {
-        perror("Serial port");
-        exit(-1);
-    }
+    long long t0 = timeline_now(port->timeline);
+
+    port->transport->send(port, data, len);
+    if (port->capture)
+        capture_record(port, CAPTURE_TX, data, len);
+    port->write_time = now_usec();
+    port->tx_pending += len;
+    timeline_span(port->timeline, port->timeline_tid, "serial", t0, "write %d", len);
 #endif
 }
 
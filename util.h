@@ -28,6 +28,9 @@
 #include <stdio.h>
 #include <stdbool.h>
 
+#include "stats.h"
+#include "timeline.h"
+
 //
 // Localization.
 //
@@ -48,6 +51,12 @@
 //
 extern bool trace_flag;
 
+//
+// Request low latency mode of USB serial adapter, when opening the port.
+// Linux only: ASYNC_LOW_LATENCY flag and the latency timer of FTDI.
+//
+extern bool low_latency_flag;
+
 //
 // CTCSS tones, Hz*10.
 //
@@ -67,32 +76,70 @@ extern const int DCS_CODES[NDCS];
 //
 void print_hex(const unsigned char *data, int len);
 
+//
+// Serial port: handle and saved mode of the device.
+//
+typedef struct serial_port serial_port_t;
+
 //
 // Open the serial port.
 //
-int serial_open(const char *portname);
+serial_port_t *serial_open(const char *portname);
+
+//
+// Count serial i/o of the port in given statistics, and show it
+// on the track of the timeline (NULL for none).
+//
+void serial_observe(serial_port_t *port, stats_t *stats, timeline_t *timeline, int tid);
+
+//
+// Get a name which identifies the serial adapter, like
+// 'usb-067b:2303-A1B2C3' for USB, or 'ttyS0' for a native port.
+// Return 0 when unknown, for example for a pseudo-terminal.
+//
+int serial_identity(const char *portname, char *buf, int size);
+
+//
+// Write all data sent and received to the capture file, with timestamps.
+// Use port 'replay:filename' to play it back.
+//
+void serial_capture(serial_port_t *port, const char *filename);
 
 //
 // Close the serial port.
 //
-void serial_close(int fd);
+void serial_close(serial_port_t *port);
 
 //
 // Purge all received data.
 //
-void serial_flush(int fd);
+void serial_flush(serial_port_t *port);
+
+//
+// Kinds of replies, with separate estimates of latency:
+// radio acknowledges a write only after programming its memory.
+//
+#define SERIAL_REPLY     0 // Reply to a command: identifier, block read
+#define SERIAL_WRITE_ACK 1 // Acknowledge of block write
+#define SERIAL_NKINDS    2
 
 //
 // Read data from serial port.
 // Return 0 when no data available.
-// Use 200-msec timeout.
+// Timeout is adapted to the latency of the radio, 200 msec at most.
+//
+int serial_read(serial_port_t *port, unsigned char *data, int len);
+
+//
+// Read reply of given kind: SERIAL_REPLY or SERIAL_WRITE_ACK.
+// Timeout is doubled after every timeout in a row.
 //
-int serial_read(int fd, unsigned char *data, int len);
+int serial_read_kind(serial_port_t *port, int kind, unsigned char *data, int len);
 
 //
 // Write data to serial port.
 //
-void serial_write(int fd, const void *data, int len);
+void serial_write(serial_port_t *port, const void *data, int len);
 
 //
 // Delay in milliseconds.
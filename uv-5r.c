@@ -30,6 +30,7 @@
 #include <string.h>
 #include <unistd.h>
 
+#include "latency.h"
 #include "radio.h"
 #include "util.h"
 
@@ -66,27 +67,27 @@ static const char *OFF_ON[] = { "Off", "On" };
 //
 // Print a generic information about the device.
 //
-static void uv5r_print_version(FILE *out, int show_version)
+static void uv5r_print_version(radio_session_t *s, FILE *out, int show_version)
 {
     // Don't print firmware and serial number to file,
     // to prevent the user to copy them from one radio to another.
     if (show_version) {
         // Copy the string, trim spaces.
         char buf[17];
-        const char *version = trim_str((const char *)&radio_mem[0x1EC0 + 0x30], 14, buf);
+        const char *version = trim_str((const char *)&s->mem[0x1EC0 + 0x30], 14, buf);
 
         // 3+poweron message
         fprintf(out, "Firmware: %s\n", version);
 
         // Copy the string, trim spaces.
-        const char *serial = trim_str((const char *)&radio_mem[0x1EC0 + 0x10], 16, buf);
+        const char *serial = trim_str((const char *)&s->mem[0x1EC0 + 0x10], 16, buf);
 
         // 6+poweron message
         fprintf(out, "Serial: %.16s\n", serial);
     }
 }
 
-static void aged_print_version(FILE *out, int show_version)
+static void aged_print_version(radio_session_t *s, FILE *out, int show_version)
 {
     // Nothing to print.
 }
@@ -104,108 +105,123 @@ static int is_valid_frequency(int mhz)
 }
 
 //
-// Read block of data, up to 64 bytes.
-// Halt the program on any error.
+// Read block of data, 64 bytes or as calibrated.
+// Return 0 on any error.
+// BF-F8HP delays the acknowledge until the next command, so instead
+// of waiting for it, we pick it up from the reply of the next block.
 //
-static void read_block(int fd, int start, unsigned char *data, int nbytes)
+static int try_read_block(radio_session_t *s, int start, unsigned char *data, int nbytes)
 {
-    unsigned char cmd[4], reply[4];
-    int addr, len;
+    unsigned char reply[4];
+    int addr, len, got = 0;
 
     // Send command.
-    cmd[0] = 'S';
-    cmd[1] = start >> 8;
-    cmd[2] = start;
-    cmd[3] = nbytes;
-    serial_write(fd, cmd, 4);
+    radio_send_frame(s, 'S', start, NULL, nbytes);
 
-    // Read reply.
-    if (serial_read(fd, reply, 4) != 4) {
-        fprintf(stderr, "Radio refused to send block 0x%04x.\n", start);
-        exit(-1);
+    // Skip acknowledge of previous block, timed as such.
+    if (s->ack_pending) {
+        got = radio_read(s, LAT_READ_ACK, reply, 1);
+        if (got == 1 && reply[0] == 0x06)
+            got = 0;
     }
+    s->ack_pending = 0;
 
-    // On BF-F8HP, we may get acknowledge from previous block.
-    if (reply[0] == 0x06) {
-        reply[0] = reply[1];
-        reply[1] = reply[2];
-        reply[2] = reply[3];
-        if (serial_read(fd, &reply[3], 1) != 1) {
-            fprintf(stderr, "Radio refused to send block 0x%04x.\n", start);
-            exit(-1);
-        }
+    // Read reply.
+    if (got + radio_read(s, LAT_READ_HEADER, &reply[got], 4 - got) != 4) {
+        fprintf(stderr, "Radio refused to send block 0x%04x.\n", start);
+        return 0;
     }
 
     addr = reply[1] << 8 | reply[2];
     if (reply[0] != 'X' || addr != start || reply[3] != nbytes) {
         fprintf(stderr, "Bad reply for block 0x%04x of %d bytes: %02x-%02x-%02x-%02x\n", start,
                 nbytes, reply[0], reply[1], reply[2], reply[3]);
-        exit(-1);
+        return 0;
     }
 
     // Read data.
-    len = serial_read(fd, data, 0x40);
+    len = radio_read(s, LAT_READ_DATA, data, nbytes);
     if (len != nbytes) {
         fprintf(stderr, "Reading block 0x%04x: got only %d bytes.\n", start, len);
-        exit(-1);
+        return 0;
     }
 
-    // Get acknowledge.
-    // Note that on BF-F8HP acknowledge may be delayed until next command.
-    serial_write(fd, "\x06", 1);
-    if (serial_read(fd, reply, 1) == 1) {
-        if (reply[0] != 0x06) {
-            fprintf(stderr, "Bad acknowledge after block 0x%04x: %02x\n", start, reply[0]);
-            exit(-1);
-        }
-    }
+    // Confirm the block.
+    // Don't wait for acknowledge: it comes together with the next reply.
+    serial_write(s->port, "\x06", 1);
+    s->ack_pending = 1;
 
     if (trace_flag) {
         printf("# Read 0x%04x: ", start);
         print_hex(data, nbytes);
         printf("\n");
     } else {
-        ++radio_progress;
-        if (radio_progress % 2 == 0) {
+        ++s->progress;
+        if (s->progress % 2 == 0) {
             fprintf(stderr, "#");
             fflush(stderr);
         }
     }
+    return 1;
 }
 
 //
-// Write block of data, up to 16 bytes.
-// Halt the program on any error.
+// Get acknowledge of the last block read from memory range.
+// When it does not come in time, we have BF-F8HP,
+// which will send it before the reply to the next command.
+// On a bad acknowledge, the last block is read again.
+// Return 0 when the retries are exhausted.
 //
-static void write_block(int fd, int start, const unsigned char *data, int nbytes)
+static int read_finish(radio_session_t *s, int start, int end)
 {
-    unsigned char cmd[4], reply;
+    unsigned char reply;
+    int last, nbytes, retry = 0;
 
-    // Send command.
-    cmd[0] = 'X';
-    cmd[1] = start >> 8;
-    cmd[2] = start;
-    cmd[3] = nbytes;
-    serial_write(fd, cmd, 4);
-    serial_write(fd, data, nbytes);
+    // Find the last block of the range.
+    for (last = start; last + (nbytes = radio_block_size(s, 0, last, end)) < end; last += nbytes)
+        continue;
 
-    // Get acknowledge.
-    if (serial_read(fd, &reply, 1) != 1) {
-        fprintf(stderr, "No acknowledge after block 0x%04x.\n", start);
-        exit(-1);
-    }
-    if (reply != 0x06) {
-        fprintf(stderr, "Bad acknowledge after block 0x%04x: %02x\n", start, reply);
-        exit(-1);
+    while (s->ack_pending && radio_read(s, LAT_READ_ACK, &reply, 1) == 1) {
+        s->ack_pending = 0;
+        if (reply == 0x06)
+            break;
+        fprintf(stderr, "Bad acknowledge after block 0x%04x: %02x\n", last, reply);
+
+        // Reply to the block ends with a new acknowledge.
+        do {
+            if (!radio_retry(s, last, retry++))
+                return 0;
+        } while (!try_read_block(s, last, &s->mem[last], nbytes));
     }
+    return 1;
+}
+
+//
+// Read the block with firmware version and serial number.
+//
+static int uv5r_identify(radio_session_t *s, char *firmware, char *serial)
+{
+    char buf[17];
+
+    if (!radio_read_block(s, 0x1EC0, &s->mem[0x1EC0], 0x40) || !read_finish(s, 0x1EC0, 0x1F00))
+        return 0;
+    strcpy(firmware, trim_str((const char *)&s->mem[0x1EC0 + 0x30], 14, buf));
+    strcpy(serial, trim_str((const char *)&s->mem[0x1EC0 + 0x10], 16, buf));
+    return 1;
+}
 
+//
+// Report the block written.
+//
+static void write_done(radio_session_t *s, int start, const unsigned char *data, int nbytes)
+{
     if (trace_flag) {
         printf("# Write 0x%04x: ", start);
         print_hex(data, nbytes);
         printf("\n");
     } else {
-        ++radio_progress;
-        if (radio_progress % 8 == 0) {
+        ++s->progress;
+        if (s->progress % 8 == 0) {
             fprintf(stderr, "#");
             fflush(stderr);
         }
@@ -213,53 +229,151 @@ static void write_block(int fd, int start, const unsigned char *data, int nbytes
 }
 
 //
-// Read memory image from the device.
+// Write block of data, 16 bytes or as calibrated, up to MAX_BLOCK.
+// The radio replies with one byte of acknowledge for any size.
+// Return 0 on any error.
 //
-static void uv5r_download()
+static int try_write_block(radio_session_t *s, int start, const unsigned char *data, int nbytes)
 {
-    int addr;
+    unsigned char reply;
+
+    radio_send_frame(s, 'X', start, data, nbytes);
+
+    // Skip delayed acknowledge of the last block read.
+    // On retry, it's already gone with the rest of the line.
+    if (s->ack_pending) {
+        s->ack_pending = 0;
+        if (radio_read(s, LAT_READ_ACK, &reply, 1) != 1 || reply != 0x06) {
+            fprintf(stderr, "No acknowledge after last block read.\n");
+            return 0;
+        }
+    }
+
+    // Get acknowledge.
+    if (radio_read(s, LAT_WRITE_ACK, &reply, 1) != 1) {
+        fprintf(stderr, "No acknowledge after block 0x%04x.\n", start);
+        return 0;
+    }
+    if (reply != 0x06) {
+        fprintf(stderr, "Bad acknowledge after block 0x%04x: %02x\n", start, reply);
+        return 0;
+    }
+    write_done(s, start, data, nbytes);
+    return 1;
+}
 
-    // Main block.
-    for (addr = 0; addr < 0x1800; addr += 0x40)
-        read_block(radio_port, addr, &radio_mem[addr], 0x40);
+//
+// Read memory range in blocks of 64 bytes, or as calibrated.
+// Return 0 when a block failed.
+//
+static int read_range(radio_session_t *s, int start, int end)
+{
+    int addr, nbytes;
 
-    // Auxiliary block starts at 0x1EC0.
-    for (addr = 0x1EC0; addr < 0x2000; addr += 0x40)
-        read_block(radio_port, addr, &radio_mem[addr], 0x40);
+    for (addr = start; addr < end; addr += nbytes) {
+        nbytes = radio_block_size(s, 0, addr, end);
+        if (!radio_read_block(s, addr, &s->mem[addr], nbytes))
+            return 0;
+    }
+    return 1;
 }
 
-static void aged_download()
+//
+// Read memory image from the device.
+//
+static int uv5r_download(radio_session_t *s)
 {
-    int addr;
+    // Main block, then auxiliary block at 0x1EC0.
+    return read_range(s, 0, 0x1800) && read_range(s, 0x1EC0, 0x2000) &&
+           read_finish(s, 0x1EC0, 0x2000);
+}
 
+static int aged_download(radio_session_t *s)
+{
     // Main block only.
-    for (addr = 0; addr < 0x1800; addr += 0x40)
-        read_block(radio_port, addr, &radio_mem[addr], 0x40);
+    return read_range(s, 0, 0x1800) && read_finish(s, 0, 0x1800);
 }
 
 //
-// Write memory image to the device.
+// Write memory range in blocks of 16 bytes, or as calibrated.
+// With window above 1, up to that many frames are sent before
+// waiting for the acknowledge of the first one.  On a lost or bad
+// acknowledge, the blocks not yet acknowledged are written again
+// in stop-and-wait mode, which is used for the rest of the session.
+// Return 0 when a block failed.
 //
-static void uv5r_upload(int cont_flag)
+static int write_range(radio_session_t *s, int start, int end)
 {
-    int addr;
+    int queue[MAX_WINDOW];      // Blocks sent, not acknowledged yet
+    int size[MAX_WINDOW];       // Length of every block
+    long long sent[MAX_WINDOW]; // Start time of every block
+    int head = 0, count = 0, addr = start, oldest, nbytes, i;
+    unsigned char reply;
+
+    while (addr < end || count > 0) {
+        if (addr < end && count < s->window) {
+            nbytes = radio_block_size(s, 1, addr, end);
+            if (!radio_block_dirty(s, addr, nbytes) ||
+                radio_journal_done(s, addr, NULL, nbytes)) {
+                addr += nbytes;
+                continue;
+            }
+            if (s->window == 1 || s->ack_pending) {
+                // Stop-and-wait, or the first block after download.
+                if (!radio_write_block(s, addr, &s->mem[addr], nbytes))
+                    return 0;
+                addr += nbytes;
+                continue;
+            }
+
+            // Send next frame without waiting.
+            i        = (head + count++) % MAX_WINDOW;
+            queue[i] = addr;
+            size[i]  = nbytes;
+            sent[i]  = radio_block_start(s, "write", addr, nbytes);
+            radio_send_frame(s, 'X', addr, &s->mem[addr], nbytes);
+            addr += nbytes;
+            continue;
+        }
 
-    // Main block.
-    for (addr = 0; addr < 0x1800; addr += 0x10)
-        write_block(radio_port, addr, &radio_mem[addr], 0x10);
+        // Wait for acknowledge of the oldest frame.
+        oldest = queue[head];
+        nbytes = size[head];
+        if (radio_read(s, LAT_WRITE_ACK, &reply, 1) == 1 && reply == 0x06) {
+            write_done(s, oldest, &s->mem[oldest], nbytes);
+            radio_journal_add(s, oldest, &s->mem[oldest], nbytes);
+            radio_block_done(s, "write", sent[head], oldest, nbytes);
+            head = (head + 1) % MAX_WINDOW;
+            count--;
+            continue;
+        }
 
-    // Auxiliary block starts at 0x1EC0.
-    for (addr = 0x1EC0; addr < 0x2000; addr += 0x10)
-        write_block(radio_port, addr, &radio_mem[addr], 0x10);
+        // Radio did not keep up: write the rest one by one.
+        fprintf(stderr, "\nNo acknowledge for block 0x%04x in window of %d, "
+                        "fall back to stop-and-wait.\n", oldest, s->window);
+        s->window = 1;
+        if (!radio_retry(s, oldest, 0))
+            return 0;
+        for (; count > 0; count--, head = (head + 1) % MAX_WINDOW)
+            if (!radio_write_block(s, queue[head], &s->mem[queue[head]], size[head]))
+                return 0;
+    }
+    return 1;
 }
 
-static void aged_upload()
+//
+// Write memory image to the device.
+//
+static int uv5r_upload(radio_session_t *s, int cont_flag)
 {
-    int addr;
+    // Main block, then auxiliary block at 0x1EC0.
+    return write_range(s, 0, 0x1800) && write_range(s, 0x1EC0, 0x2000);
+}
 
+static int aged_upload(radio_session_t *s, int cont_flag)
+{
     // Main block only.
-    for (addr = 0; addr < 0x1800; addr += 0x10)
-        write_block(radio_port, addr, &radio_mem[addr], 0x10);
+    return write_range(s, 0, 0x1800);
 }
 
 static void decode_squelch(uint16_t index, int *ctcs, int *dcs)
@@ -351,11 +465,11 @@ typedef struct {
     uint8_t _u4 : 1;
 } memory_channel_t;
 
-static void decode_channel(int i, char *name, int *rx_hz, int *tx_hz, int *rx_ctcs, int *tx_ctcs,
-                           int *rx_dcs, int *tx_dcs, int *lowpower, int *wide, int *scan, int *bcl,
-                           int *pttid, int *scode)
+static void decode_channel(radio_session_t *s, int i, char *name, int *rx_hz, int *tx_hz,
+                           int *rx_ctcs, int *tx_ctcs, int *rx_dcs, int *tx_dcs, int *lowpower,
+                           int *wide, int *scan, int *bcl, int *pttid, int *scode)
 {
-    memory_channel_t *ch = i + (memory_channel_t *)radio_mem;
+    memory_channel_t *ch = i + (memory_channel_t *)s->mem;
 
     *rx_hz = *tx_hz = *rx_ctcs = *tx_ctcs = *rx_dcs = *tx_dcs = 0;
     *name                                                     = 0;
@@ -364,7 +478,7 @@ static void decode_channel(int i, char *name, int *rx_hz, int *tx_hz, int *rx_ct
 
     // Extract channel name; strip trailing FF's.
     char *p;
-    strncpy(name, (char *)&radio_mem[0x1000 + i * 16], 7);
+    strncpy(name, (char *)&s->mem[0x1000 + i * 16], 7);
     name[7] = 0;
     for (p = name + 6; p >= name && *p == '\xff'; p--)
         *p = 0;
@@ -407,9 +521,9 @@ static int encode_char(int c)
 //
 // Set a name for the channel.
 //
-static void encode_name(int i, char *name)
+static void encode_name(radio_session_t *s, int i, char *name)
 {
-    unsigned char *data = &radio_mem[0x1000 + i * 16];
+    unsigned char *data = &s->mem[0x1000 + i * 16];
     int n;
 
     if (name && *name && *name != '-') {
@@ -426,10 +540,11 @@ static void encode_name(int i, char *name)
     }
 }
 
-static void setup_channel(int i, char *name, double rx_mhz, double tx_mhz, int rq, int tq,
-                          int lowpower, int wide, int scan, int bcl, int scode, int pttid)
+static void setup_channel(radio_session_t *s, int i, char *name, double rx_mhz, double tx_mhz,
+                          int rq, int tq, int lowpower, int wide, int scan, int bcl, int scode,
+                          int pttid)
 {
-    memory_channel_t *ch = i + (memory_channel_t *)radio_mem;
+    memory_channel_t *ch = i + (memory_channel_t *)s->mem;
 
     ch->rxfreq = int_to_bcd(iround(rx_mhz * 100000.0));
 
@@ -455,16 +570,16 @@ static void setup_channel(int i, char *name, double rx_mhz, double tx_mhz, int r
     ch->_u4      = 0;
     ch->_u5      = 0;
 
-    encode_name(i, name);
+    encode_name(s, i, name);
 }
 
-static void erase_channel(int i)
+static void erase_channel(radio_session_t *s, int i)
 {
-    memory_channel_t *ch = i + (memory_channel_t *)radio_mem;
+    memory_channel_t *ch = i + (memory_channel_t *)s->mem;
 
     // Erase channel name.
     memset(ch, 0xff, 16);
-    memset(&radio_mem[0x1000 + i * 16], 0xff, 7);
+    memset(&s->mem[0x1000 + i * 16], 0xff, 7);
 }
 
 typedef struct {
@@ -479,11 +594,11 @@ typedef struct {
 // Looks like limits are not implemented on old firmware
 // (prior to version 291).
 //
-static void decode_limits(char band, int *enable, int *lower, int *upper)
+static void decode_limits(radio_session_t *s, char band, int *enable, int *lower, int *upper)
 {
     int offset = (band == 'V') ? 0x1EC0 + 0x100 : 0x1EC0 + 0x105;
 
-    limits_t *limits = (limits_t *)(radio_mem + offset);
+    limits_t *limits = (limits_t *)(s->mem + offset);
     *enable          = limits->enable;
     *lower           = ((limits->lower_msb >> 4) & 15) * 1000 + (limits->lower_msb & 15) * 100 +
              ((limits->lower_lsb >> 4) & 15) * 10 + (limits->lower_lsb & 15);
@@ -491,11 +606,11 @@ static void decode_limits(char band, int *enable, int *lower, int *upper)
              ((limits->upper_lsb >> 4) & 15) * 10 + (limits->upper_lsb & 15);
 }
 
-static void setup_limits(char band, int enable, int lower, int upper)
+static void setup_limits(radio_session_t *s, char band, int enable, int lower, int upper)
 {
     int offset = (band == 'V') ? 0x1EC0 + 0x100 : 0x1EC0 + 0x105;
 
-    limits_t *limits = (limits_t *)(radio_mem + offset);
+    limits_t *limits = (limits_t *)(s->mem + offset);
     limits->enable   = enable;
 
     limits->lower_msb = ((lower / 1000) % 10) << 4 | ((lower / 100) % 10);
@@ -504,15 +619,15 @@ static void setup_limits(char band, int enable, int lower, int upper)
     limits->upper_lsb = ((upper / 10) % 10) << 4 | (upper % 10);
 }
 
-static void fetch_ani(char *ani)
+static void fetch_ani(radio_session_t *s, char *ani)
 {
     int i;
 
     for (i = 0; i < 5; i++)
-        ani[i] = "0123456789ABCDEF"[radio_mem[0x0CAA + i] & 0x0f];
+        ani[i] = "0123456789ABCDEF"[s->mem[0x0CAA + i] & 0x0f];
 }
 
-static void setup_ani(char *ani)
+static void setup_ani(radio_session_t *s, char *ani)
 {
     int i, v;
 
@@ -529,7 +644,7 @@ static void setup_ani(char *ani)
         else
             v = 0;
 
-        radio_mem[0x0CAA + i] = v;
+        s->mem[0x0CAA + i] = v;
     }
 }
 
@@ -554,10 +669,11 @@ typedef struct {
     uint8_t lowpower : 1;
 } vfo_t;
 
-void uv5r_decode_vfo(int index, int *band, int *hz, int *offset, int *rx_ctcs, int *tx_ctcs,
-                     int *rx_dcs, int *tx_dcs, int *lowpower, int *wide, int *step, int *scode)
+void uv5r_decode_vfo(radio_session_t *s, int index, int *band, int *hz, int *offset, int *rx_ctcs,
+                     int *tx_ctcs, int *rx_dcs, int *tx_dcs, int *lowpower, int *wide, int *step,
+                     int *scode)
 {
-    vfo_t *vfo = (vfo_t *)&radio_mem[index ? 0x0F28 : 0x0F08];
+    vfo_t *vfo = (vfo_t *)&s->mem[index ? 0x0F28 : 0x0F08];
 
     *band = *hz = *offset = *rx_ctcs = *tx_ctcs = *rx_dcs = *tx_dcs = 0;
     *lowpower = *wide = *step = *scode = 0;
@@ -577,10 +693,10 @@ void uv5r_decode_vfo(int index, int *band, int *hz, int *offset, int *rx_ctcs, i
     *scode    = vfo->scode;
 }
 
-void uv5r_setup_vfo(int index, int band, double rx_mhz, double tx_offset_mhz, int rxtone, int txtone, int step,
-                    int lowpower, int wide, int scode)
+void uv5r_setup_vfo(radio_session_t *s, int index, int band, double rx_mhz, double tx_offset_mhz,
+                    int rxtone, int txtone, int step, int lowpower, int wide, int scode)
 {
-    vfo_t *vfo = (vfo_t *)&radio_mem[index ? 0x0F28 : 0x0F08];
+    vfo_t *vfo = (vfo_t *)&s->mem[index ? 0x0F28 : 0x0F08];
 
     unsigned hz     = iround(rx_mhz * 1000000.0);
     unsigned offset = iround(tx_offset_mhz * 1000000.0);
@@ -716,7 +832,7 @@ typedef struct {
 //
 // Print full information about the device configuration.
 //
-static void print_config(FILE *out, int verbose, int is_aged)
+static void print_config(radio_session_t *s, FILE *out, int verbose, int is_aged)
 {
     int i;
 
@@ -726,7 +842,7 @@ static void print_config(FILE *out, int verbose, int is_aged)
         fprintf(out, "# Display this message on power-on.\n");
         fprintf(out, "# 14 characters split into two lines of 7 symbols each.\n");
     }
-    fprintf(out, "Message: %.14s\n", &radio_mem[0x1EC0 + 0x20]);
+    fprintf(out, "Message: %.14s\n", &s->mem[0x1EC0 + 0x20]);
 
     // Print memory channels.
     fprintf(out, "\n");
@@ -754,7 +870,7 @@ static void print_config(FILE *out, int verbose, int is_aged)
         int lowpower, wide, scan, bcl, pttid, scode;
         char name[17];
 
-        decode_channel(i, name, &rx_hz, &tx_hz, &rx_ctcs, &tx_ctcs, &rx_dcs, &tx_dcs, &lowpower,
+        decode_channel(s, i, name, &rx_hz, &tx_hz, &rx_ctcs, &tx_ctcs, &rx_dcs, &tx_dcs, &lowpower,
                        &wide, &scan, &bcl, &pttid, &scode);
         if (rx_hz == 0) {
             // Channel is disabled
@@ -805,21 +921,21 @@ static void print_config(FILE *out, int verbose, int is_aged)
         fprintf(out, "# 10) Last (6-th) character of ANI code, or '-'\n");
         fprintf(out, "#\n");
     }
-    uv5r_decode_vfo(0, &band, &hz, &offset, &rx_ctcs, &tx_ctcs, &rx_dcs, &tx_dcs, &lowpower, &wide,
-                    &step, &scode);
+    uv5r_decode_vfo(s, 0, &band, &hz, &offset, &rx_ctcs, &tx_ctcs, &rx_dcs, &tx_dcs, &lowpower,
+                    &wide, &step, &scode);
     fprintf(out, "VFO Band Receive  TxOffset R-Squel T-Squel Step Power FM     Scode\n");
     print_vfo(out, 'A', band, hz, offset, rx_ctcs, tx_ctcs, rx_dcs, tx_dcs, lowpower, wide, step,
               scode);
-    uv5r_decode_vfo(1, &band, &hz, &offset, &rx_ctcs, &tx_ctcs, &rx_dcs, &tx_dcs, &lowpower, &wide,
-                    &step, &scode);
+    uv5r_decode_vfo(s, 1, &band, &hz, &offset, &rx_ctcs, &tx_ctcs, &rx_dcs, &tx_dcs, &lowpower,
+                    &wide, &step, &scode);
     print_vfo(out, 'B', band, hz, offset, rx_ctcs, tx_ctcs, rx_dcs, tx_dcs, lowpower, wide, step,
               scode);
 
     if (!is_aged) {
         // Print band limits.
         int vhf_enable, vhf_lower, vhf_upper, uhf_enable, uhf_lower, uhf_upper;
-        decode_limits('V', &vhf_enable, &vhf_lower, &vhf_upper);
-        decode_limits('U', &uhf_enable, &uhf_lower, &uhf_upper);
+        decode_limits(s, 'V', &vhf_enable, &vhf_lower, &vhf_upper);
+        decode_limits(s, 'U', &uhf_enable, &uhf_lower, &uhf_upper);
         fprintf(out, "\n");
         if (verbose) {
             fprintf(out, "# Table of band limits.\n");
@@ -836,10 +952,10 @@ static void print_config(FILE *out, int verbose, int is_aged)
 
     // Get atomatic number identifier.
     char ani[5];
-    fetch_ani(ani);
+    fetch_ani(s, ani);
 
     // Print other settings.
-    settings_t *mode = (settings_t *)&radio_mem[0x0E20];
+    settings_t *mode = (settings_t *)&s->mem[0x0E20];
     fprintf(out, "\n");
 
     if (verbose) {
@@ -962,42 +1078,42 @@ static void print_config(FILE *out, int verbose, int is_aged)
 //
 // Print full information about the device configuration.
 //
-static void uv5r_print_config(FILE *out, int verbose)
+static void uv5r_print_config(radio_session_t *s, FILE *out, int verbose)
 {
-    print_config(out, verbose, 0);
+    print_config(s, out, verbose, 0);
 }
 
-static void aged_print_config(FILE *out, int verbose)
+static void aged_print_config(radio_session_t *s, FILE *out, int verbose)
 {
-    print_config(out, verbose, 1);
+    print_config(s, out, verbose, 1);
 }
 
 //
 // Read memory image from the binary file.
 //
-static void uv5r_read_image(FILE *img, unsigned char *ident)
+static void uv5r_read_image(radio_session_t *s, FILE *img, unsigned char *ident)
 {
     if (fread(ident, 1, 8, img) != 8) {
         fprintf(stderr, "Error reading image header.\n");
         exit(-1);
     }
-    if (fread(&radio_mem[0], 1, 0x1800, img) != 0x1800) {
+    if (fread(&s->mem[0], 1, 0x1800, img) != 0x1800) {
         fprintf(stderr, "Error reading image data.\n");
         exit(-1);
     }
-    if (fread(&radio_mem[0x1EC0], 1, 0x2000 - 0x1EC0, img) != 0x2000 - 0x1EC0) {
+    if (fread(&s->mem[0x1EC0], 1, 0x2000 - 0x1EC0, img) != 0x2000 - 0x1EC0) {
         fprintf(stderr, "Error reading image footer.\n");
         exit(-1);
     }
 }
 
-static void aged_read_image(FILE *img, unsigned char *ident)
+static void aged_read_image(radio_session_t *s, FILE *img, unsigned char *ident)
 {
     if (fread(ident, 1, 8, img) != 8) {
         fprintf(stderr, "Error reading image header.\n");
         exit(-1);
     }
-    if (fread(&radio_mem[0], 1, 0x1800, img) != 0x1800) {
+    if (fread(&s->mem[0], 1, 0x1800, img) != 0x1800) {
         fprintf(stderr, "Error reading image data.\n");
         exit(-1);
     }
@@ -1006,25 +1122,25 @@ static void aged_read_image(FILE *img, unsigned char *ident)
 //
 // Save memory image to the binary file.
 //
-static void uv5r_save_image(FILE *img)
+static void uv5r_save_image(radio_session_t *s, FILE *img)
 {
-    fwrite(radio_ident, 1, 8, img);
-    fwrite(&radio_mem[0], 1, 0x1800, img);
-    fwrite(&radio_mem[0x1EC0], 1, 0x2000 - 0x1EC0, img);
+    fwrite(s->ident, 1, 8, img);
+    fwrite(&s->mem[0], 1, 0x1800, img);
+    fwrite(&s->mem[0x1EC0], 1, 0x2000 - 0x1EC0, img);
 }
 
-static void aged_save_image(FILE *img)
+static void aged_save_image(radio_session_t *s, FILE *img)
 {
-    fwrite(radio_ident, 1, 8, img);
-    fwrite(&radio_mem[0], 1, 0x1800, img);
+    fwrite(s->ident, 1, 8, img);
+    fwrite(&s->mem[0], 1, 0x1800, img);
 }
 
 //
 // Read the configuration from text file, and modify the image.
 //
-static void parse_parameter(char *param, char *value, int is_aged)
+static void parse_parameter(radio_session_t *s, char *param, char *value, int is_aged)
 {
-    settings_t *mode = (settings_t *)&radio_mem[0x0E20];
+    settings_t *mode = (settings_t *)&s->mem[0x0E20];
     int i;
 
     if (strcasecmp("Radio", param) == 0) {
@@ -1038,7 +1154,7 @@ static void parse_parameter(char *param, char *value, int is_aged)
     if (!is_aged) {
         // Only new firmware has power-on messages.
         if (strcasecmp("Serial", param) == 0) {
-            copy_str(&radio_mem[0x1EC0 + 0x10], value, 14);
+            copy_str(&s->mem[0x1EC0 + 0x10], value, 14);
             return;
         }
         if (strcasecmp("Firmware", param) == 0) {
@@ -1047,7 +1163,7 @@ static void parse_parameter(char *param, char *value, int is_aged)
             return;
         }
         if (strcasecmp("Message", param) == 0) {
-            copy_str(&radio_mem[0x1EC0 + 0x20], value, 14);
+            copy_str(&s->mem[0x1EC0 + 0x20], value, 14);
             return;
         }
     }
@@ -1093,7 +1209,7 @@ static void parse_parameter(char *param, char *value, int is_aged)
             fprintf(stderr, "Five hex digits expected.\n");
             goto bad;
         }
-        setup_ani(value);
+        setup_ani(s, value);
         return;
     }
     if (strcasecmp("DTMF Sidetone", param) == 0) {
@@ -1184,21 +1300,21 @@ static void parse_parameter(char *param, char *value, int is_aged)
     exit(-1);
 }
 
-static void uv5r_parse_parameter(char *param, char *value)
+static void uv5r_parse_parameter(radio_session_t *s, char *param, char *value)
 {
-    parse_parameter(param, value, 0);
+    parse_parameter(s, param, value, 0);
 }
 
-static void aged_parse_parameter(char *param, char *value)
+static void aged_parse_parameter(radio_session_t *s, char *param, char *value)
 {
-    parse_parameter(param, value, 1);
+    parse_parameter(s, param, value, 1);
 }
 
 //
 // Parse table header.
 // Return table id, or 0 in case of error.
 //
-static int uv5r_parse_header(char *line)
+static int uv5r_parse_header(radio_session_t *s, char *line)
 {
     if (strncasecmp(line, "Channel", 7) == 0)
         return 'C';
@@ -1216,7 +1332,7 @@ static int uv5r_parse_header(char *line)
 //     0   WR6ABD  442.9000 +5       162.2   162.2   High  Wide   +    -   -   -
 //    93   K6GL    145.1700 -0.600    94.8    94.8   High  Wide   +    -   -   -
 //
-static int parse_channel(int first_row, char *line)
+static int parse_channel(radio_session_t *s, int first_row, char *line)
 {
     char num_str[256], name_str[256], rxfreq_str[256], offset_str[256];
     char rq_str[256], tq_str[256], power_str[256], wide_str[256];
@@ -1308,10 +1424,10 @@ static int parse_channel(int first_row, char *line)
         // On first entry, erase the channel table.
         int i;
         for (i = 0; i < NCHAN; i++) {
-            erase_channel(i);
+            erase_channel(s, i);
         }
     }
-    setup_channel(num, name_str, rx_mhz, rx_mhz + txoff_mhz, rq, tq, lowpower, wide, scan, bcl,
+    setup_channel(s, num, name_str, rx_mhz, rx_mhz + txoff_mhz, rq, tq, lowpower, wide, scan, bcl,
                   scode, pttid);
     return 1;
 }
@@ -1322,7 +1438,7 @@ static int parse_channel(int first_row, char *line)
 //  A  UHF  443.9300  0          -       -    2.5  High  Wide   -
 //  B  VHF  145.2300 +6          -       -    5.0  High  Wide   -
 //
-static int parse_vfo(int first_row, char *line)
+static int parse_vfo(radio_session_t *s, int first_row, char *line)
 {
     char num_str[256], band_str[256], rxfreq_str[256], offset_str[256];
     char rq_str[256], tq_str[256], step_str[256];
@@ -1400,7 +1516,7 @@ static int parse_vfo(int first_row, char *line)
         return 0;
     }
 
-    uv5r_setup_vfo(num, band, rx_mhz, txoff_mhz, rq, tq, step, lowpower, wide, scode);
+    uv5r_setup_vfo(s, num, band, rx_mhz, txoff_mhz, rq, tq, step, lowpower, wide, scode);
     return 1;
 }
 
@@ -1410,7 +1526,7 @@ static int parse_vfo(int first_row, char *line)
 //  VHF   136   174  +
 //  UHF   400   520  +
 //
-static int parse_limit(int first_row, char *line)
+static int parse_limit(radio_session_t *s, int first_row, char *line)
 {
     char band_str[256], lower_str[256], upper_str[256], enable_str[256];
     int lower, upper, enable;
@@ -1430,9 +1546,9 @@ static int parse_limit(int first_row, char *line)
     }
 
     if (strcasecmp("VHF", band_str) == 0) {
-        setup_limits('V', enable, lower, upper);
+        setup_limits(s, 'V', enable, lower, upper);
     } else if (strcasecmp("UHF", band_str) == 0) {
-        setup_limits('U', enable, lower, upper);
+        setup_limits(s, 'U', enable, lower, upper);
     } else {
         fprintf(stderr, "Unknown band.\n");
         return 0;
@@ -1440,15 +1556,15 @@ static int parse_limit(int first_row, char *line)
     return 1;
 }
 
-static int uv5r_parse_row(int table_id, int first_row, char *line)
+static int uv5r_parse_row(radio_session_t *s, int table_id, int first_row, char *line)
 {
     switch (table_id) {
     case 'C':
-        return parse_channel(first_row, line);
+        return parse_channel(s, first_row, line);
     case 'V':
-        return parse_vfo(first_row, line);
+        return parse_vfo(s, first_row, line);
     case 'L':
-        return parse_limit(first_row, line);
+        return parse_limit(s, first_row, line);
     }
     return 0;
 }
@@ -1456,17 +1572,18 @@ static int uv5r_parse_row(int table_id, int first_row, char *line)
 //
 // Set VFO mode with given frequency.
 //
-static void uv5r_set_vfo(int vfo_index, double freq_mhz)
+static int uv5r_set_vfo(radio_session_t *s, int vfo_index, double freq_mhz)
 {
     // Read current VFO settings.
-    read_block(radio_port, 0x0E40, &radio_mem[0x0E40], 0x40);
-    read_block(radio_port, 0x0F00, &radio_mem[0x0F00], 0x40);
+    if (!radio_read_block(s, 0x0E40, &s->mem[0x0E40], 0x40) ||
+        !radio_read_block(s, 0x0F00, &s->mem[0x0F00], 0x40) || !read_finish(s, 0x0F00, 0x0F40))
+        return 0;
 
     // Get existing settings.
     int band, hz, offset, rx_ctcs, tx_ctcs, rx_dcs, tx_dcs;
     int lowpower, wide, step, scode;
-    uv5r_decode_vfo(vfo_index, &band, &hz, &offset, &rx_ctcs, &tx_ctcs, &rx_dcs, &tx_dcs, &lowpower,
-                    &wide, &step, &scode);
+    uv5r_decode_vfo(s, vfo_index, &band, &hz, &offset, &rx_ctcs, &tx_ctcs, &rx_dcs, &tx_dcs,
+                    &lowpower, &wide, &step, &scode);
 
     // Print old settings for debug.
     //printf("VFO Band Receive  TxOffset R-Squel T-Squel Step Power FM     Scode\n");
@@ -1475,28 +1592,31 @@ static void uv5r_set_vfo(int vfo_index, double freq_mhz)
 
     // Modify VFO settings.
     band = (freq_mhz > 200) ? 'U' : 'V';
-    uv5r_setup_vfo(vfo_index, band, freq_mhz, 0.0, 0, 0, step, lowpower, wide, scode);
+    uv5r_setup_vfo(s, vfo_index, band, freq_mhz, 0.0, 0, 0, step, lowpower, wide, scode);
 
     // Print new settings.
-    uv5r_decode_vfo(vfo_index, &band, &hz, &offset, &rx_ctcs, &tx_ctcs, &rx_dcs, &tx_dcs, &lowpower,
-                    &wide, &step, &scode);
+    uv5r_decode_vfo(s, vfo_index, &band, &hz, &offset, &rx_ctcs, &tx_ctcs, &rx_dcs, &tx_dcs,
+                    &lowpower, &wide, &step, &scode);
     printf("VFO Band Receive  TxOffset R-Squel T-Squel Step Power FM     Scode\n");
     print_vfo(stdout, 'A' + vfo_index, band, hz, offset, rx_ctcs, tx_ctcs, rx_dcs, tx_dcs,
               lowpower, wide, step, scode);
 
     // Switch to VFO mode, select channel A or B.
     if (vfo_index == 0) {
-        radio_mem[0x0E4A] &= ~0x80; // select VFO channel A
+        s->mem[0x0E4A] &= ~0x80; // select VFO channel A
     } else {
-        radio_mem[0x0E4A] |= 0x80;  // select VFO channel B
+        s->mem[0x0E4A] |= 0x80;  // select VFO channel B
     }
-    radio_mem[0x0E4C] = 0; // set VFO mode
+    s->mem[0x0E4C] = 0; // set VFO mode
 
     // Apply new settings.
-    write_block(radio_port, 0x0E40, &radio_mem[0x0E40], 0x10);
+    if (!radio_write_block(s, 0x0E40, &s->mem[0x0E40], 0x10))
+        return 0;
     for (unsigned addr = 0x0F00; addr < 0x0F40; addr += 0x10) {
-        write_block(radio_port, addr, &radio_mem[addr], 0x10);
+        if (!radio_write_block(s, addr, &s->mem[addr], 0x10))
+            return 0;
     }
+    return 1;
 }
 
 //
@@ -1505,7 +1625,8 @@ static void uv5r_set_vfo(int vfo_index, double freq_mhz)
 radio_device_t radio_uv5r = {
     "Baofeng UV-5R",    uv5r_download,     uv5r_upload,          uv5r_read_image,   uv5r_save_image,
     uv5r_print_version, uv5r_print_config, uv5r_parse_parameter, uv5r_parse_header, uv5r_parse_row,
-    uv5r_set_vfo,
+    uv5r_set_vfo,       try_read_block,    try_write_block,      0x40,              0x10,
+    0,                  uv5r_identify,     0x1EC0 + 0x10,
 };
 
 //
@@ -1516,4 +1637,6 @@ radio_device_t radio_uv5r_aged = {
     aged_save_image,      aged_print_version, aged_print_config, aged_parse_parameter,
     uv5r_parse_header, // Use the same routines
     uv5r_parse_row,    // for tables
+    NULL,              // No VFO mode
+    try_read_block,     try_write_block,    0x40,              0x10,                 0,
 };
@@ -30,6 +30,7 @@
 #include <string.h>
 #include <unistd.h>
 
+#include "latency.h"
 #include "radio.h"
 #include "util.h"
 
@@ -59,93 +60,85 @@ static const char *OFF_ON[] = { "Off", "On" };
 //
 // Print a generic information about the device.
 //
-static void uvb5_print_version(FILE *out, int show_version)
+static void uvb5_print_version(radio_session_t *s, FILE *out, int show_version)
 {
     // Nothing to print.
 }
 
 //
-// Read block of data, up to 16 bytes.
-// Halt the program on any error.
+// Read block of data, 16 bytes or as calibrated.
+// Return 0 on any error.
 //
-static void read_block(int fd, int start, unsigned char *data, int nbytes)
+static int try_read_block(radio_session_t *s, int start, unsigned char *data, int nbytes)
 {
-    unsigned char cmd[4], reply[4];
+    unsigned char reply[4];
     int addr, len;
 
     // Send command.
-    cmd[0] = 'R';
-    cmd[1] = start >> 8;
-    cmd[2] = start;
-    cmd[3] = nbytes;
-    serial_write(fd, cmd, 4);
+    radio_send_frame(s, 'R', start, NULL, nbytes);
 
     // Read reply.
-    if (serial_read(fd, reply, 4) != 4) {
+    if (radio_read(s, LAT_READ_HEADER, reply, 4) != 4) {
         fprintf(stderr, "Radio refused to send block 0x%04x.\n", start);
-        exit(-1);
+        return 0;
     }
     addr = reply[1] << 8 | reply[2];
     if (reply[0] != 'W' || addr != start || reply[3] != nbytes) {
         fprintf(stderr, "Bad reply for block 0x%04x of %d bytes: %02x-%02x-%02x-%02x\n", start,
                 nbytes, reply[0], reply[1], reply[2], reply[3]);
-        exit(-1);
+        return 0;
     }
 
     // Read data.
-    len = serial_read(fd, data, 0x10);
+    len = radio_read(s, LAT_READ_DATA, data, nbytes);
     if (len != nbytes) {
         fprintf(stderr, "Reading block 0x%04x: got only %d bytes.\n", start, len);
-        exit(-1);
+        return 0;
     }
 
     // Get acknowledge.
-    serial_write(fd, "\x06", 1);
-    if (serial_read(fd, reply, 1) != 1) {
+    serial_write(s->port, "\x06", 1);
+    if (radio_read(s, LAT_READ_ACK, reply, 1) != 1) {
         fprintf(stderr, "No acknowledge after block 0x%04x.\n", start);
-        exit(-1);
+        return 0;
     }
     if (reply[0] != 0x74 && reply[0] != 0x78 && reply[0] != 0x1f) {
         fprintf(stderr, "Bad acknowledge after block 0x%04x: %02x\n", start, reply[0]);
-        exit(-1);
+        return 0;
     }
     if (trace_flag) {
         printf("# Read 0x%04x: ", start);
         print_hex(data, nbytes);
         printf("\n");
     } else {
-        ++radio_progress;
-        if (radio_progress % 8 == 0) {
+        ++s->progress;
+        if (s->progress % 8 == 0) {
             fprintf(stderr, "#");
             fflush(stderr);
         }
     }
+    return 1;
 }
 
 //
-// Write block of data, up to 16 bytes.
-// Halt the program on any error.
+// Write block of data, 16 bytes or as calibrated.
+// Return 0 on any error.
 //
-static void write_block(int fd, int start, const unsigned char *data, int nbytes)
+static int try_write_block(radio_session_t *s, int start, const unsigned char *data, int nbytes)
 {
-    unsigned char cmd[4], reply;
+    unsigned char reply;
 
-    // Send command.
-    cmd[0] = 'W';
-    cmd[1] = start >> 8;
-    cmd[2] = start;
-    cmd[3] = nbytes;
-    serial_write(fd, cmd, 4);
-    serial_write(fd, data, nbytes);
+    // Send command and data in one write: one USB transfer.
+    radio_send_frame(s, 'W', start, data, nbytes);
 
     // Get acknowledge.
-    if (serial_read(fd, &reply, 1) != 1) {
+    if (radio_read(s, LAT_WRITE_ACK, &reply, 1) != 1) {
         fprintf(stderr, "No acknowledge after block 0x%04x.\n", start);
-        exit(-1);
+        return 0;
     }
     if (reply != 0x06) {
         fprintf(stderr, "Bad acknowledge after block 0x%04x: %02x\n", start, reply);
-        exit(-1);
+        return 0;
     }
 
     if (trace_flag) {
@@ -153,34 +146,43 @@ static void write_block(int fd, int start, const unsigned char *data, int nbytes
         print_hex(data, nbytes);
         printf("\n");
     } else {
-        ++radio_progress;
-        if (radio_progress % 8 == 0) {
+        ++s->progress;
+        if (s->progress % 8 == 0) {
             fprintf(stderr, "#");
             fflush(stderr);
         }
     }
+    return 1;
 }
 
 //
 // Read memory image from the device.
 //
-static void uvb5_download()
+static int uvb5_download(radio_session_t *s)
 {
-    int addr;
+    int addr, nbytes;
 
-    for (addr = 0; addr < 0x1000; addr += 0x10)
-        read_block(radio_port, addr, &radio_mem[addr], 0x10);
+    for (addr = 0; addr < 0x1000; addr += nbytes) {
+        nbytes = radio_block_size(s, 0, addr, 0x1000);
+        if (!radio_read_block(s, addr, &s->mem[addr], nbytes))
+            return 0;
+    }
+    return 1;
 }
 
 //
 // Write memory image to the device.
 //
-static void uvb5_upload(int cont_flag)
+static int uvb5_upload(radio_session_t *s, int cont_flag)
 {
-    int addr;
+    int addr, nbytes;
 
-    for (addr = 0; addr < 0x1000; addr += 0x10)
-        write_block(radio_port, addr, &radio_mem[addr], 0x10);
+    for (addr = 0; addr < 0x1000; addr += nbytes) {
+        nbytes = radio_block_size(s, 1, addr, 0x1000);
+        if (radio_block_dirty(s, addr, nbytes) && !radio_write_block(s, addr, &s->mem[addr], nbytes))
+            return 0;
+    }
+    return 1;
 }
 
 //
@@ -289,11 +291,12 @@ typedef struct {
     uint8_t _u2[4];
 } memory_channel_t;
 
-static void decode_channel(int i, char *name, int *rx_hz, int *txoff_hz, int *rx_ctcs, int *tx_ctcs,
-                           int *rx_dcs, int *tx_dcs, int *step, int *lowpower, int *wide, int *scan,
-                           int *pttid, int *bcl, int *compander, int *revfreq)
+static void decode_channel(radio_session_t *s, int i, char *name, int *rx_hz, int *txoff_hz,
+                           int *rx_ctcs, int *tx_ctcs, int *rx_dcs, int *tx_dcs, int *step,
+                           int *lowpower, int *wide, int *scan, int *pttid, int *bcl,
+                           int *compander, int *revfreq)
 {
-    memory_channel_t *ch = i + (memory_channel_t *)radio_mem;
+    memory_channel_t *ch = i + (memory_channel_t *)s->mem;
 
     *rx_hz = *txoff_hz = *rx_ctcs = *tx_ctcs = *rx_dcs = *tx_dcs = 0;
     *lowpower = *wide = *scan = *pttid = *bcl = *compander = 0;
@@ -305,7 +308,7 @@ static void decode_channel(int i, char *name, int *rx_hz, int *txoff_hz, int *rx
 
     // Extract channel name; strip trailing FF's.
     if (name && i >= 1 && i <= NCHAN) {
-        unsigned char *p = (unsigned char *)&radio_mem[0x0A00 + (i - 1) * 5];
+        unsigned char *p = (unsigned char *)&s->mem[0x0A00 + (i - 1) * 5];
         int n;
         for (n = 0; n < 5; n++) {
             name[n] = (*p < 42) ? CHARSET[*p++] : 0;
@@ -337,11 +340,12 @@ static void decode_channel(int i, char *name, int *rx_hz, int *txoff_hz, int *rx
     *revfreq   = ch->revfreq;
 }
 
-static void setup_channel(int chan_num, char *name, double rx_mhz, double txoff_mhz, int rq, int tq,
-                          int rpol, int tpol, int step, int lowpower, int wide, int scan, int pttid,
-                          int bcl, int compander, int revfreq)
+static void setup_channel(radio_session_t *s, int chan_num, char *name, double rx_mhz,
+                          double txoff_mhz, int rq, int tq, int rpol, int tpol, int step,
+                          int lowpower, int wide, int scan, int pttid, int bcl, int compander,
+                          int revfreq)
 {
-    memory_channel_t *ch = chan_num + (memory_channel_t *)radio_mem;
+    memory_channel_t *ch = chan_num + (memory_channel_t *)s->mem;
 
     // Compute offset direction.
     if (txoff_mhz < 0) {
@@ -370,7 +374,7 @@ static void setup_channel(int chan_num, char *name, double rx_mhz, double txoff_
     ch->_u2[0] = ch->_u2[1] = ch->_u2[2] = ch->_u2[3] = 0;
 
     // Encode channel name.
-    uint8_t *dest = &radio_mem[0x0A00 + (chan_num - 1) * 5];
+    uint8_t *dest = &s->mem[0x0A00 + (chan_num - 1) * 5];
     int i;
     memset(dest, 0xff, 5);
     for (i = 0; i < 5 && *name; i++) {
@@ -387,13 +391,13 @@ static void setup_channel(int chan_num, char *name, double rx_mhz, double txoff_
     }
 }
 
-static void erase_channel(int i)
+static void erase_channel(radio_session_t *s, int i)
 {
-    memory_channel_t *ch = i + (memory_channel_t *)radio_mem;
+    memory_channel_t *ch = i + (memory_channel_t *)s->mem;
 
     // Erase channel name.
     memset(ch, 0xff, 16);
-    memset(&radio_mem[0x0A00 + (i - 1) * 5], 0xff, 5);
+    memset(&s->mem[0x0A00 + (i - 1) * 5], 0xff, 5);
 }
 
 typedef struct {
@@ -407,21 +411,21 @@ typedef struct {
 // Looks like limits are not implemented on old firmware
 // (prior to version 291).
 //
-static void decode_limits(char band, int *lower, int *upper)
+static void decode_limits(radio_session_t *s, char band, int *lower, int *upper)
 {
     int offset = (band == 'V') ? 0xF00 : 0xF04;
 
-    limits_t *limits = (limits_t *)(radio_mem + offset);
+    limits_t *limits = (limits_t *)(s->mem + offset);
     *lower           = ((limits->lower_msb >> 4) & 15) * 1000 + (limits->lower_msb & 15) * 100 +
              ((limits->lower_lsb >> 4) & 15) * 10 + (limits->lower_lsb & 15);
     *upper = ((limits->upper_msb >> 4) & 15) * 1000 + (limits->upper_msb & 15) * 100 +
              ((limits->upper_lsb >> 4) & 15) * 10 + (limits->upper_lsb & 15);
 }
 
-static void setup_limits(char band, double lower_mhz, double upper_mhz)
+static void setup_limits(radio_session_t *s, char band, double lower_mhz, double upper_mhz)
 {
     int offset       = (band == 'V') ? 0xF00 : 0xF04;
-    limits_t *limits = (limits_t *)(radio_mem + offset);
+    limits_t *limits = (limits_t *)(s->mem + offset);
     int lower        = lower_mhz * 10 + 0.5;
     int upper        = upper_mhz * 10 + 0.5;
 
@@ -431,15 +435,15 @@ static void setup_limits(char band, double lower_mhz, double upper_mhz)
     limits->upper_lsb = ((upper / 10) % 10) << 4 | (upper % 10);
 }
 
-static void fetch_ani(char *ani)
+static void fetch_ani(radio_session_t *s, char *ani)
 {
     int i;
 
     for (i = 0; i < 6; i++)
-        ani[i] = "0123456789ABCDEF"[radio_mem[0x0D20 + i] & 0x0f];
+        ani[i] = "0123456789ABCDEF"[s->mem[0x0D20 + i] & 0x0f];
 }
 
-static void setup_ani(char *ani)
+static void setup_ani(radio_session_t *s, char *ani)
 {
     int i, v;
 
@@ -456,7 +460,7 @@ static void setup_ani(char *ani)
         else
             v = 0;
 
-        radio_mem[0x0D20 + i] = v;
+        s->mem[0x0D20 + i] = v;
     }
 }
 
@@ -545,7 +549,7 @@ typedef struct {
 //
 // Print full information about the device configuration.
 //
-static void uvb5_print_config(FILE *out, int verbose)
+static void uvb5_print_config(radio_session_t *s, FILE *out, int verbose)
 {
     int i;
 
@@ -576,7 +580,7 @@ static void uvb5_print_config(FILE *out, int verbose)
         int bcl, compander, revfreq;
         char name[17];
 
-        decode_channel(i, name, &rx_hz, &txoff_hz, &rx_ctcs, &tx_ctcs, &rx_dcs, &tx_dcs, &step,
+        decode_channel(s, i, name, &rx_hz, &txoff_hz, &rx_ctcs, &tx_ctcs, &rx_dcs, &tx_dcs, &step,
                        &lowpower, &wide, &scan, &pttid, &bcl, &compander, &revfreq);
 
         if (rx_hz == 0) {
@@ -621,20 +625,20 @@ static void uvb5_print_config(FILE *out, int verbose)
         fprintf(out, "#\n");
     }
 
-    decode_channel(0, 0, &hz, &offset, &rx_ctcs, &tx_ctcs, &rx_dcs, &tx_dcs, &step, &lowpower,
+    decode_channel(s, 0, 0, &hz, &offset, &rx_ctcs, &tx_ctcs, &rx_dcs, &tx_dcs, &step, &lowpower,
                    &wide, &scan, &pttid, &bcl, &compander, &revfreq);
     fprintf(out, "VFO Receive  TxOffset Rx-Sq Tx-Sq Step Power FM   PTTID BCL Rev Compand\n");
     print_vfo(out, 'A', hz, offset, rx_ctcs, tx_ctcs, rx_dcs, tx_dcs, step, lowpower, wide, pttid,
               bcl, revfreq, compander);
-    decode_channel(130, 0, &hz, &offset, &rx_ctcs, &tx_ctcs, &rx_dcs, &tx_dcs, &step, &lowpower,
+    decode_channel(s, 130, 0, &hz, &offset, &rx_ctcs, &tx_ctcs, &rx_dcs, &tx_dcs, &step, &lowpower,
                    &wide, &scan, &pttid, &bcl, &compander, &revfreq);
     print_vfo(out, 'B', hz, offset, rx_ctcs, tx_ctcs, rx_dcs, tx_dcs, step, lowpower, wide, pttid,
               bcl, revfreq, compander);
 
     // Print band limits.
     int vhf_lower, vhf_upper, uhf_lower, uhf_upper;
-    decode_limits('V', &vhf_lower, &vhf_upper);
-    decode_limits('U', &uhf_lower, &uhf_upper);
+    decode_limits(s, 'V', &vhf_lower, &vhf_upper);
+    decode_limits(s, 'U', &uhf_lower, &uhf_upper);
     fprintf(out, "\n");
     if (verbose) {
         fprintf(out, "# Table of band limits.\n");
@@ -648,7 +652,7 @@ static void uvb5_print_config(FILE *out, int verbose)
     fprintf(out, " UHF  %5.1f  %5.1f\n", uhf_lower / 10.0, uhf_upper / 10.0);
 
     // Broadcast FM.
-    fm_t *fm = (fm_t *)&radio_mem[0x09A0];
+    fm_t *fm = (fm_t *)&s->mem[0x09A0];
     fprintf(out, "\n");
     if (verbose) {
         fprintf(out, "# Table of FM radio channels.\n");
@@ -665,10 +669,10 @@ static void uvb5_print_config(FILE *out, int verbose)
 
     // Get atomatic number identifier.
     char ani[6];
-    fetch_ani(ani);
+    fetch_ani(s, ani);
 
     // Print other settings.
-    settings_t *mode = (settings_t *)&radio_mem[0x0D00];
+    settings_t *mode = (settings_t *)&s->mem[0x0D00];
     fprintf(out, "\n");
     if (verbose) {
         fprintf(out, "# Mute the speaker when a received signal is below this level.\n");
@@ -765,7 +769,7 @@ static void uvb5_print_config(FILE *out, int verbose)
 //
 // Read memory image from the binary file.
 //
-static void uvb5_read_image(FILE *img, unsigned char *ident)
+static void uvb5_read_image(radio_session_t *s, FILE *img, unsigned char *ident)
 {
     char buf[40];
 
@@ -778,7 +782,7 @@ static void uvb5_read_image(FILE *img, unsigned char *ident)
         fprintf(stderr, "Error reading header.\n");
         exit(-1);
     }
-    if (fread(&radio_mem[0], 1, 0x1000, img) != 0x1000) {
+    if (fread(&s->mem[0], 1, 0x1000, img) != 0x1000) {
         fprintf(stderr, "Error reading image data.\n");
         exit(-1);
     }
@@ -788,16 +792,16 @@ static void uvb5_read_image(FILE *img, unsigned char *ident)
 // Save memory image to the binary file.
 // Try to be compatible with Chirp.
 //
-static void uvb5_save_image(FILE *img)
+static void uvb5_save_image(radio_session_t *s, FILE *img)
 {
-    fwrite(radio_ident, 1, 8, img);
+    fwrite(s->ident, 1, 8, img);
     fwrite("Radio Program data v1.08\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0", 1, 40, img);
-    fwrite(&radio_mem[0], 1, 0x1000, img);
+    fwrite(&s->mem[0], 1, 0x1000, img);
 }
 
-static void uvb5_parse_parameter(char *param, char *value)
+static void uvb5_parse_parameter(radio_session_t *s, char *param, char *value)
 {
-    settings_t *mode = (settings_t *)&radio_mem[0x0E20];
+    settings_t *mode = (settings_t *)&s->mem[0x0E20];
     int i;
 
     if (strcasecmp("Radio", param) == 0) {
@@ -856,7 +860,7 @@ static void uvb5_parse_parameter(char *param, char *value)
             fprintf(stderr, "Six hex digits expected.\n");
             goto bad;
         }
-        setup_ani(value);
+        setup_ani(s, value);
         return;
     }
     if (strcasecmp("DTMF Sidetone", param) == 0) {
@@ -925,7 +929,7 @@ static int is_valid_frequency(int mhz)
 //     2   TWO   453.2250  0        91.5  91.5 High  Wide   -    -    -   -    -
 //    13   -     465.5250  0       D703I D703I High  Wide   -    -    -   -    -
 //
-static int parse_channel(int first_row, char *line)
+static int parse_channel(radio_session_t *s, int first_row, char *line)
 {
     char num_str[256], name[256], rxfreq_str[256], offset_str[256];
     char rq_str[256], tq_str[256], power_str[256], wide_str[256];
@@ -1024,13 +1028,13 @@ static int parse_channel(int first_row, char *line)
         // On first entry, erase the channel table.
         int i;
         for (i = 0; i < NCHAN; i++) {
-            erase_channel(i);
+            erase_channel(s, i);
         }
     }
     if (name[0] == '-')
         name[0] = 0;
-    setup_channel(num, name, rx_mhz, txoff_mhz, rq, tq, rpol, tpol, 0, lowpower, wide, scan, pttid,
-                  bcl, compand, rev);
+    setup_channel(s, num, name, rx_mhz, txoff_mhz, rq, tq, rpol, tpol, 0, lowpower, wide, scan,
+                  pttid, bcl, compand, rev);
     return 1;
 }
 
@@ -1040,7 +1044,7 @@ static int parse_channel(int first_row, char *line)
 //  A  443.0750  0          -     -  25.0 High  Wide   -    -   -    -
 //  B  145.2300  0          -     -  5.0  High  Wide   -    -   -    -
 //
-static int parse_vfo(int first_row, char *line)
+static int parse_vfo(radio_session_t *s, int first_row, char *line)
 {
     char num_str[256], rxfreq_str[256], offset_str[256];
     char rq_str[256], tq_str[256], step_str[256];
@@ -1134,7 +1138,7 @@ static int parse_vfo(int first_row, char *line)
         return 0;
     }
 
-    setup_channel(num, "", rx_mhz, txoff_mhz, rq, tq, rpol, tpol, step, lowpower, wide, 0, pttid,
+    setup_channel(s, num, "", rx_mhz, txoff_mhz, rq, tq, rpol, tpol, step, lowpower, wide, 0, pttid,
                   bcl, compand, rev);
     return 1;
 }
@@ -1145,7 +1149,7 @@ static int parse_vfo(int first_row, char *line)
 //  VHF  136.0  174.0
 //  UHF  400.0  480.0
 //
-static int parse_limit(int first_row, char *line)
+static int parse_limit(radio_session_t *s, int first_row, char *line)
 {
     char band_str[256];
     double lower, upper;
@@ -1154,9 +1158,9 @@ static int parse_limit(int first_row, char *line)
         return 0;
 
     if (strcasecmp("VHF", band_str) == 0) {
-        setup_limits('V', lower, upper);
+        setup_limits(s, 'V', lower, upper);
     } else if (strcasecmp("UHF", band_str) == 0) {
-        setup_limits('U', lower, upper);
+        setup_limits(s, 'U', lower, upper);
     } else {
         fprintf(stderr, "Unknown band.\n");
         return 0;
@@ -1170,9 +1174,9 @@ static int parse_limit(int first_row, char *line)
 //  1    91.5
 //  10  100.9
 //
-static int parse_fm(int first_row, char *line)
+static int parse_fm(radio_session_t *s, int first_row, char *line)
 {
-    fm_t *fm = (fm_t *)&radio_mem[0x09A0];
+    fm_t *fm = (fm_t *)&s->mem[0x09A0];
     int num, freq;
     double mhz;
 
@@ -1195,7 +1199,7 @@ static int parse_fm(int first_row, char *line)
     return 1;
 }
 
-static int uvb5_parse_header(char *line)
+static int uvb5_parse_header(radio_session_t *s, char *line)
 {
     if (strncasecmp(line, "Channel", 7) == 0)
         return 'C';
@@ -1208,17 +1212,17 @@ static int uvb5_parse_header(char *line)
     return 0;
 }
 
-static int uvb5_parse_row(int table_id, int first_row, char *line)
+static int uvb5_parse_row(radio_session_t *s, int table_id, int first_row, char *line)
 {
     switch (table_id) {
     case 'C':
-        return parse_channel(first_row, line);
+        return parse_channel(s, first_row, line);
     case 'V':
-        return parse_vfo(first_row, line);
+        return parse_vfo(s, first_row, line);
     case 'L':
-        return parse_limit(first_row, line);
+        return parse_limit(s, first_row, line);
     case 'F':
-        return parse_fm(first_row, line);
+        return parse_fm(s, first_row, line);
     }
     return 0;
 }
@@ -1229,4 +1233,6 @@ static int uvb5_parse_row(int table_id, int first_row, char *line)
 radio_device_t radio_uvb5 = {
     "Baofeng UV-B5",    uvb5_download,     uvb5_upload,          uvb5_read_image,   uvb5_save_image,
     uvb5_print_version, uvb5_print_config, uvb5_parse_parameter, uvb5_parse_header, uvb5_parse_row,
+    NULL,               try_read_block,    try_write_block,      0x10,              0x10,
+    0,
 };